@@ -1,9 +1,23 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <sqlite3.h>
 
+#include "common.h"
+#include "crc32c.h"
+#include "filesrc.h"
+#include "iotrace.h"
+#include "outvfs.h"
+
 static int varint_size(
     sqlite3_int64 val)
 {
@@ -28,6 +42,30 @@ static int varint_size(
     return 9;
 }
 
+/*
+  Size of an integer column in a record body.
+*/
+
+static int int_size(
+    sqlite3_int64 val)
+{
+    if (val==0 || val==1)
+        return 0;
+    if (val<0)
+        val=~val;
+    if (val<0x80)
+        return 1;
+    if (val<0x8000)
+        return 2;
+    if (val<0x800000)
+        return 3;
+    if (val<0x80000000)
+        return 4;
+    if (val<0x800000000000)
+        return 6;
+    return 8;
+}
+
 /*
   payload size for a single row of a table like:
 
@@ -92,23 +130,204 @@ static space blob_space(
     return result;
 }
 
+/*
+  The fragment catalog.  Splits, fragments and pages are stored as
+  parallel arrays, all carved out of a single arena sized by the
+  counting pass in generate_frags.  There can't be more pages than
+  fragments, so the page arrays are sized by the fragment count too.
+
+  Splits are in output id order, and split_src tells which source
+  each one comes from.  A split's fragments are consecutive,
+  starting at first_frag; split_frags is 0 for NULL blobs and for
+  duplicates, which refer to the split they duplicate through same_as.
+
+  Pages are numbered from 1.  A page_id of 0 marks a fragment that
+  was merged back into its head.
+
+  split_heat, allocated separately, holds the access weight of each
+  split from the --hot-ids file, with the weight of a duplicate added
+  to the split it refers to.
+
+  Output fragment ids start after id_base, which is 0 unless there is
+  a previous release to keep fragments of, and end by id_max; cell
+  sizes are worked out with id_max as the rowid.  split_kept, also
+  allocated separately, marks the splits whose fragments are kept from
+  the previous release, with final_id holding their ids there.
+
+  With tail packing, small fragments are bundled into shared rows.
+  row_lead is the fragment that stands for the row in packing and
+  ordering, row_next links the row's fragments in order, ending with
+  -1, and row_offset is each one's offset in the row.  Only the lead
+  gets a page; the others get its final id.  These arrays are only
+  carved out of the arena with tail packing, and NULL otherwise.
+*/
+
+typedef struct catalog {
+    sqlite3_int64 split_cnt;
+    sqlite3_int64 frag_cnt;
+    sqlite3_int64 page_cnt;
+    sqlite3_int64 final_cnt;
+
+    sqlite3_int64 null_cnt;
+    sqlite3_int64 dup_cnt;
+    sqlite3_int64 subset_a_cnt;
+    sqlite3_int64 subset_b_cnt;
+    sqlite3_int64 unsplit_cnt;
+    sqlite3_int64 saved_cnt;
+    sqlite3_int64 kept_cnt;
+    sqlite3_int64 bundled_cnt;
+    sqlite3_int64 bundle_cnt;
+
+    sqlite3_int64 split_max;
+    sqlite3_int64 frag_max;
+    sqlite3_int64 id_base;
+    sqlite3_int64 id_max;
+    sqlite3_uint64 arena_size;
+
+    sqlite3_int64 *split_id;
+    sqlite3_int64 *first_frag;
+    sqlite3_int64 *same_as;
+    unsigned int *split_src;
+    unsigned char *split_frags;
+    unsigned char *split_seen;
+
+    sqlite3_int64 *offset;
+    sqlite3_int64 *size;
+    unsigned int *cell_size;
+    sqlite3_int64 *split_no;
+    sqlite3_int64 *page_id;
+    sqlite3_int64 *final_id;
+    sqlite3_int64 *frag_order;
+    unsigned int *crc;
+
+    unsigned int *page_space;
+    unsigned int *page_frags;
+    sqlite3_int64 *page_link;
+    sqlite3_int64 *page_order;
+    unsigned char *page_seen;
+    sqlite3_int64 *page_in;
+    sqlite3_int64 *page_out;
+    double *split_heat;
+    unsigned char *split_kept;
+
+    sqlite3_int64 *row_lead;
+    sqlite3_int64 *row_next;
+    sqlite3_int64 *row_offset;
+
+    void *arena;
+} catalog;
+
+/*
+  A source is read either through a database connection or as files.
+  A database source may also be a packed database, to be repacked;
+  layouts has its SOURCE_ bits, and finds a statement that looks up
+  a blob's fragments.
+
+  A file's id is its entry number plus 1, unless numbers has the
+  file source's entries in id order; see number_files.
+*/
+
+typedef struct file_number {
+    sqlite3_int64 id;
+    sqlite3_int64 entry_no;
+} file_number;
+
+#define SOURCE_PACKED 1
+#define SOURCE_IMPLICIT 2
+#define SOURCE_SLICED 4
+#define SOURCE_NAMED 8
+
+typedef struct sources {
+    sqlite3 **dbs;
+    filesrc **files;
+    int *layouts;
+    sqlite3_stmt **finds;
+    file_number **numbers;
+} sources;
+
+/*
+  The previous release, with --previous.  kept has a bit for each of
+  its fragment ids, set for the fragments the new output keeps, and
+  gone lists the ids of its blobs that aren't packed any more.
+*/
+
+typedef struct previous {
+    sqlite3 *db;
+    sqlite3_int64 file_size;
+    unsigned char *kept;
+    sqlite3_int64 *gone;
+    sqlite3_int64 gone_cnt;
+} previous;
+
 typedef struct globals {
     unsigned int page_size;
+    int dedup;
+    int implicit_splits;
+    int adaptive_splits;
+    int tail_packing;
+    unsigned int shard_cnt;
+    sqlite3_int64 max_output_size;
+    sqlite3_int64 memory_limit;
+    int dry_run;
+    int checkpoint;
+    int resume;
+    int no_journal;
+    int trace_io;
 
-    char const *src_path;
+    char const **src_paths;
+    int src_cnt;
+    sqlite3_int64 id_shift;
     char const *dst_path;
+    char *tmp_path;
+    char const *hot_path;
+    char const *prev_path;
+
+    int shard_no;
+    sqlite3_int64 lo_id;
+    sqlite3_int64 hi_id;
 
     sqlite3 *db;
+    int in_memory;
+    sources srcs;
+    previous prev;
+
+    catalog cat;
 } globals;
 
 static globals const default_globals =
 {
     0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
 
     NULL,
+    0,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+
+    -1,
+    -9223372036854775807-1,
+    9223372036854775807,
+
     NULL,
+    0,
+    {NULL,NULL,NULL,NULL,NULL},
+    {NULL,0,NULL,NULL,0},
 
-    NULL
+    {0}
 };
 
 /*
@@ -121,606 +340,4317 @@ static globals const default_globals =
 static char const oom_msg[] =
     "Out of memory or something\n";
 
+static void progress(
+    globals const *g,
+    char const *msg)
+{
+    if (g->shard_no>=0) {
+        fprintf(stderr,"Shard %d: %s",g->shard_no,msg);
+    } else {
+        fputs(msg,stderr);
+    }
+}
+
 /*
-  Create the destination database;
-  attach the source database using the identifier "source";
-  set the page size;
-  start a transaction.
+  A database without a blobs table may be a packed one, in either
+  split layout and with or without tail packing.  Its blobs are listed
+  with sizes taken from the lengths of their fragments, which doesn't
+  read the fragments themselves.  A shard manifest is rejected; its
+  shards can be given as sources instead, since their ids don't overlap.
 */
 
-static int open_db(
-    globals *g)
+static int source_layout(
+    globals *g,
+    sources *s,
+    int src_no)
 {
-    sqlite3 *db=NULL;
-    sqlite3_stmt *attach=NULL;
-    char *set_page_size_sql=NULL;
-    char *errmsg=NULL;
-    int status;
+    sqlite3 *db=s->dbs[src_no];
+    sqlite3_stmt *query=NULL;
+    char *find_sql;
+    int layout,status;
 
-    status=sqlite3_open_v2(
-        g->dst_path,&db,SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,NULL);
+    status=sqlite3_prepare_v2(
+        db,source_layout_sql,sizeof source_layout_sql,&query,NULL);
     if (status!=SQLITE_OK) {
-        if (db) {
-            fprintf(stderr,"%s: sqlite3_open: %s\n",
-                    g->dst_path,sqlite3_errmsg(db));
-        } else {
-            fprintf(stderr,"%s: sqlite3_open: %s\n",
-                    g->dst_path,sqlite3_errstr(status));
-        }
+        fprintf(stderr,"%s: sqlite3_prepare(source_layout): %s\n",
+                g->src_paths[src_no],sqlite3_errmsg(db));
         return -1;
     }
+    status=sqlite3_step(query);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"%s: sqlite3_step(source_layout): %s\n",
+                g->src_paths[src_no],sqlite3_errmsg(db));
+        return -1;
+    }
+    layout=0;
+    if (!sqlite3_column_int(query,0)) {
+        if (sqlite3_column_int(query,1))
+            layout=SOURCE_PACKED;
+        if (sqlite3_column_int(query,2))
+            layout=SOURCE_PACKED | SOURCE_IMPLICIT;
+        if (layout && sqlite3_column_int(query,3))
+            layout|=SOURCE_SLICED;
+        if (layout && sqlite3_column_int(query,4))
+            layout|=SOURCE_NAMED;
+        if (sqlite3_column_int(query,5)) {
+            fprintf(stderr,"%s: Shard manifest; give its shards as sources\n",
+                    g->src_paths[src_no]);
+            return -1;
+        }
+    }
+    sqlite3_finalize(query);
+    s->layouts[src_no]=layout;
+    if (!layout)
+        return 0;
 
-    status=sqlite3_prepare_v2(db,attach_sql,sizeof attach_sql,&attach,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(attach): %s\n",sqlite3_errmsg(db));
+    find_sql=sqlite3_mprintf(
+        layout & SOURCE_IMPLICIT ? find_packed_implicit_fmt : find_packed_fmt,
+        layout & SOURCE_SLICED ? slice_offset_column_sql : no_slice_column_sql);
+    if (!find_sql) {
+        fputs(oom_msg,stderr);
         return -1;
     }
-    status=sqlite3_bind_text(attach,1,g->src_path,-1,SQLITE_STATIC);
+    status=sqlite3_prepare_v2(db,find_sql,-1,&s->finds[src_no],NULL);
+    sqlite3_free(find_sql);
     if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_bind_text(attach): %s\n",sqlite3_errmsg(db));
+        fprintf(stderr,"%s: sqlite3_prepare(find_packed): %s\n",
+                g->src_paths[src_no],sqlite3_errmsg(db));
         return -1;
     }
-    status=sqlite3_step(attach);
-    if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(attach): %s\n",sqlite3_errmsg(db));
+    return 0;
+}
+
+/*
+  Each database source gets a read-only connection of its own, rather
+  than being attached to the destination, so there's no limit on their
+  number.  A read transaction on each keeps them stable from the
+  first pass over them to the last.  Any other path is taken as a
+  file source.  The page size comes from the first database source
+  unless one was specified, and is SQLite's default without one.
+*/
+
+static int open_sources(
+    globals *g,
+    sources *s)
+{
+    sqlite3 *first_db=NULL;
+    char *errmsg=NULL;
+    int src_no,status;
+
+    s->dbs=sqlite3_malloc64(g->src_cnt*sizeof *s->dbs);
+    s->files=sqlite3_malloc64(g->src_cnt*sizeof *s->files);
+    s->layouts=sqlite3_malloc64(g->src_cnt*sizeof *s->layouts);
+    s->finds=sqlite3_malloc64(g->src_cnt*sizeof *s->finds);
+    if (!s->dbs || !s->files || !s->layouts || !s->finds) {
+        fputs(oom_msg,stderr);
         return -1;
     }
-    sqlite3_finalize(attach);
-    attach=NULL;
+    memset(s->dbs,0,g->src_cnt*sizeof *s->dbs);
+    memset(s->files,0,g->src_cnt*sizeof *s->files);
+    memset(s->layouts,0,g->src_cnt*sizeof *s->layouts);
+    memset(s->finds,0,g->src_cnt*sizeof *s->finds);
+    for (src_no=0; src_no<g->src_cnt; src_no++) {
+        char const *path=g->src_paths[src_no];
 
+        status=filesrc_open(path,&s->files[src_no]);
+        if (status<0)
+            return -1;
+        if (status==0)
+            continue;
+
+        status=sqlite3_open_v2(path,&s->dbs[src_no],SQLITE_OPEN_READONLY,
+                               g->trace_io ? IOTRACE_NAME : NULL);
+        if (status!=SQLITE_OK) {
+            if (s->dbs[src_no]) {
+                fprintf(stderr,"%s: sqlite3_open: %s\n",
+                        path,sqlite3_errmsg(s->dbs[src_no]));
+            } else {
+                fprintf(stderr,"%s: sqlite3_open: %s\n",
+                        path,sqlite3_errstr(status));
+            }
+            return -1;
+        }
+        status=sqlite3_exec(s->dbs[src_no],begin_read_sql,0,NULL,&errmsg);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"%s: Failed to start transaction: %s\n",
+                    path,errmsg);
+            return -1;
+        }
+        if (source_layout(g,s,src_no))
+            return -1;
+        if (!first_db)
+            first_db=s->dbs[src_no];
+    }
+
+    if (!g->page_size && !first_db)
+        g->page_size=4096;
     if (!g->page_size) {
         sqlite3_stmt *get_page_size=NULL;
 
         status=sqlite3_prepare_v2(
-            db,get_page_size_sql,sizeof get_page_size_sql,&get_page_size,NULL);
+            first_db,get_page_size_sql,sizeof get_page_size_sql,
+            &get_page_size,NULL);
         if (status!=SQLITE_OK) {
             fprintf(stderr,"sqlite3_prepapre(get_page_size): %s\n",
-                    sqlite3_errmsg(db));
+                    sqlite3_errmsg(first_db));
             return -1;
         }
         status=sqlite3_step(get_page_size);
         if (status!=SQLITE_ROW) {
             fprintf(stderr,"sqlite3_step(page_size): %s\n",
-                    sqlite3_errmsg(db));
+                    sqlite3_errmsg(first_db));
             return -1;
         }
         g->page_size=sqlite3_column_int(get_page_size,0);
         sqlite3_finalize(get_page_size);
     }
 
-    set_page_size_sql=sqlite3_mprintf(set_page_size_fmt,g->page_size);
-    if (!set_page_size_sql) {
-        fputs(oom_msg,stderr);
-        return -1;
-    }
-    status=sqlite3_exec(db,set_page_size_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to set page size: %s\n",errmsg);
-        return -1;
-    }
-    sqlite3_free(set_page_size_sql);
+    return 0;
+}
 
-    status=sqlite3_exec(db,begin_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to start transaction: %s\n",errmsg);
-        return -1;
+static void close_sources(
+    globals *g,
+    sources *s)
+{
+    int src_no;
+
+    for (src_no=0; src_no<g->src_cnt; src_no++) {
+        if (s->finds)
+            sqlite3_finalize(s->finds[src_no]);
+        if (s->dbs)
+            sqlite3_close_v2(s->dbs[src_no]);
+        if (s->files)
+            filesrc_close(s->files[src_no]);
+        if (s->numbers)
+            sqlite3_free(s->numbers[src_no]);
     }
+    sqlite3_free(s->dbs);
+    sqlite3_free(s->files);
+    sqlite3_free(s->layouts);
+    sqlite3_free(s->finds);
+    sqlite3_free(s->numbers);
+    s->dbs=NULL;
+    s->files=NULL;
+    s->layouts=NULL;
+    s->finds=NULL;
+    s->numbers=NULL;
+}
 
-    g->db=db;
+/*
+  Blobs from file sources have names, and so do those from packed
+  sources that have a names table.
+*/
+
+static int named_sources(
+    globals const *g)
+{
+    int src_no;
+
+    for (src_no=0; src_no<g->src_cnt; src_no++) {
+        if (g->srcs.files[src_no]
+                || g->srcs.layouts[src_no] & SOURCE_NAMED)
+            return 1;
+    }
     return 0;
 }
 
 /*
-  The set of blobs to be split has two disjoint subsets:
-  A) The cell size would exceed half the leaf page cell space,
-     making it harder to pack things efficiently.
-  B) The last overflow page would have unused space in it.
- */
+  The number of entries of a file source with ids below id,
+  or up to id if inclusive.
+*/
 
-static int generate_frags(
-    globals *g)
+static sqlite3_int64 file_rank(
+    sources const *s,
+    int src_no,
+    sqlite3_int64 id,
+    int inclusive)
 {
-    sqlite3_stmt *list=NULL;
-    sqlite3_stmt *split=NULL;
-    sqlite3_stmt *frag=NULL;
-    char *errmsg=NULL;
-    int status;
-    sqlite3_int64 frag_cnt,frag_id;
-    int half_space;
+    file_number const *numbers;
+    sqlite3_int64 cnt,lo,hi;
 
-    fputs("Generating fragments...\n",stderr);
-    status=sqlite3_exec(g->db,create_temps_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to create temporary tables: %s\n",errmsg);
-        return -1;
+    cnt=filesrc_count(s->files[src_no]);
+    numbers=s->numbers ? s->numbers[src_no] : NULL;
+    if (!numbers) {
+        if (!inclusive)
+            id=id>INT64_MIN ? id-1 : id;
+        return id<1 ? 0 : id>cnt ? cnt : id;
     }
+    lo=0;
+    hi=cnt;
+    while (lo<hi) {
+        sqlite3_int64 mid;
 
-    status=sqlite3_prepare_v2(
-        g->db,list_blobs_sql,sizeof list_blobs_sql,&list,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(list_blobs): %s\n",
-                sqlite3_errmsg(g->db));
-        return -1;
+        mid=lo+(hi-lo)/2;
+        if (numbers[mid].id<id || inclusive && numbers[mid].id==id) {
+            lo=mid+1;
+        } else {
+            hi=mid;
+        }
     }
+    return lo;
+}
 
-    status=sqlite3_prepare_v2(
-        g->db,insert_temp_split_sql,sizeof insert_temp_split_sql,&split,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(temp_insert_split): %s\n",
-                sqlite3_errmsg(g->db));
-        return -1;
-    }
+/*
+  The entry of a file source holding the blob with the given id,
+  which is known to be there.
+*/
 
-    status=sqlite3_prepare_v2(
-        g->db,insert_temp_frag_sql,sizeof insert_temp_frag_sql,&frag,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(temp_insert_frag): %s\n",
-                sqlite3_errmsg(g->db));
-        return -1;
-    }
+static sqlite3_int64 file_entry(
+    sources const *s,
+    int src_no,
+    sqlite3_int64 id)
+{
+    if (!s->numbers || !s->numbers[src_no])
+        return id-1;
+    return s->numbers[src_no][file_rank(s,src_no,id,0)].entry_no;
+}
 
-    half_space=(g->page_size-8)/2;
-    frag_cnt=0;
-    for (;;) {
-        status=sqlite3_step(list);
-        if (status!=SQLITE_ROW)
-            break;
-        if (sqlite3_column_type(list,1)!=SQLITE_NULL) {
-            space head_space;
-            sqlite3_int64 size;
+/*
+  The blobs of all sources, merged into one stream in output id order.
+  With an id shift, source k's ids are moved up by k times the shift;
+  otherwise they are kept, and an id found in two sources is an error.
+  With dozens of sources at most, a linear scan for the smallest
+  current id is as good as a heap.
 
-            size=sqlite3_column_int64(list,1);
-            head_space=blob_space(-1,size,g->page_size);
-            if (head_space.cell_size>half_space || head_space.unused_space>0) {
-                frag_cnt+=2;
-            } else {
-                frag_cnt+=1;
-            }
-        }
-    }
-    if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(list_blobs): %s\n",
-                sqlite3_errmsg(g->db));
-        return -1;
-    }
-    sqlite3_reset(list);
+  A file source needs no query: its blob ids are its entry numbers
+  plus 1, so the range of entries to go through is known up front.
+*/
 
-    frag_id=0;
-    for (;;) {
-        sqlite3_int64 split_id;
+typedef struct blob_list {
+    int src_cnt;
+    sqlite3_stmt **lists;
+    sqlite3_int64 *ids;
+    sqlite3_int64 *sizes;
+    sqlite3_int64 *next_entry;
+    sqlite3_int64 *first_entry;
+    sqlite3_int64 *end_entry;
+    int *live;
+    sqlite3_int64 last_id;
+    int last_src;
+} blob_list;
 
-        status=sqlite3_step(list);
-        if (status!=SQLITE_ROW)
-            break;
-        split_id=sqlite3_column_int64(list,0);
-        sqlite3_bind_int64(split,1,split_id);
-        status=sqlite3_step(split);
-        if (status!=SQLITE_DONE) {
-            fprintf(stderr,"sqlite3_step(insert_temp_split): %s\n",
-                    sqlite3_errmsg(g->db));
-            return -1;
-        }
-        sqlite3_reset(split);
+static sqlite3_int64 shift_of(
+    globals const *g,
+    int src_no)
+{
+    return src_no*g->id_shift;
+}
 
-        if (sqlite3_column_type(list,1)!=SQLITE_NULL) {
-            sqlite3_int64 size,head_size,tail_size;
-            space head_space,tail_space;
-            sqlite3_int64 lo,hi;
-
-            size=sqlite3_column_int64(list,1);
-            head_space=blob_space(frag_cnt,size,g->page_size);
-            if (head_space.cell_size>half_space) {
-                /*
-                  Subset A:
-                  Pick a head size that leaves the tail with the same
-                  number of overflow pages as the unsplit version.
-                  The cell sizes will fall in the approximate range
-                  1/4 to 1/2 of the page size.
-                */
-                lo=g->page_size/8;
-                hi=g->page_size*5/8;
-            } else if (head_space.unused_space>0) {
-                /*
-                  Subset B:
-                  Pick a head size that leaves the tail with one less
-                  overflow page than the unsplit version.
-                  The cell sizes will fall in the approximate range
-                  1/2 to 9/16 of the page size.
-                 */
-                lo=g->page_size*17/32;
-                hi=g->page_size*19/32;
-            } else {
-                hi=lo=size;
-            }
-            while (hi-lo>1) {
-                sqlite3_int64 mid;
-
-                mid=(lo+hi)/2;
-                head_space=blob_space(frag_cnt,mid,g->page_size);
-                tail_space=blob_space(frag_cnt,size-mid,g->page_size);
-                if (tail_space.cell_size<head_space.cell_size) {
-                    hi=mid;
-                } else {
-                    lo=mid;
-                }
-            }
+/*
+  Translate an output id bound into source src_no's ids,
+  clamping instead of overflowing.
+*/
 
-            head_size=lo;
-            head_space=blob_space(frag_cnt,head_size,g->page_size);
-            assert(head_space.unused_space==0);
-            frag_id++;
-            sqlite3_bind_int64(frag,1,frag_id);
-            sqlite3_bind_int(frag,2,0);
-            sqlite3_bind_int64(frag,3,head_size);
-            sqlite3_bind_int(frag,4,head_space.cell_size);
-            sqlite3_bind_int64(frag,5,split_id);
-            status=sqlite3_step(frag);
+static sqlite3_int64 source_bound(
+    globals const *g,
+    int src_no,
+    sqlite3_int64 bound)
+{
+    sqlite3_int64 shift;
+
+    shift=shift_of(g,src_no);
+    if (bound<INT64_MIN+shift)
+        return INT64_MIN;
+    return bound-shift;
+}
+
+static int step_list(
+    globals *g,
+    sources *s,
+    blob_list *l,
+    int src_no)
+{
+    sqlite3_int64 id,shift;
+    int status;
+
+    if (s->files[src_no]) {
+        sqlite3_int64 entry_no;
+
+        entry_no=l->next_entry[src_no];
+        if (entry_no>=l->end_entry[src_no]) {
+            l->live[src_no]=0;
+            return 0;
+        }
+        l->next_entry[src_no]++;
+        id=entry_no+1;
+        if (s->numbers && s->numbers[src_no]) {
+            id=s->numbers[src_no][entry_no].id;
+            entry_no=s->numbers[src_no][entry_no].entry_no;
+        }
+        l->sizes[src_no]=filesrc_size(s->files[src_no],entry_no);
+    } else {
+        sqlite3_stmt *list=l->lists[src_no];
+
+        status=sqlite3_step(list);
+        if (status!=SQLITE_ROW) {
+            l->live[src_no]=0;
             if (status!=SQLITE_DONE) {
-                fprintf(stderr,"sqlite3_step(insert_temp_frag): %s\n",
-                        sqlite3_errmsg(g->db));
+                fprintf(stderr,"%s: sqlite3_step(list_blobs): %s\n",
+                        g->src_paths[src_no],sqlite3_errmsg(s->dbs[src_no]));
                 return -1;
             }
-            sqlite3_reset(frag);
-
-            tail_size=size-head_size;
-            if (tail_size>0) {
-                tail_space=blob_space(frag_cnt,tail_size,g->page_size);
-                assert(tail_space.unused_space==0);
-                frag_id++;
-                sqlite3_bind_int64(frag,1,frag_id);
-                sqlite3_bind_int64(frag,2,head_size);
-                sqlite3_bind_int64(frag,3,tail_size);
-                sqlite3_bind_int(frag,4,tail_space.cell_size);
-                status=sqlite3_step(frag);
-                if (status!=SQLITE_DONE) {
-                    fprintf(stderr,"sqlite3_step(insert_temp_frag): %s\n",
-                            sqlite3_errmsg(g->db));
-                    return -1;
-                }
-                sqlite3_reset(frag);
-            }
+            return 0;
+        }
+        id=sqlite3_column_int64(list,0);
+        if (sqlite3_column_type(list,1)==SQLITE_NULL) {
+            l->sizes[src_no]=-1;
+        } else {
+            l->sizes[src_no]=sqlite3_column_int64(list,1);
         }
     }
-    if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(list_blobs): %s\n",
-                sqlite3_errmsg(g->db));
+    shift=shift_of(g,src_no);
+    if (id>INT64_MAX-shift) {
+        fprintf(stderr,"%s: Blob id %lld is too large to shift\n",
+                g->src_paths[src_no],id);
         return -1;
     }
-
-    sqlite3_finalize(list);
-    sqlite3_finalize(split);
-    sqlite3_finalize(frag);
+    l->ids[src_no]=id+shift;
+    l->live[src_no]=1;
     return 0;
 }
 
-/*
-  For f fragments and p pages, looping over pages is O((f+p) log(f))
+static int rewind_list(
+    globals *g,
+    sources *s,
+    blob_list *l)
+{
+    int src_no;
+
+    l->last_src=-1;
+    for (src_no=0; src_no<l->src_cnt; src_no++) {
+        if (l->lists[src_no])
+            sqlite3_reset(l->lists[src_no]);
+        l->next_entry[src_no]=l->first_entry[src_no];
+        if (step_list(g,s,l,src_no))
+            return -1;
+    }
+    return 0;
+}
+
+static int open_list(
+    globals *g,
+    sources *s,
+    blob_list *l)
+{
+    int src_no,status;
+
+    l->src_cnt=g->src_cnt;
+    l->lists=sqlite3_malloc64(l->src_cnt*sizeof *l->lists);
+    l->ids=sqlite3_malloc64(l->src_cnt*sizeof *l->ids);
+    l->sizes=sqlite3_malloc64(l->src_cnt*sizeof *l->sizes);
+    l->next_entry=sqlite3_malloc64(3*l->src_cnt*sizeof *l->next_entry);
+    l->live=sqlite3_malloc64(l->src_cnt*sizeof *l->live);
+    if (!l->lists || !l->ids || !l->sizes || !l->next_entry || !l->live) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    l->first_entry=l->next_entry+l->src_cnt;
+    l->end_entry=l->first_entry+l->src_cnt;
+    for (src_no=0; src_no<l->src_cnt; src_no++) {
+        sqlite3_int64 lo,hi;
+
+        lo=source_bound(g,src_no,g->lo_id);
+        hi=source_bound(g,src_no,g->hi_id);
+        l->lists[src_no]=NULL;
+        l->first_entry[src_no]=l->end_entry[src_no]=0;
+        if (s->files[src_no]) {
+            l->first_entry[src_no]=file_rank(s,src_no,lo,0);
+            l->end_entry[src_no]=file_rank(s,src_no,hi,1);
+            continue;
+        }
+        if (s->layouts[src_no]) {
+            char *list_sql;
+
+            list_sql=sqlite3_mprintf(
+                s->layouts[src_no] & SOURCE_IMPLICIT
+                    ? list_packed_implicit_fmt : list_packed_fmt,
+                s->layouts[src_no] & SOURCE_SLICED
+                    ? slice_size_column_sql : no_slice_column_sql);
+            if (!list_sql) {
+                fputs(oom_msg,stderr);
+                return -1;
+            }
+            status=sqlite3_prepare_v2(
+                s->dbs[src_no],list_sql,-1,&l->lists[src_no],NULL);
+            sqlite3_free(list_sql);
+        } else {
+            status=sqlite3_prepare_v2(
+                s->dbs[src_no],list_blobs_sql,sizeof list_blobs_sql,
+                &l->lists[src_no],NULL);
+        }
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"%s: sqlite3_prepare(list_blobs): %s\n",
+                    g->src_paths[src_no],sqlite3_errmsg(s->dbs[src_no]));
+            return -1;
+        }
+        sqlite3_bind_int64(l->lists[src_no],1,lo);
+        sqlite3_bind_int64(l->lists[src_no],2,hi);
+    }
+    return rewind_list(g,s,l);
+}
+
+static void close_list(
+    blob_list *l)
+{
+    int src_no;
+
+    for (src_no=0; src_no<l->src_cnt; src_no++)
+        sqlite3_finalize(l->lists[src_no]);
+    sqlite3_free(l->lists);
+    sqlite3_free(l->ids);
+    sqlite3_free(l->sizes);
+    sqlite3_free(l->next_entry);
+    sqlite3_free(l->live);
+}
+
+/*
+  Returns 1 with the next blob's output id, source and size
+  (-1 for NULL), 0 at the end, -1 on error.
+*/
+
+static int next_blob(
+    globals *g,
+    sources *s,
+    blob_list *l,
+    sqlite3_int64 *id,
+    int *src_ptr,
+    sqlite3_int64 *size)
+{
+    int src_no,best;
+
+    best=-1;
+    for (src_no=0; src_no<l->src_cnt; src_no++) {
+        if (l->live[src_no] && (best<0 || l->ids[src_no]<l->ids[best]))
+            best=src_no;
+    }
+    if (best<0)
+        return 0;
+    if (l->last_src>=0 && l->ids[best]==l->last_id) {
+        fprintf(stderr,"Blob id %lld is in both %s and %s;"
+                " use --id-shift to keep them apart\n",
+                l->last_id,g->src_paths[l->last_src],g->src_paths[best]);
+        return -1;
+    }
+    *id=l->last_id=l->ids[best];
+    *src_ptr=l->last_src=best;
+    *size=l->sizes[best];
+    if (step_list(g,s,l,best))
+        return -1;
+    return 1;
+}
+
+/*
+  With --previous, the destination starts out as a copy of the previous
+  release, made with the backup API, so that every page is the same to
+  begin with.  Its page size and split layout are kept, and new
+  fragments get ids after its largest one.  The connection stays open,
+  in a read transaction, until the output is written.
+*/
+
+static int open_previous(
+    globals *g)
+{
+    previous *p=&g->prev;
+    sqlite3_stmt *query=NULL;
+    struct stat st;
+    char *errmsg=NULL;
+    unsigned int page_size;
+    int status,implicit,sliced;
+
+    if (!g->prev_path)
+        return 0;
+    if (stat(g->prev_path,&st)) {
+        perror(g->prev_path);
+        return -1;
+    }
+    p->file_size=st.st_size;
+    status=sqlite3_open_v2(g->prev_path,&p->db,SQLITE_OPEN_READONLY,
+                           g->trace_io ? IOTRACE_NAME : NULL);
+    if (status!=SQLITE_OK) {
+        if (p->db) {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    g->prev_path,sqlite3_errmsg(p->db));
+        } else {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    g->prev_path,sqlite3_errstr(status));
+        }
+        return -1;
+    }
+    status=sqlite3_exec(p->db,begin_read_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: Failed to start transaction: %s\n",
+                g->prev_path,errmsg);
+        return -1;
+    }
+
+    status=sqlite3_prepare_v2(
+        p->db,find_output_sql,sizeof find_output_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_prepare(find_output): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    status=sqlite3_step(query);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"%s: sqlite3_step(find_output): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    if (!sqlite3_column_int(query,0)) {
+        fprintf(stderr,"%s: Not a packed database\n",g->prev_path);
+        return -1;
+    }
+    sqlite3_finalize(query);
+
+    status=sqlite3_prepare_v2(
+        p->db,get_page_size_sql,sizeof get_page_size_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_prepare(get_page_size): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    status=sqlite3_step(query);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"%s: sqlite3_step(get_page_size): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    page_size=sqlite3_column_int(query,0);
+    sqlite3_finalize(query);
+    if (g->page_size && g->page_size!=page_size) {
+        fprintf(stderr,"%s: Page size is %u, not %u\n",
+                g->prev_path,page_size,g->page_size);
+        return -1;
+    }
+    g->page_size=page_size;
+
+    status=sqlite3_prepare_v2(
+        p->db,previous_layout_sql,sizeof previous_layout_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_prepare(previous_layout): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    status=sqlite3_step(query);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"%s: sqlite3_step(previous_layout): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    implicit=sqlite3_column_int(query,0);
+    g->cat.id_base=sqlite3_column_int64(query,1);
+    sliced=sqlite3_column_int(query,2);
+    sqlite3_finalize(query);
+    if (implicit!=g->implicit_splits) {
+        fprintf(stderr,"%s: Packed %s --implicit-splits\n",
+                g->prev_path,implicit ? "with" : "without");
+        return -1;
+    }
+    if (sliced) {
+        fprintf(stderr,"%s: Packed with --tail-packing\n",g->prev_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  With --previous, a file keeps the id it had in the previous release,
+  found by name in its names table, so that adding or removing a file
+  doesn't renumber the others.  New names get ids in name order above
+  the largest id of the previous release, or with an id shift, above
+  the largest one in the source's range of ids.
+*/
+
+static int compare_numbers(
+    void const *a,
+    void const *b)
+{
+    file_number const *na=a,*nb=b;
+
+    if (na->id!=nb->id)
+        return na->id<nb->id ? -1 : 1;
+    return 0;
+}
+
+static int number_files(
+    globals *g)
+{
+    previous *p=&g->prev;
+    sources *s=&g->srcs;
+    sqlite3_stmt *query=NULL;
+    int src_no,status,names;
+
+    if (!g->prev_path)
+        return 0;
+    status=sqlite3_prepare_v2(
+        p->db,find_names_sql,sizeof find_names_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_prepare(find_names): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    status=sqlite3_step(query);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"%s: sqlite3_step(find_names): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    names=sqlite3_column_int(query,0);
+    sqlite3_finalize(query);
+
+    s->numbers=sqlite3_malloc64(g->src_cnt*sizeof *s->numbers);
+    if (!s->numbers) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    memset(s->numbers,0,g->src_cnt*sizeof *s->numbers);
+    for (src_no=0; src_no<g->src_cnt; src_no++) {
+        filesrc *files=s->files[src_no];
+        file_number *numbers;
+        sqlite3_int64 cnt,shift,lo,hi,max_id,i;
+
+        if (!files)
+            continue;
+        cnt=filesrc_count(files);
+        shift=shift_of(g,src_no);
+        lo=shift+1;
+        hi=g->id_shift>0 ? shift+g->id_shift : INT64_MAX;
+        numbers=sqlite3_malloc64((cnt>0 ? cnt : 1)*sizeof *numbers);
+        if (!numbers) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        s->numbers[src_no]=numbers;
+        for (i=0; i<cnt; i++) {
+            numbers[i].id=0;
+            numbers[i].entry_no=i;
+        }
+
+        if (names) {
+            status=sqlite3_prepare_v2(
+                p->db,list_previous_names_sql,sizeof list_previous_names_sql,
+                &query,NULL);
+            if (status!=SQLITE_OK) {
+                fprintf(stderr,"%s: sqlite3_prepare(list_previous_names):"
+                        " %s\n",g->prev_path,sqlite3_errmsg(p->db));
+                return -1;
+            }
+            sqlite3_bind_int64(query,1,lo);
+            sqlite3_bind_int64(query,2,hi);
+            while ((status=sqlite3_step(query))==SQLITE_ROW) {
+                char const *name;
+
+                name=(char const *)sqlite3_column_text(query,1);
+                i=name ? filesrc_find(files,name) : -1;
+                if (i>=0)
+                    numbers[i].id=sqlite3_column_int64(query,0)-shift;
+            }
+            if (status!=SQLITE_DONE) {
+                fprintf(stderr,"%s: sqlite3_step(list_previous_names): %s\n",
+                        g->prev_path,sqlite3_errmsg(p->db));
+                return -1;
+            }
+            sqlite3_finalize(query);
+        }
+
+        status=sqlite3_prepare_v2(
+            p->db,previous_max_id_sql,sizeof previous_max_id_sql,&query,NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"%s: sqlite3_prepare(previous_max_id): %s\n",
+                    g->prev_path,sqlite3_errmsg(p->db));
+            return -1;
+        }
+        sqlite3_bind_int64(query,1,lo);
+        sqlite3_bind_int64(query,2,hi);
+        status=sqlite3_step(query);
+        if (status!=SQLITE_ROW) {
+            fprintf(stderr,"%s: sqlite3_step(previous_max_id): %s\n",
+                    g->prev_path,sqlite3_errmsg(p->db));
+            return -1;
+        }
+        max_id=sqlite3_column_int64(query,0)-shift;
+        sqlite3_finalize(query);
+
+        for (i=0; i<cnt; i++) {
+            if (!numbers[i].id)
+                numbers[i].id=++max_id;
+        }
+        qsort(numbers,cnt,sizeof *numbers,compare_numbers);
+    }
+    return 0;
+}
+
+static int copy_previous(
+    globals *g,
+    sqlite3 *db)
+{
+    sqlite3_backup *backup;
+    int status;
+
+    progress(g,"Copying the previous release...\n");
+    backup=sqlite3_backup_init(db,"main",g->prev.db,"main");
+    if (!backup) {
+        fprintf(stderr,"sqlite3_backup_init: %s\n",sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_backup_step(backup,-1);
+    status=sqlite3_backup_finish(backup);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to copy %s: %s\n",
+                g->prev_path,sqlite3_errmsg(db));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Create the destination database;
+  copy the previous release into it, if any;
+  set the page size;
+  start a transaction.
+
+  The destination is written through the output VFS shim,
+  with the tracing one on top when tracing I/O.
+  Without a journal, it's written under a temporary name
+  and only renamed into place by close_db once it's complete.
+  With --build-in-memory, it's an in-memory database, resizable
+  through sqlite3_deserialize, that close_db writes out under the
+  temporary name.  A dry run gets a plain in-memory database instead.
+*/
+
+static int open_dst(
+    globals *g)
+{
+    sqlite3 *db=NULL;
+    char *set_page_size_sql=NULL;
+    char const *dst_path;
+    char const *vfs_name;
+    char *errmsg=NULL;
+    int status;
+
+    dst_path=g->dry_run ? ":memory:" : g->dst_path;
+    if (g->prev_path && !g->dry_run && !access(g->dst_path,F_OK)) {
+        fprintf(stderr,"%s: Already exists;"
+                " --previous only writes new files\n",g->dst_path);
+        return -1;
+    }
+    if (g->no_journal || g->in_memory) {
+        if (!access(g->dst_path,F_OK)) {
+            fprintf(stderr,"%s: Already exists;"
+                    " --%s only writes new files\n",g->dst_path,
+                    g->in_memory ? "build-in-memory" : "no-journal");
+            return -1;
+        }
+        if (!g->tmp_path)
+            g->tmp_path=sqlite3_mprintf("%s-tmp",g->dst_path);
+        if (!g->tmp_path) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        dst_path=g->in_memory ? ":memory:" : g->tmp_path;
+    } else {
+        sqlite3_free(g->tmp_path);
+        g->tmp_path=NULL;
+    }
+    if (g->dry_run || g->in_memory) {
+        vfs_name=NULL;
+    } else {
+        vfs_name=g->trace_io ? IOTRACE_NAME : OUTVFS_NAME;
+    }
+    status=sqlite3_open_v2(
+        dst_path,&db,SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,vfs_name);
+    if (status!=SQLITE_OK) {
+        if (db) {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    dst_path,sqlite3_errmsg(db));
+        } else {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    dst_path,sqlite3_errstr(status));
+        }
+        return -1;
+    }
+    if (g->in_memory) {
+        sqlite3_int64 size_limit;
+
+        status=sqlite3_deserialize(
+            db,"main",NULL,0,0,
+            SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"sqlite3_deserialize: %s\n",sqlite3_errmsg(db));
+            return -1;
+        }
+        /* room for prediction error before SQLITE_FULL */
+        size_limit=2*g->memory_limit;
+        sqlite3_file_control(db,"main",SQLITE_FCNTL_SIZE_LIMIT,&size_limit);
+    }
+
+    if (g->prev_path && !g->dry_run && copy_previous(g,db))
+        return -1;
+
+    set_page_size_sql=sqlite3_mprintf(set_page_size_fmt,g->page_size);
+    if (!set_page_size_sql) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    status=sqlite3_exec(db,set_page_size_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to set page size: %s\n",errmsg);
+        return -1;
+    }
+    sqlite3_free(set_page_size_sql);
+
+    if (g->no_journal) {
+        status=sqlite3_exec(db,no_journal_sql,0,NULL,&errmsg);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"Failed to turn off the journal: %s\n",errmsg);
+            return -1;
+        }
+    }
+
+    status=sqlite3_exec(db,begin_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to start transaction: %s\n",errmsg);
+        return -1;
+    }
+
+    g->db=db;
+    return 0;
+}
+
+/*
+  The size of a new output is predicted once it's planned; a copy of
+  the previous release adds its size.
+*/
+
+static int fits_in_memory(
+    globals const *g,
+    sqlite3_int64 size)
+{
+    return size+g->prev.file_size<=g->memory_limit;
+}
+
+/*
+  Open the previous release, if any, and the sources first,
+  since they decide the page size.
+*/
+
+static int open_db(
+    globals *g)
+{
+    if (open_previous(g))
+        return -1;
+    if (open_sources(g,&g->srcs))
+        return -1;
+    if (number_files(g))
+        return -1;
+    g->in_memory=g->memory_limit>0 && !g->dry_run;
+    if (g->in_memory && !fits_in_memory(g,0)) {
+        fprintf(stderr,"%s is over the memory limit; building on disk\n",
+                g->prev_path);
+        g->in_memory=0;
+    }
+    return open_dst(g);
+}
+
+/*
+  Builds that turn out too big for memory go to disk instead.  Nothing
+  has been written yet, so the in-memory database is just dropped.
+*/
+
+static int check_memory(
+    globals *g,
+    sqlite3_int64 size)
+{
+    if (!g->in_memory || fits_in_memory(g,size))
+        return 0;
+    fprintf(stderr,"Predicted size %lld is over the memory limit;"
+            " building on disk\n",size+g->prev.file_size);
+    sqlite3_close(g->db);
+    g->db=NULL;
+    g->in_memory=0;
+    return open_dst(g);
+}
+
+/*
+  Content hashing for deduplication.  The hash only has to be
+  good enough to make false candidates rare; candidates are
+  always compared byte for byte before any sharing happens.
+*/
+
+#define DEDUP_CHUNK 65536
+
+static sqlite3_uint64 hash_chunk(
+    sqlite3_uint64 hash,
+    unsigned char const *data,
+    int len)
+{
+    int i;
+
+    for (i=0; i+8<=len; i+=8) {
+        sqlite3_uint64 word;
+
+        memcpy(&word,data+i,8);
+        hash=(hash^word)*0x100000001B3;
+        hash^=hash>>29;
+    }
+    for (; i<len; i++)
+        hash=(hash^data[i])*0x100000001B3;
+    return hash;
+}
+
+/*
+  A blob handle remembers its source, since a handle can only be
+  moved to another row of the same table on the same connection.
+  A blob from a file source is memory-mapped instead.
+
+  A blob from a packed source is read from its old fragments: the
+  first head_size bytes from head_offset on in the head fragment,
+  the rest from the start of the tail fragment.  A fragment that keeps
+  its boundaries is thus read with a single call, as it was stored.
+*/
+
+typedef struct source_blob {
+    sqlite3_blob *blob;
+    sqlite3_blob *tail;
+    int head_offset;
+    int head_size;
+    int src_no;
+    sqlite3_int64 entry_no;
+    unsigned char const *data;
+} source_blob;
+
+static int read_blob(
+    globals *g,
+    source_blob *sb,
+    void *buf,
+    int len,
+    int offset)
+{
+    int head_len,status;
+
+    if (!sb->blob) {
+        if (len>0)
+            memcpy(buf,sb->data+offset,len);
+        return 0;
+    }
+    head_len=0;
+    if (offset<sb->head_size) {
+        head_len=len<sb->head_size-offset ? len : sb->head_size-offset;
+        status=sqlite3_blob_read(
+            sb->blob,buf,head_len,sb->head_offset+offset);
+        if (status!=SQLITE_OK)
+            goto fail;
+    }
+    if (len>head_len) {
+        status=sqlite3_blob_read(
+            sb->tail,(unsigned char *)buf+head_len,len-head_len,
+            offset+head_len-sb->head_size);
+        if (status!=SQLITE_OK)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    fprintf(stderr,"%s: sqlite3_blob_read: %s\n",
+            g->src_paths[sb->src_no],
+            sqlite3_errmsg(g->srcs.dbs[sb->src_no]));
+    return -1;
+}
+
+static int hash_blob(
+    globals *g,
+    source_blob *sb,
+    sqlite3_int64 size,
+    unsigned char *buf,
+    sqlite3_uint64 *hash)
+{
+    sqlite3_int64 offset;
+
+    *hash=0xCBF29CE484222325;
+    for (offset=0; offset<size; offset+=DEDUP_CHUNK) {
+        int len;
+
+        len=size-offset<DEDUP_CHUNK ? (int)(size-offset) : DEDUP_CHUNK;
+        if (read_blob(g,sb,buf,len,(int)offset))
+            return -1;
+        *hash=hash_chunk(*hash,buf,len);
+    }
+    return 0;
+}
+
+/*
+  Returns 1 if equal, 0 if different, -1 on error.
+*/
+
+static int same_blobs(
+    globals *g,
+    source_blob *blob1,
+    source_blob *blob2,
+    sqlite3_int64 size,
+    unsigned char *buf1,
+    unsigned char *buf2)
+{
+    sqlite3_int64 offset;
+
+    for (offset=0; offset<size; offset+=DEDUP_CHUNK) {
+        int len;
+
+        len=size-offset<DEDUP_CHUNK ? (int)(size-offset) : DEDUP_CHUNK;
+        if (read_blob(g,blob1,buf1,len,(int)offset)
+                || read_blob(g,blob2,buf2,len,(int)offset))
+            return -1;
+        if (memcmp(buf1,buf2,len))
+            return 0;
+    }
+    return 1;
+}
+
+static void close_blob(
+    globals *g,
+    source_blob *sb)
+{
+    sqlite3_blob_close(sb->blob);
+    sqlite3_blob_close(sb->tail);
+    sb->blob=NULL;
+    sb->tail=NULL;
+    if (sb->data) {
+        filesrc_unmap(g->srcs.files[sb->src_no],sb->entry_no,sb->data);
+        sb->data=NULL;
+    }
+}
+
+/*
+  Point a handle of a packed source at fragment frag_id, opening it
+  if need be.  The caller has made sure the handle is on src_no.
+*/
+
+static int open_frag(
+    globals *g,
+    int src_no,
+    sqlite3_int64 frag_id,
+    sqlite3_blob **blob)
+{
+    int status;
+
+    if (*blob) {
+        status=sqlite3_blob_reopen(*blob,frag_id);
+    } else {
+        status=sqlite3_blob_open(
+            g->srcs.dbs[src_no],"main","frags","val",frag_id,0,blob);
+    }
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_blob_open(frags): %s\n",
+                g->src_paths[src_no],sqlite3_errmsg(g->srcs.dbs[src_no]));
+        return -1;
+    }
+    return 0;
+}
+
+static int open_packed(
+    globals *g,
+    source_blob *sb,
+    int src_no,
+    sqlite3_int64 id)
+{
+    sqlite3_stmt *find=g->srcs.finds[src_no];
+    int status;
+
+    sqlite3_bind_int64(find,1,id);
+    status=sqlite3_step(find);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"%s: sqlite3_step(find_packed): %s\n",
+                g->src_paths[src_no],
+                status==SQLITE_DONE ? "No such blob"
+                    : sqlite3_errmsg(g->srcs.dbs[src_no]));
+        return -1;
+    }
+    if (open_frag(g,src_no,sqlite3_column_int64(find,0),&sb->blob))
+        return -1;
+    sb->head_offset=sqlite3_column_int(find,2);
+    sb->head_size=sqlite3_blob_bytes(sb->blob)-sb->head_offset;
+    if (sqlite3_column_type(find,1)!=SQLITE_NULL
+            && open_frag(g,src_no,sqlite3_column_int64(find,1),&sb->tail))
+        return -1;
+    sqlite3_reset(find);
+    return 0;
+}
+
+static int open_blob(
+    globals *g,
+    source_blob *sb,
+    sqlite3_int64 split_no)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 id;
+    int src_no,status;
+
+    src_no=c->split_src[split_no];
+    id=c->split_id[split_no]-shift_of(g,src_no);
+    if (g->srcs.files[src_no]) {
+        close_blob(g,sb);
+        sb->src_no=src_no;
+        sb->entry_no=file_entry(&g->srcs,src_no,id);
+        return filesrc_map(g->srcs.files[src_no],sb->entry_no,&sb->data);
+    }
+    if (sb->src_no!=src_no || !sb->blob)
+        close_blob(g,sb);
+    sb->src_no=src_no;
+    if (g->srcs.layouts[src_no])
+        return open_packed(g,sb,src_no,id);
+    if (sb->blob) {
+        status=sqlite3_blob_reopen(sb->blob,id);
+    } else {
+        status=sqlite3_blob_open(
+            g->srcs.dbs[src_no],"main","blobs","val",id,0,&sb->blob);
+    }
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_blob_open: %s\n",
+                g->src_paths[src_no],sqlite3_errmsg(g->srcs.dbs[src_no]));
+        return -1;
+    }
+    sb->head_offset=0;
+    sb->head_size=sqlite3_blob_bytes(sb->blob);
+    return 0;
+}
+
+/*
+  Open-addressing table of blob contents, keyed by hash and size.
+  Slots hold split numbers; -1 marks an empty slot.
+*/
+
+typedef struct content_table {
+    sqlite3_int64 mask;
+    sqlite3_int64 *slots;
+    sqlite3_uint64 *hashes;
+    sqlite3_int64 *sizes;
+    source_blob blobs[2];
+    unsigned char *buf;
+} content_table;
+
+static int init_content(
+    content_table *t,
+    sqlite3_int64 split_cnt)
+{
+    sqlite3_int64 slot_cnt,i;
+
+    slot_cnt=16;
+    while (slot_cnt<2*split_cnt)
+        slot_cnt*=2;
+    t->mask=slot_cnt-1;
+    t->slots=sqlite3_malloc64(slot_cnt*sizeof *t->slots);
+    t->hashes=sqlite3_malloc64((split_cnt+1)*sizeof *t->hashes);
+    t->sizes=sqlite3_malloc64((split_cnt+1)*sizeof *t->sizes);
+    memset(t->blobs,0,sizeof t->blobs);
+    t->buf=sqlite3_malloc(2*DEDUP_CHUNK);
+    if (!t->slots || !t->hashes || !t->sizes || !t->buf) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    for (i=0; i<slot_cnt; i++)
+        t->slots[i]=-1;
+    return 0;
+}
+
+static void free_content(
+    globals *g,
+    content_table *t)
+{
+    sqlite3_free(t->slots);
+    sqlite3_free(t->hashes);
+    sqlite3_free(t->sizes);
+    close_blob(g,&t->blobs[0]);
+    close_blob(g,&t->blobs[1]);
+    sqlite3_free(t->buf);
+}
+
+/*
+  Look for an earlier blob with the same content.  If there is one,
+  its split number is stored in *same_as; otherwise *same_as is set
+  to -1 and the blob is recorded as a candidate for later blobs.
+*/
+
+static int find_duplicate(
+    globals *g,
+    content_table *t,
+    sqlite3_int64 split_no,
+    sqlite3_int64 size,
+    sqlite3_int64 *same_as)
+{
+    sqlite3_uint64 hash;
+    sqlite3_int64 slot;
+
+    if (open_blob(g,&t->blobs[0],split_no))
+        return -1;
+    if (hash_blob(g,&t->blobs[0],size,t->buf,&hash))
+        return -1;
+
+    *same_as=-1;
+    for (slot=hash&t->mask; t->slots[slot]>=0; slot=slot+1&t->mask) {
+        sqlite3_int64 other;
+        int status;
+
+        other=t->slots[slot];
+        if (t->hashes[other]!=hash || t->sizes[other]!=size)
+            continue;
+        if (open_blob(g,&t->blobs[1],other))
+            return -1;
+        status=same_blobs(
+            g,&t->blobs[0],&t->blobs[1],size,t->buf,t->buf+DEDUP_CHUNK);
+        if (status<0)
+            return -1;
+        if (status) {
+            *same_as=other;
+            return 0;
+        }
+    }
+    t->slots[slot]=split_no;
+    t->hashes[split_no]=hash;
+    t->sizes[split_no]=size;
+    return 0;
+}
+
+/*
+  Carve the catalog arrays out of one arena.  The 8-byte arrays
+  come first, so everything stays aligned without padding.
+*/
+
+static int alloc_catalog(
+    catalog *c,
+    sqlite3_int64 split_cnt,
+    sqlite3_int64 frag_cnt,
+    int bundled)
+{
+    sqlite3_int64 page_max;
+    sqlite3_uint64 bytes;
+    char *p;
+
+    page_max=frag_cnt+2;
+    bytes=split_cnt*(3*sizeof(sqlite3_int64)+sizeof(unsigned int)+2)
+        +frag_cnt*(6*sizeof(sqlite3_int64)+2*sizeof(unsigned int))
+        +page_max*(2*sizeof(sqlite3_int64)+2*sizeof(unsigned int)+1);
+    if (bundled)
+        bytes+=frag_cnt*3*sizeof(sqlite3_int64);
+    p=sqlite3_malloc64(bytes ? bytes : 1);
+    if (!p) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    c->arena=p;
+    c->split_max=split_cnt;
+    c->frag_max=frag_cnt;
+    c->id_max=c->id_base+frag_cnt;
+    c->arena_size=bytes;
+
+#define CARVE(field,cnt) \
+    (c->field=(void *)p, p+=(cnt)*sizeof *c->field)
+
+    CARVE(split_id,split_cnt);
+    CARVE(first_frag,split_cnt);
+    CARVE(same_as,split_cnt);
+    CARVE(offset,frag_cnt);
+    CARVE(size,frag_cnt);
+    CARVE(split_no,frag_cnt);
+    CARVE(page_id,frag_cnt);
+    CARVE(final_id,frag_cnt);
+    CARVE(frag_order,frag_cnt);
+    CARVE(page_link,page_max);
+    CARVE(page_order,page_max);
+    if (bundled) {
+        CARVE(row_lead,frag_cnt);
+        CARVE(row_next,frag_cnt);
+        CARVE(row_offset,frag_cnt);
+    } else {
+        c->row_lead=c->row_next=c->row_offset=NULL;
+    }
+    CARVE(split_src,split_cnt);
+    CARVE(cell_size,frag_cnt);
+    CARVE(crc,frag_cnt);
+    CARVE(page_space,page_max);
+    CARVE(page_frags,page_max);
+    CARVE(split_frags,split_cnt);
+    CARVE(split_seen,split_cnt);
+    CARVE(page_seen,page_max);
+
+#undef CARVE
+
+    c->page_in=c->page_out=NULL;
+    c->split_heat=NULL;
+    c->split_kept=NULL;
+    c->split_cnt=c->frag_cnt=c->page_cnt=c->final_cnt=0;
+    c->null_cnt=c->dup_cnt=0;
+    c->subset_a_cnt=c->subset_b_cnt=c->unsplit_cnt=0;
+    c->saved_cnt=c->kept_cnt=0;
+    c->bundled_cnt=c->bundle_cnt=0;
+    return 0;
+}
+
+static void free_catalog(
+    catalog *c)
+{
+    sqlite3_free(c->arena);
+    sqlite3_free(c->page_in);
+    sqlite3_free(c->page_out);
+    sqlite3_free(c->split_heat);
+    sqlite3_free(c->split_kept);
+    c->arena=NULL;
+    c->page_in=c->page_out=NULL;
+    c->split_heat=NULL;
+    c->split_kept=NULL;
+}
+
+static void add_frag(
+    catalog *c,
+    sqlite3_int64 split_no,
+    sqlite3_int64 offset,
+    sqlite3_int64 size,
+    unsigned int cell_size)
+{
+    sqlite3_int64 frag_no;
+
+    frag_no=c->frag_cnt++;
+    c->offset[frag_no]=offset;
+    c->size[frag_no]=size;
+    c->cell_size[frag_no]=cell_size;
+    c->split_no[frag_no]=split_no;
+    c->page_id[frag_no]=0;
+    c->split_frags[split_no]++;
+    if (c->row_lead) {
+        c->row_lead[frag_no]=frag_no;
+        c->row_next[frag_no]=-1;
+        c->row_offset[frag_no]=0;
+    }
+}
+
+/*
+  A fragment bundled by tail packing shares the row of its lead.
+*/
+
+static sqlite3_int64 lead_of(
+    catalog const *c,
+    sqlite3_int64 frag_no)
+{
+    return c->row_lead ? c->row_lead[frag_no] : frag_no;
+}
+
+static sqlite3_int64 next_piece(
+    catalog const *c,
+    sqlite3_int64 frag_no)
+{
+    return c->row_next ? c->row_next[frag_no] : -1;
+}
+
+static int bundled(
+    catalog const *c,
+    sqlite3_int64 frag_no)
+{
+    return c->row_lead
+        && (c->row_lead[frag_no]!=frag_no || c->row_next[frag_no]>=0);
+}
+
+static sqlite3_int64 row_size(
+    catalog const *c,
+    sqlite3_int64 frag_no)
+{
+    if (!c->row_next)
+        return c->size[frag_no];
+    while (c->row_next[frag_no]>=0)
+        frag_no=c->row_next[frag_no];
+    return c->row_offset[frag_no]+c->size[frag_no];
+}
+
+/*
+  The set of blobs to be split has two disjoint subsets:
+  A) The cell size would exceed half the leaf page cell space,
+     making it harder to pack things efficiently.
+  B) The last overflow page would have unused space in it.
+
+  split_point returns the head size, which is the whole blob if it
+  isn't split, and which subset it's in (0 if neither).
+  The rowid only has to be an upper bound for the fragment ids.
+ */
+
+static sqlite3_int64 split_point(
+    globals const *g,
+    sqlite3_int64 rowid,
+    sqlite3_int64 size,
+    int *subset)
+{
+    space head_space,tail_space;
+    sqlite3_int64 lo,hi;
+
+    head_space=blob_space(rowid,size,g->page_size);
+    if (head_space.cell_size>(int)(g->page_size-8)/2) {
+        /*
+          Subset A:
+          Pick a head size that leaves the tail with the same
+          number of overflow pages as the unsplit version.
+          The cell sizes will fall in the approximate range
+          1/4 to 1/2 of the page size.
+        */
+        lo=g->page_size/8;
+        hi=g->page_size*5/8;
+        *subset='A';
+    } else if (head_space.unused_space>0) {
+        /*
+          Subset B:
+          Pick a head size that leaves the tail with one less
+          overflow page than the unsplit version.
+          The cell sizes will fall in the approximate range
+          1/2 to 9/16 of the page size.
+         */
+        lo=g->page_size*17/32;
+        hi=g->page_size*19/32;
+        *subset='B';
+    } else {
+        *subset=0;
+        return size;
+    }
+    while (hi-lo>1) {
+        sqlite3_int64 mid;
+
+        mid=(lo+hi)/2;
+        head_space=blob_space(rowid,mid,g->page_size);
+        tail_space=blob_space(rowid,size-mid,g->page_size);
+        if (tail_space.cell_size<head_space.cell_size) {
+            hi=mid;
+        } else {
+            lo=mid;
+        }
+    }
+    return lo;
+}
+
+/*
+  With deduplication, a blob identical to an earlier one gets no
+  fragments of its own; its split refers to the earlier blob's split
+  and shares its fragments.
+ */
+
+static int generate_frags(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    blob_list list;
+    content_table content;
+    int status;
+    sqlite3_int64 split_cnt,frag_cnt,id,size;
+    int half_space,src_no;
+
+    progress(g,"Generating fragments...\n");
+    if (open_list(g,&g->srcs,&list))
+        return -1;
+
+    half_space=(g->page_size-8)/2;
+    split_cnt=frag_cnt=0;
+    for (;;) {
+        status=next_blob(g,&g->srcs,&list,&id,&src_no,&size);
+        if (status<=0)
+            break;
+        split_cnt++;
+        if (size>=0) {
+            space head_space;
+
+            head_space=blob_space(-1,size,g->page_size);
+            if (head_space.cell_size>half_space || head_space.unused_space>0) {
+                frag_cnt+=2;
+            } else {
+                frag_cnt+=1;
+            }
+        }
+    }
+    if (status<0 || rewind_list(g,&g->srcs,&list))
+        return -1;
+
+    if (alloc_catalog(c,split_cnt,frag_cnt,g->tail_packing))
+        return -1;
+    if (g->dedup && init_content(&content,split_cnt))
+        return -1;
+
+    for (;;) {
+        sqlite3_int64 split_no;
+
+        status=next_blob(g,&g->srcs,&list,&id,&src_no,&size);
+        if (status<=0)
+            break;
+        split_no=c->split_cnt++;
+        c->split_id[split_no]=id;
+        c->split_src[split_no]=src_no;
+        c->first_frag[split_no]=c->frag_cnt;
+        c->same_as[split_no]=-1;
+        c->split_frags[split_no]=0;
+
+        if (size>=0) {
+            sqlite3_int64 head_size,tail_size;
+            space head_space,tail_space;
+            int subset;
+
+            if (g->dedup) {
+                if (find_duplicate(g,&content,split_no,size,
+                                   &c->same_as[split_no]))
+                    return -1;
+                if (c->same_as[split_no]>=0) {
+                    c->dup_cnt++;
+                    continue;
+                }
+            }
+
+            head_size=split_point(g,c->id_max,size,&subset);
+            if (subset=='A') {
+                c->subset_a_cnt++;
+            } else if (subset=='B') {
+                c->subset_b_cnt++;
+            }
+            head_space=blob_space(c->id_max,head_size,g->page_size);
+            assert(head_space.unused_space==0);
+            add_frag(c,split_no,0,head_size,head_space.cell_size);
+
+            tail_size=size-head_size;
+            if (tail_size>0) {
+                tail_space=blob_space(c->id_max,tail_size,g->page_size);
+                assert(tail_space.unused_space==0);
+                add_frag(c,split_no,head_size,tail_size,tail_space.cell_size);
+            }
+        } else {
+            c->null_cnt++;
+        }
+    }
+    if (status<0)
+        return -1;
+
+    close_list(&list);
+    if (g->dedup) {
+        free_content(g,&content);
+        fprintf(stderr,"%lld duplicate blobs share fragments\n",
+                c->dup_cnt);
+    }
+    return 0;
+}
+
+/*
+  The hot ids file lists the ids read first, one per line, each
+  optionally followed by a weight such as an access count (default 1).
+  Ids are looked up among the splits, which are in id order; ids
+  that aren't being packed, such as those of another shard or of
+  NULL blobs, are ignored.
+*/
+
+static int load_heat(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    char line[128];
+    FILE *file;
+    sqlite3_int64 hot_cnt;
+
+    if (!g->hot_path)
+        return 0;
+    c->split_heat=sqlite3_malloc64(
+        (c->split_cnt ? c->split_cnt : 1)*sizeof *c->split_heat);
+    if (!c->split_heat) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    memset(c->split_heat,0,c->split_cnt*sizeof *c->split_heat);
+
+    file=fopen(g->hot_path,"r");
+    if (!file) {
+        perror(g->hot_path);
+        return -1;
+    }
+    hot_cnt=0;
+    while (fgets(line,sizeof line,file)) {
+        long long id;
+        double weight;
+        sqlite3_int64 lo,hi,owner;
+        char extra;
+
+        weight=1;
+        if (sscanf(line,"%lld %c",&id,&extra)!=1
+                && (sscanf(line,"%lld %lf %c",&id,&weight,&extra)!=2
+                    || !(weight>0))) {
+            if (sscanf(line," %c",&extra)<1)
+                continue;
+            fprintf(stderr,"%s: Invalid line %s",g->hot_path,line);
+            return -1;
+        }
+        lo=0;
+        hi=c->split_cnt;
+        while (lo<hi) {
+            sqlite3_int64 mid;
+
+            mid=(lo+hi)/2;
+            if (c->split_id[mid]<id) {
+                lo=mid+1;
+            } else {
+                hi=mid;
+            }
+        }
+        if (lo==c->split_cnt || c->split_id[lo]!=id)
+            continue;
+        owner=c->same_as[lo]>=0 ? c->same_as[lo] : lo;
+        if (c->split_frags[owner]==0)
+            continue;
+        if (c->split_heat[owner]==0)
+            hot_cnt++;
+        c->split_heat[owner]+=weight;
+    }
+    if (ferror(file)) {
+        perror(g->hot_path);
+        return -1;
+    }
+    fclose(file);
+    fprintf(stderr,"%lld hot blobs\n",hot_cnt);
+    return 0;
+}
+
+/*
+  Pages with free space are kept in buckets by the amount of it,
+  with a two-level bitmap of nonempty buckets.  Finding the best fit,
+  the fullest page that still has room, is a short bitmap scan.
+*/
+
+#define SPACE_WORDS (65536/64)
+#define SPACE_GROUPS (SPACE_WORDS/64)
+
+typedef struct space_index {
+    sqlite3_int64 *heads;
+    sqlite3_uint64 words[SPACE_WORDS];
+    sqlite3_uint64 groups[SPACE_GROUPS];
+} space_index;
+
+static int ctz64(
+    sqlite3_uint64 word)
+{
+    return __builtin_ctzll(word);
+}
+
+static void space_push(
+    space_index *x,
+    sqlite3_int64 *links,
+    unsigned int space,
+    sqlite3_int64 page_id)
+{
+    links[page_id]=x->heads[space];
+    x->heads[space]=page_id;
+    x->words[space/64]|=(sqlite3_uint64)1<<space%64;
+    x->groups[space/4096]|=(sqlite3_uint64)1<<space/64%64;
+}
+
+static sqlite3_int64 space_pop(
+    space_index *x,
+    sqlite3_int64 *links,
+    unsigned int space)
+{
+    sqlite3_int64 page_id;
+
+    page_id=x->heads[space];
+    x->heads[space]=links[page_id];
+    if (!x->heads[space]) {
+        x->words[space/64]&=~((sqlite3_uint64)1<<space%64);
+        if (!x->words[space/64])
+            x->groups[space/4096]&=~((sqlite3_uint64)1<<space/64%64);
+    }
+    return page_id;
+}
+
+/*
+  Smallest nonempty bucket at or above the given space, or -1.
+*/
+
+static int space_find(
+    space_index const *x,
+    unsigned int space)
+{
+    sqlite3_uint64 word;
+    unsigned int w,grp;
+
+    w=space/64;
+    word=x->words[w]&~(((sqlite3_uint64)1<<space%64)-1);
+    if (word)
+        return w*64+ctz64(word);
+    w++;
+    if (w>=SPACE_WORDS)
+        return -1;
+    grp=w/64;
+    word=x->groups[grp]&~(((sqlite3_uint64)1<<w%64)-1);
+    while (!word) {
+        grp++;
+        if (grp>=SPACE_GROUPS)
+            return -1;
+        word=x->groups[grp];
+    }
+    w=grp*64+ctz64(word);
+    return w*64+ctz64(x->words[w]);
+}
+
+/*
+  For f fragments and p pages, looping over pages is O((f+p) log(f))
   while looping over fragments is O(f log(p)).
   Since p<=f, the second approach wins.
+
+  Fragments are taken in decreasing cell size order, found by a
+  counting sort, and each goes to the fullest page it fits on.
+  The fragments of hot blobs come first, so they share as few pages
+  as possible, which the cold ones then top up.
+*/
+
+static unsigned int fill_key(
+    catalog const *c,
+    sqlite3_int64 frag_no,
+    unsigned int max_space)
+{
+    unsigned int key;
+
+    key=max_space-c->cell_size[frag_no];
+    if (c->split_heat && !(c->split_heat[c->split_no[frag_no]]>0))
+        key+=max_space+1;
+    return key;
+}
+
+static void place_frag(
+    catalog *c,
+    space_index *index,
+    sqlite3_int64 frag_no,
+    unsigned int max_space,
+    unsigned int min_size)
+{
+    sqlite3_int64 page_id;
+    unsigned int cell_space,cell_size;
+    int found;
+
+    cell_size=c->cell_size[frag_no];
+    found=space_find(index,cell_size);
+    if (found>=0) {
+        cell_space=found;
+        page_id=space_pop(index,c->page_link,cell_space);
+    } else {
+        page_id=++c->page_cnt;
+        cell_space=max_space;
+        c->page_frags[page_id]=0;
+    }
+
+    cell_space-=cell_size;
+    c->page_space[page_id]=cell_space;
+    if (cell_space>=min_size)
+        space_push(index,c->page_link,cell_space,page_id);
+    c->page_id[frag_no]=page_id;
+    c->page_frags[page_id]++;
+}
+
+/*
+  Adaptive splits.  Any head size is as good as the fixed one as long
+  as the head stays on the leaf page and the tail keeps the same number
+  of overflow pages, the last of them full.  That holds while the tail
+  record size is in [M+k*U, P-35+k*U] for page size P, U=P-4,
+  M=(P-12)*32/255-23 and k overflow pages; when k is 0, anything up to
+  P-35 will do.  Record sizes grow with blob sizes, so the range of head
+  sizes is found by bisection from the fixed one, which is in it.
+*/
+
+static void head_range(
+    globals const *g,
+    sqlite3_int64 size,
+    sqlite3_int64 head_size,
+    sqlite3_int64 *lo_ptr,
+    sqlite3_int64 *hi_ptr)
+{
+    sqlite3_int64 usable,min_inline,max_inline,rec_lo,rec_hi,lo,hi;
+    space tail_space;
+
+    usable=g->page_size-4;
+    min_inline=(g->page_size-12)*32/255-23;
+    max_inline=g->page_size-35;
+    tail_space=blob_space(0,size-head_size,g->page_size);
+    rec_lo=tail_space.overflow_cnt ?
+        min_inline+tail_space.overflow_cnt*usable : 0;
+    rec_hi=max_inline+tail_space.overflow_cnt*usable;
+
+    lo=0;
+    hi=head_size;
+    while (hi-lo>1) {
+        sqlite3_int64 mid;
+
+        mid=(lo+hi)/2;
+        if (blob_rec_size(size-mid)<=rec_hi) {
+            hi=mid;
+        } else {
+            lo=mid;
+        }
+    }
+    *lo_ptr=hi;
+
+    lo=head_size;
+    hi=size;
+    while (hi-lo>1) {
+        sqlite3_int64 mid;
+
+        mid=(lo+hi)/2;
+        if (blob_rec_size(size-mid)>=rec_lo
+                && blob_rec_size(mid)<=max_inline) {
+            lo=mid;
+        } else {
+            hi=mid;
+        }
+    }
+    *hi_ptr=lo;
+}
+
+static void set_head_size(
+    globals *g,
+    sqlite3_int64 split_no,
+    sqlite3_int64 head_size)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 head,tail,size;
+
+    head=c->first_frag[split_no];
+    tail=head+1;
+    size=c->size[head]+c->size[tail];
+    c->size[head]=head_size;
+    c->cell_size[head]=
+        blob_space(c->id_max,head_size,g->page_size).cell_size;
+    c->offset[tail]=head_size;
+    c->size[tail]=size-head_size;
+    c->cell_size[tail]=
+        blob_space(c->id_max,size-head_size,g->page_size).cell_size;
+}
+
+/*
+  Place both fragments of a split at once.  Of the fullest page that
+  can take the smallest possible head and the fullest one that can take
+  the smallest possible tail, the one the fitted fragment leaves
+  less room on wins; the other fragment then goes wherever it fits
+  best.  If neither exists, the fixed split opens a new page.
+*/
+
+static void place_split(
+    globals *g,
+    space_index *index,
+    sqlite3_int64 split_no,
+    unsigned int max_space,
+    unsigned int min_size)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 head,tail,size,lo,hi,head_size;
+    sqlite3_int64 first,second;
+    int head_room,tail_room;
+    unsigned int waste;
+
+    head=c->first_frag[split_no];
+    tail=head+1;
+    size=c->size[head]+c->size[tail];
+    head_range(g,size,c->size[head],&lo,&hi);
+
+    head_size=c->size[head];
+    first=head;
+    second=tail;
+    waste=max_space+1;
+    head_room=space_find(
+        index,blob_space(c->id_max,lo,g->page_size).cell_size);
+    if (head_room>=0) {
+        sqlite3_int64 l,h;
+
+        /* largest head that fits */
+        l=lo;
+        h=hi+1;
+        while (h-l>1) {
+            sqlite3_int64 mid;
+
+            mid=(l+h)/2;
+            if (blob_space(c->id_max,mid,g->page_size).cell_size
+                    <=head_room) {
+                l=mid;
+            } else {
+                h=mid;
+            }
+        }
+        head_size=l;
+        waste=head_room
+            -blob_space(c->id_max,l,g->page_size).cell_size;
+    }
+    tail_room=space_find(
+        index,blob_space(c->id_max,size-hi,g->page_size).cell_size);
+    if (tail_room>=0) {
+        sqlite3_int64 l,h;
+        unsigned int tail_waste;
+
+        /* largest tail that fits */
+        l=lo-1;
+        h=hi;
+        while (h-l>1) {
+            sqlite3_int64 mid;
+
+            mid=(l+h)/2;
+            if (blob_space(c->id_max,size-mid,g->page_size).cell_size
+                    <=tail_room) {
+                h=mid;
+            } else {
+                l=mid;
+            }
+        }
+        tail_waste=tail_room
+            -blob_space(c->id_max,size-h,g->page_size).cell_size;
+        if (tail_waste<waste) {
+            head_size=h;
+            first=tail;
+            second=head;
+        }
+    }
+
+    set_head_size(g,split_no,head_size);
+    place_frag(c,index,first,max_space,min_size);
+    place_frag(c,index,second,max_space,min_size);
+}
+
+static void pack_pages(
+    globals *g,
+    space_index *index,
+    int adaptive,
+    unsigned int min_size)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 frag_no,i;
+    unsigned int max_space;
+
+    max_space=g->page_size-8;
+    memset(index->heads,0,(max_space+1)*sizeof *index->heads);
+    memset(index->words,0,sizeof index->words);
+    memset(index->groups,0,sizeof index->groups);
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++)
+        c->page_id[frag_no]=0;
+
+    c->page_cnt=0;
+    for (i=0; i<c->frag_cnt; i++) {
+        sqlite3_int64 split_no;
+
+        frag_no=c->frag_order[i];
+        split_no=c->split_no[frag_no];
+        if (c->page_id[frag_no] || c->split_kept && c->split_kept[split_no]
+                || lead_of(c,frag_no)!=frag_no)
+            continue;
+        if (adaptive && c->split_frags[split_no]==2) {
+            place_split(g,index,split_no,max_space,min_size);
+        } else {
+            place_frag(c,index,frag_no,max_space,min_size);
+        }
+    }
+}
+
+/*
+  Stable layout.  A blob is kept as it was in the previous release if
+  it has the same id, size and checksum there and its fragments weren't
+  shared with a blob of lower id: its split gets the previous head size
+  and its fragments the previous ids, and they're left out of packing
+  and writing.  A blob that was whole there but is split now is made
+  whole again.  Checking means reading each candidate blob once.
+*/
+
+static int crc_range(
+    globals *g,
+    source_blob *sb,
+    sqlite3_int64 offset,
+    sqlite3_int64 size,
+    unsigned char *buf,
+    unsigned int *crc)
+{
+    sqlite3_int64 end;
+
+    *crc=0;
+    end=offset+size;
+    for (; offset<end; offset+=DEDUP_CHUNK) {
+        int len;
+
+        len=end-offset<DEDUP_CHUNK ? (int)(end-offset) : DEDUP_CHUNK;
+        if (read_blob(g,sb,buf,len,(int)offset))
+            return -1;
+        *crc=crc32c(*crc,buf,len);
+    }
+    return 0;
+}
+
+static int kept_bit(
+    previous const *p,
+    sqlite3_int64 id)
+{
+    return p->kept[id/8]>>id%8&1;
+}
+
+static int keep_split(
+    globals *g,
+    source_blob *sb,
+    unsigned char *buf,
+    sqlite3_int64 split_no,
+    sqlite3_stmt *row)
+{
+    catalog *c=&g->cat;
+    previous *p=&g->prev;
+    sqlite3_int64 head,head_id,tail_id,head_size,size;
+    unsigned int head_crc,tail_crc,crc;
+    int split;
+
+    if (c->same_as[split_no]>=0 || !c->split_frags[split_no])
+        return 0;
+    head=c->first_frag[split_no];
+    size=c->size[head];
+    if (c->split_frags[split_no]>1)
+        size+=c->size[head+1];
+
+    head_id=sqlite3_column_int64(row,1);
+    split=sqlite3_column_type(row,2)!=SQLITE_NULL;
+    tail_id=sqlite3_column_int64(row,2);
+    head_size=sqlite3_column_int64(row,4);
+    if (head_size+sqlite3_column_int64(row,5)!=size
+            || split && c->split_frags[split_no]<2
+            || head_id<1 || head_id>c->id_base || kept_bit(p,head_id)
+            || split && (tail_id<1 || tail_id>c->id_base
+                         || tail_id==head_id || kept_bit(p,tail_id)))
+        return 0;
+    if (!split)
+        head_size=size;
+
+    if (open_blob(g,sb,split_no)
+            || crc_range(g,sb,0,head_size,buf,&head_crc)
+            || crc_range(g,sb,head_size,size-head_size,buf,&tail_crc))
+        return -1;
+    crc=head_crc;
+    if (split)
+        crc=crc32c_combine(crc,tail_crc,size-head_size);
+    if (crc!=(unsigned int)sqlite3_column_int64(row,3))
+        return 0;
+
+    if (split) {
+        set_head_size(g,split_no,head_size);
+        c->crc[head+1]=tail_crc;
+        c->final_id[head+1]=tail_id;
+        p->kept[tail_id/8]|=1<<tail_id%8;
+    } else if (c->split_frags[split_no]>1) {
+        c->size[head]=size;
+        c->split_frags[split_no]=1;
+        c->unsplit_cnt++;
+    }
+    c->crc[head]=head_crc;
+    c->final_id[head]=head_id;
+    p->kept[head_id/8]|=1<<head_id%8;
+    c->split_kept[split_no]=1;
+    c->kept_cnt++;
+    return 0;
+}
+
+/*
+  The previous splits are merged with the new ones by id.
+*/
+
+static int match_previous(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    previous *p=&g->prev;
+    sqlite3_stmt *list=NULL;
+    source_blob blob;
+    unsigned char *buf;
+    sqlite3_int64 split_no,gone_max;
+    int status;
+
+    if (!g->prev_path)
+        return 0;
+    progress(g,"Matching the previous release...\n");
+    c->split_kept=sqlite3_malloc64(c->split_cnt ? c->split_cnt : 1);
+    p->kept=sqlite3_malloc64(c->id_base/8+1);
+    buf=sqlite3_malloc(DEDUP_CHUNK);
+    if (!c->split_kept || !p->kept || !buf) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    memset(c->split_kept,0,c->split_cnt);
+    memset(p->kept,0,c->id_base/8+1);
+
+    if (g->implicit_splits) {
+        status=sqlite3_prepare_v2(
+            p->db,list_previous_implicit_sql,sizeof list_previous_implicit_sql,
+            &list,NULL);
+    } else {
+        status=sqlite3_prepare_v2(
+            p->db,list_previous_sql,sizeof list_previous_sql,&list,NULL);
+    }
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"%s: sqlite3_prepare(list_previous): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    memset(&blob,0,sizeof blob);
+    gone_max=0;
+    split_no=0;
+    for (;;) {
+        sqlite3_int64 id;
+
+        status=sqlite3_step(list);
+        if (status!=SQLITE_ROW)
+            break;
+        id=sqlite3_column_int64(list,0);
+        while (split_no<c->split_cnt && c->split_id[split_no]<id)
+            split_no++;
+        if (split_no<c->split_cnt && c->split_id[split_no]==id) {
+            if (sqlite3_column_type(list,1)!=SQLITE_NULL
+                    && keep_split(g,&blob,buf,split_no,list))
+                return -1;
+            continue;
+        }
+        if (p->gone_cnt==gone_max) {
+            sqlite3_int64 *gone;
+
+            gone_max=gone_max ? 2*gone_max : 1024;
+            gone=sqlite3_realloc64(p->gone,gone_max*sizeof *gone);
+            if (!gone) {
+                fputs(oom_msg,stderr);
+                return -1;
+            }
+            p->gone=gone;
+        }
+        p->gone[p->gone_cnt++]=id;
+    }
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"%s: sqlite3_step(list_previous): %s\n",
+                g->prev_path,sqlite3_errmsg(p->db));
+        return -1;
+    }
+    sqlite3_finalize(list);
+    close_blob(g,&blob);
+    sqlite3_free(buf);
+
+    fprintf(stderr,"%lld of %lld blobs kept from %s, %lld gone\n",
+            c->kept_cnt,c->split_cnt,g->prev_path,p->gone_cnt);
+    return 0;
+}
+
+static void free_previous(
+    previous *p)
+{
+    sqlite3_close(p->db);
+    sqlite3_free(p->kept);
+    sqlite3_free(p->gone);
+    p->db=NULL;
+    p->kept=NULL;
+    p->gone=NULL;
+    p->gone_cnt=0;
+}
+
+/*
+  Tail packing.  A small blob pays a large share of its cell in
+  overhead: the cell pointer, the rowid and the record header.
+  Whole blobs that packing put on the same page are bundled into one
+  row, up to the largest record that stays on the leaf page, each
+  costing an offset and a size in splits instead of a cell of its
+  own.  Their fragments were going to be read together anyway.  Hot
+  and cold blobs are bundled separately, so that hot pages stay hot.
+*/
+
+static void unbundle(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 frag_no;
+
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++) {
+        if (c->row_next[frag_no]>=0)
+            c->cell_size[frag_no]=
+                blob_space(c->id_max,c->size[frag_no],g->page_size).cell_size;
+        c->row_lead[frag_no]=frag_no;
+        c->row_next[frag_no]=-1;
+        c->row_offset[frag_no]=0;
+    }
+    c->bundled_cnt=c->bundle_cnt=0;
+}
+
+static void end_bundle(
+    globals *g,
+    sqlite3_int64 lead)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 frag_no;
+
+    if (c->row_next[lead]<0)
+        return;
+    c->cell_size[lead]=
+        blob_space(c->id_max,row_size(c,lead),g->page_size).cell_size;
+    for (frag_no=lead; frag_no>=0; frag_no=c->row_next[frag_no])
+        c->bundled_cnt++;
+    c->bundle_cnt++;
+}
+
+/*
+  Bundles are built from the pages of a packing without them, given
+  as page_of.  The page arrays page_link and page_order aren't in use
+  between packings, so they hold the lead and the last fragment of the
+  bundle being built on each page.
+*/
+
+static void bundle_pages(
+    globals *g,
+    sqlite3_int64 const *page_of,
+    sqlite3_int64 page_cnt,
+    unsigned int max_rec)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 *lead,*last;
+    sqlite3_int64 split_no,frag_no,page_id,size;
+    int hot;
+
+    lead=c->page_link;
+    last=c->page_order;
+    for (hot=c->split_heat!=NULL; hot>=0; hot--) {
+        for (page_id=0; page_id<=page_cnt; page_id++)
+            lead[page_id]=-1;
+        for (split_no=0; split_no<c->split_cnt; split_no++) {
+            if (c->split_frags[split_no]!=1
+                    || c->split_kept && c->split_kept[split_no]
+                    || c->split_heat
+                        && (c->split_heat[split_no]>0)!=hot)
+                continue;
+            frag_no=c->first_frag[split_no];
+            page_id=page_of[frag_no];
+            if (!page_id || blob_rec_size(c->size[frag_no])>max_rec)
+                continue;
+            if (lead[page_id]>=0) {
+                size=row_size(c,lead[page_id]);
+                if (blob_rec_size(size+c->size[frag_no])<=max_rec) {
+                    c->row_lead[frag_no]=lead[page_id];
+                    c->row_offset[frag_no]=size;
+                    c->row_next[last[page_id]]=frag_no;
+                    last[page_id]=frag_no;
+                    continue;
+                }
+                end_bundle(g,lead[page_id]);
+            }
+            lead[page_id]=last[page_id]=frag_no;
+        }
+        for (page_id=1; page_id<=page_cnt; page_id++) {
+            if (lead[page_id]>=0)
+                end_bundle(g,lead[page_id]);
+        }
+    }
+}
+
+/*
+  Sort the fragments by fill_key and return the smallest cell size
+  among those that get placed.
+*/
+
+static unsigned int sort_frags(
+    catalog *c,
+    sqlite3_int64 *counts,
+    unsigned int key_cnt,
+    unsigned int max_space)
+{
+    sqlite3_int64 frag_no,i;
+    unsigned int min_size,cell_size;
+
+    memset(counts,0,(key_cnt+1)*sizeof *counts);
+    min_size=max_space;
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++) {
+        cell_size=c->cell_size[frag_no];
+        assert(cell_size<=max_space);
+        if (cell_size<min_size && lead_of(c,frag_no)==frag_no)
+            min_size=cell_size;
+        counts[fill_key(c,frag_no,max_space)+1]++;
+    }
+    for (i=1; i<=key_cnt; i++)
+        counts[i]+=counts[i-1];
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++)
+        c->frag_order[counts[fill_key(c,frag_no,max_space)]++]=frag_no;
+    return min_size;
+}
+
+/*
+  Bundles only pay off if repacking with them saves more than the
+  slice columns cost: a byte of record header in every splits row
+  each, and the offset and size of each bundled blob.
+*/
+
+static sqlite3_int64 bundle_cost(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 cost,frag_no;
+
+    cost=c->page_cnt*g->page_size;
+    if (!c->bundle_cnt)
+        return cost;
+    cost+=2*c->split_cnt;
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++) {
+        if (bundled(c,frag_no))
+            cost+=int_size(c->row_offset[frag_no])+int_size(c->size[frag_no]);
+    }
+    return cost;
+}
+
+/*
+  Big bundles leave few small cells to fill the gaps between big ones,
+  so a few bundle sizes are tried, from 1/32 of the largest record
+  that stays on the leaf page up to all of it, and the one that comes
+  out cheapest is kept, if it beats no bundles at all.
+*/
+
+static int choose_bundles(
+    globals *g,
+    space_index *index,
+    sqlite3_int64 *counts,
+    unsigned int key_cnt)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 *page_of;
+    sqlite3_int64 page_cnt,cost,best_cost;
+    unsigned int max_space,max_rec,best_rec;
+    int shift;
+
+    progress(g,"Choosing bundles...\n");
+    max_space=g->page_size-8;
+    page_of=sqlite3_malloc64((c->frag_cnt ? c->frag_cnt : 1)*sizeof *page_of);
+    if (!page_of) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    unbundle(g);
+    pack_pages(g,index,0,sort_frags(c,counts,key_cnt,max_space));
+    memcpy(page_of,c->page_id,c->frag_cnt*sizeof *page_of);
+    page_cnt=c->page_cnt;
+    best_cost=bundle_cost(g);
+    best_rec=0;
+    for (shift=5; shift>=0; shift--) {
+        max_rec=(g->page_size-35)>>shift;
+        unbundle(g);
+        bundle_pages(g,page_of,page_cnt,max_rec);
+        if (!c->bundle_cnt)
+            continue;
+        pack_pages(g,index,0,sort_frags(c,counts,key_cnt,max_space));
+        cost=bundle_cost(g);
+        if (cost<best_cost) {
+            best_cost=cost;
+            best_rec=max_rec;
+        }
+    }
+    unbundle(g);
+    if (best_rec)
+        bundle_pages(g,page_of,page_cnt,best_rec);
+    sqlite3_free(page_of);
+    fprintf(stderr,"Tail packing: %lld blobs in %lld rows\n",
+            c->bundled_cnt,c->bundle_cnt);
+    return 0;
+}
+
+/*
+  With adaptive splits, the fixed splits are packed first to have
+  something to compare with, and restored if adapting doesn't help.
+  Fragments are visited in the order of their fixed cell sizes either
+  way, and a split is placed when the first of its fragments comes up.
+*/
+
+static int fill_pages(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    space_index *index=NULL;
+    sqlite3_int64 *counts=NULL;
+    sqlite3_int64 i;
+    unsigned int max_space,min_size,key_cnt;
+
+    progress(g,"Packing fragments into pages...\n");
+    max_space=g->page_size-8;
+    key_cnt=c->split_heat ? 2*(max_space+1) : max_space+1;
+    index=sqlite3_malloc(sizeof *index);
+    counts=sqlite3_malloc64((key_cnt+1)*sizeof *counts);
+    if (index)
+        index->heads=sqlite3_malloc64((max_space+1)*sizeof *index->heads);
+    if (!index || !counts || !index->heads) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+
+    if (c->row_lead && choose_bundles(g,index,counts,key_cnt))
+        return -1;
+    min_size=sort_frags(c,counts,key_cnt,max_space);
+    pack_pages(g,index,0,min_size);
+    c->saved_cnt=0;
+    if (g->adaptive_splits) {
+        sqlite3_int64 fixed_cnt;
+
+        /* an adapted fragment can be as small as one byte */
+        fixed_cnt=c->page_cnt;
+        pack_pages(g,index,1,blob_space(c->id_max,1,g->page_size).cell_size);
+        if (c->page_cnt>fixed_cnt) {
+            for (i=0; i<c->split_cnt; i++) {
+                sqlite3_int64 head;
+                int subset;
+
+                if (c->split_frags[i]!=2
+                        || c->split_kept && c->split_kept[i])
+                    continue;
+                head=c->first_frag[i];
+                set_head_size(g,i,split_point(
+                    g,c->id_max,c->size[head]+c->size[head+1],&subset));
+            }
+            pack_pages(g,index,0,min_size);
+        }
+        c->saved_cnt=fixed_cnt-c->page_cnt;
+        fprintf(stderr,"Adaptive splits: %lld leaf pages instead of %lld\n",
+                c->page_cnt,fixed_cnt);
+    }
+
+    sqlite3_free(index->heads);
+    sqlite3_free(index);
+    sqlite3_free(counts);
+
+/*
+  A split is undone if either
+  a) both fragments end up on the same page, or
+  b) both fragments end up as the only ones on their respective pages.
+
+  One pass over the splits does it, since a split's fragments are
+  adjacent.  The page fragment counts are left alone, so every split
+  is judged by the same packing.  The cell_size array isn't updated,
+  but it's not used after this step.  Kept splits aren't on any page
+  and stay as they were.
+*/
+
+    for (i=0; i<c->split_cnt; i++) {
+        sqlite3_int64 head,tail;
+
+        if (c->split_frags[i]!=2 || c->split_kept && c->split_kept[i])
+            continue;
+        head=c->first_frag[i];
+        tail=head+1;
+        if (c->page_id[head]==c->page_id[tail]
+                || c->page_frags[c->page_id[head]]==1
+                    && c->page_frags[c->page_id[tail]]==1) {
+            c->size[head]+=c->size[tail];
+            c->page_id[tail]=0;
+            c->split_frags[i]=1;
+            c->unsplit_cnt++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+  Goal: for each split, select head and tail ids that are close together.
+
+  Consider splits and pages as the vertex subsets of a bipartite graph
+  with fragments as the edges.  Do a breadth-first traversal of each
+  connected subgraph, ordering pages as found.
+
+  Generate the final fragment order from the page order.
+
+  The page to fragment edges are laid out in compressed row form:
+  the fragments on page p are frag_order[start[p]..start[p+1]-1],
+  in fragment order.  Unsplitting leaves some fragments without a page.
+*/
+
+static void visit_split(
+    catalog *c,
+    sqlite3_int64 split_no,
+    sqlite3_int64 *queued)
+{
+    sqlite3_int64 frag_no,end,page_id;
+
+    c->split_seen[split_no]=1;
+    end=c->first_frag[split_no]+c->split_frags[split_no];
+    for (frag_no=c->first_frag[split_no]; frag_no<end; frag_no++) {
+        page_id=c->page_id[lead_of(c,frag_no)];
+        if (!c->page_seen[page_id]) {
+            c->page_seen[page_id]=1;
+            c->page_order[(*queued)++]=page_id;
+        }
+    }
+}
+
+/*
+  Expand the queued pages, following only hot splits if hot_only.
+*/
+
+static void expand_pages(
+    catalog *c,
+    sqlite3_int64 const *start,
+    int hot_only,
+    sqlite3_int64 *visited,
+    sqlite3_int64 *queued)
+{
+    sqlite3_int64 page_id,other,i;
+
+    while (*visited<*queued) {
+        page_id=c->page_order[(*visited)++];
+        for (i=start[page_id]; i<start[page_id+1]; i++) {
+            other=c->split_no[c->frag_order[i]];
+            if (c->split_seen[other])
+                continue;
+            if (hot_only && !(c->split_heat[other]>0))
+                continue;
+            visit_split(c,other,queued);
+        }
+    }
+}
+
+/*
+  Hot splits are traversed first, hottest first and without leaving
+  them, so their pages make up the start of the order.  The traversal
+  then starts over from those pages to pick up the cold splits that
+  share them.  Kept splits count as seen from the start, since their
+  fragments aren't on any page.
+*/
+
+static sqlite3_int64 bfs_pages(
+    catalog *c,
+    sqlite3_int64 const *start,
+    sqlite3_int64 const *hot,
+    sqlite3_int64 hot_cnt)
+{
+    sqlite3_int64 split_no,queued,visited,i;
+
+    if (c->split_kept) {
+        memcpy(c->split_seen,c->split_kept,c->split_cnt);
+    } else {
+        memset(c->split_seen,0,c->split_cnt);
+    }
+    memset(c->page_seen,0,c->page_cnt+1);
+    queued=visited=0;
+    for (i=0; i<hot_cnt; i++) {
+        if (c->split_seen[hot[i]])
+            continue;
+        visit_split(c,hot[i],&queued);
+        expand_pages(c,start,1,&visited,&queued);
+    }
+    visited=0;
+    expand_pages(c,start,0,&visited,&queued);
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        if (c->split_seen[split_no])
+            continue;
+        visit_split(c,split_no,&queued);
+        expand_pages(c,start,0,&visited,&queued);
+    }
+    return queued;
+}
+
+/*
+  The implicit split layout chains pages together so that as many
+  splits as possible get consecutive final ids: one fragment goes last
+  on a page and the other first on the next page.  page_in and
+  page_out record those fragments.
+
+  From the current page, follow a split to a page that hasn't been
+  placed yet whenever possible.  Otherwise continue from the queue of
+  pages seen so far, falling back on the next split in id order.
+  This keeps the breadth-first locality for the remaining splits.
+  Hot splits are chained first, the same way as in bfs_pages.
+*/
+
+static sqlite3_int64 partner_frag(
+    catalog const *c,
+    sqlite3_int64 frag_no)
+{
+    sqlite3_int64 split_no,first;
+
+    split_no=c->split_no[frag_no];
+    if (c->split_frags[split_no]!=2)
+        return -1;
+    first=c->first_frag[split_no];
+    return frag_no==first ? first+1 : first;
+}
+
+#define PAGE_QUEUED 1
+#define PAGE_PLACED 2
+
+typedef struct page_chain {
+    sqlite3_int64 *pending;
+    sqlite3_int64 pend_head;
+    sqlite3_int64 pend_tail;
+    sqlite3_int64 placed;
+} page_chain;
+
+static void chain_from(
+    catalog *c,
+    sqlite3_int64 const *start,
+    int hot_only,
+    page_chain *ch,
+    sqlite3_int64 page_id)
+{
+    sqlite3_int64 i;
+
+    for (;;) {
+        if (page_id>0 && c->page_seen[page_id]!=PAGE_PLACED) {
+            sqlite3_int64 next;
+
+            c->page_seen[page_id]=PAGE_PLACED;
+            c->page_order[ch->placed++]=page_id;
+            next=0;
+            for (i=start[page_id]; i<start[page_id+1]; i++) {
+                sqlite3_int64 f,partner,other;
+
+                f=c->frag_order[i];
+                partner=partner_frag(c,f);
+                if (partner<0)
+                    continue;
+                if (hot_only && !(c->split_heat[c->split_no[f]]>0))
+                    continue;
+                other=c->page_id[partner];
+                if (c->page_seen[other]==PAGE_PLACED)
+                    continue;
+                if (!next && f!=c->page_in[page_id]) {
+                    next=other;
+                    c->page_out[page_id]=f;
+                    c->page_in[other]=partner;
+                } else if (!c->page_seen[other]) {
+                    c->page_seen[other]=PAGE_QUEUED;
+                    ch->pending[ch->pend_tail++]=other;
+                }
+            }
+            if (next) {
+                page_id=next;
+                continue;
+            }
+        }
+        page_id=0;
+        while (ch->pend_head<ch->pend_tail) {
+            page_id=ch->pending[ch->pend_head++];
+            if (c->page_seen[page_id]!=PAGE_PLACED)
+                break;
+            page_id=0;
+        }
+        if (!page_id)
+            return;
+    }
+}
+
+static int chain_pages(
+    catalog *c,
+    sqlite3_int64 const *start,
+    sqlite3_int64 const *hot,
+    sqlite3_int64 hot_cnt,
+    sqlite3_int64 *placed_ptr)
+{
+    page_chain ch;
+    sqlite3_int64 split_no,frag_no,page_id,end,i;
+
+    ch.pending=sqlite3_malloc64((c->page_cnt+1)*sizeof *ch.pending);
+    c->page_in=sqlite3_malloc64((c->page_cnt+1)*sizeof *c->page_in);
+    c->page_out=sqlite3_malloc64((c->page_cnt+1)*sizeof *c->page_out);
+    if (!ch.pending || !c->page_in || !c->page_out) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    for (page_id=0; page_id<=c->page_cnt; page_id++)
+        c->page_in[page_id]=c->page_out[page_id]=-1;
+
+    memset(c->page_seen,0,c->page_cnt+1);
+    ch.pend_head=ch.pend_tail=ch.placed=0;
+    for (i=0; i<hot_cnt; i++) {
+        end=c->first_frag[hot[i]]+c->split_frags[hot[i]];
+        for (frag_no=c->first_frag[hot[i]]; frag_no<end; frag_no++)
+            chain_from(c,start,1,&ch,c->page_id[lead_of(c,frag_no)]);
+    }
+    for (i=0; i<ch.placed; i++) {
+        sqlite3_int64 j;
+
+        page_id=c->page_order[i];
+        for (j=start[page_id]; j<start[page_id+1]; j++) {
+            sqlite3_int64 partner,other;
+
+            partner=partner_frag(c,c->frag_order[j]);
+            if (partner<0)
+                continue;
+            other=c->page_id[partner];
+            if (!c->page_seen[other]) {
+                c->page_seen[other]=PAGE_QUEUED;
+                ch.pending[ch.pend_tail++]=other;
+            }
+        }
+    }
+    chain_from(c,start,0,&ch,0);
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        end=c->first_frag[split_no]+c->split_frags[split_no];
+        for (frag_no=c->first_frag[split_no]; frag_no<end; frag_no++)
+            chain_from(c,start,0,&ch,c->page_id[lead_of(c,frag_no)]);
+    }
+
+    sqlite3_free(ch.pending);
+    *placed_ptr=ch.placed;
+    return 0;
+}
+
+/*
+  Hot splits, hottest first.
+*/
+
+typedef struct hot_split {
+    double heat;
+    sqlite3_int64 split_no;
+} hot_split;
+
+static int compare_heat(
+    void const *a,
+    void const *b)
+{
+    hot_split const *ha=a,*hb=b;
+
+    if (ha->heat!=hb->heat)
+        return ha->heat>hb->heat ? -1 : 1;
+    if (ha->split_no!=hb->split_no)
+        return ha->split_no<hb->split_no ? -1 : 1;
+    return 0;
+}
+
+static int hot_splits(
+    catalog const *c,
+    sqlite3_int64 **hot_ptr,
+    sqlite3_int64 *hot_cnt)
+{
+    hot_split *splits;
+    sqlite3_int64 *hot;
+    sqlite3_int64 split_no,cnt,i;
+
+    *hot_ptr=NULL;
+    *hot_cnt=0;
+    if (!c->split_heat)
+        return 0;
+    cnt=0;
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        if (c->split_heat[split_no]>0)
+            cnt++;
+    }
+    splits=sqlite3_malloc64((cnt ? cnt : 1)*sizeof *splits);
+    hot=sqlite3_malloc64((cnt ? cnt : 1)*sizeof *hot);
+    if (!splits || !hot) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    cnt=0;
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        if (c->split_heat[split_no]>0) {
+            splits[cnt].heat=c->split_heat[split_no];
+            splits[cnt].split_no=split_no;
+            cnt++;
+        }
+    }
+    qsort(splits,cnt,sizeof *splits,compare_heat);
+    for (i=0; i<cnt; i++)
+        hot[i]=splits[i].split_no;
+    sqlite3_free(splits);
+    *hot_ptr=hot;
+    *hot_cnt=cnt;
+    return 0;
+}
+
+static int order_frags(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 *start;
+    sqlite3_int64 *hot;
+    sqlite3_int64 frag_no,page_id,hot_cnt;
+    sqlite3_int64 queued,visited,final_id,i;
+
+    progress(g,"Ordering pages...\n");
+    if (hot_splits(c,&hot,&hot_cnt))
+        return -1;
+    start=c->page_link;
+    memset(start,0,(c->page_cnt+2)*sizeof *start);
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++) {
+        page_id=c->page_id[frag_no];
+        if (page_id)
+            start[page_id]++;
+    }
+    for (page_id=1; page_id<=c->page_cnt; page_id++)
+        start[page_id]+=start[page_id-1];
+    start[c->page_cnt+1]=start[c->page_cnt];
+    for (frag_no=c->frag_cnt; frag_no-->0; ) {
+        page_id=c->page_id[frag_no];
+        if (page_id)
+            c->frag_order[--start[page_id]]=frag_no;
+    }
+
+    if (g->implicit_splits) {
+        if (chain_pages(c,start,hot,hot_cnt,&queued))
+            return -1;
+    } else {
+        queued=bfs_pages(c,start,hot,hot_cnt);
+    }
+    sqlite3_free(hot);
+
+    progress(g,"Ordering fragments...\n");
+    final_id=c->id_base;
+    for (visited=0; visited<queued; visited++) {
+        sqlite3_int64 in,out;
+
+        page_id=c->page_order[visited];
+        in=out=-1;
+        if (c->page_in) {
+            in=c->page_in[page_id];
+            out=c->page_out[page_id];
+        }
+        if (in>=0)
+            c->final_id[in]=++final_id;
+        for (i=start[page_id]; i<start[page_id+1]; i++) {
+            frag_no=c->frag_order[i];
+            if (frag_no!=in && frag_no!=out)
+                c->final_id[frag_no]=++final_id;
+        }
+        if (out>=0)
+            c->final_id[out]=++final_id;
+    }
+    c->final_cnt=final_id-c->id_base;
+    if (c->row_lead) {
+        for (frag_no=0; frag_no<c->frag_cnt; frag_no++)
+            c->final_id[frag_no]=c->final_id[c->row_lead[frag_no]];
+    }
+
+    return 0;
+}
+
+/*
+  Resuming.  Fragments are committed in batches, in final id order, and
+  the splits table is only written after the last of them, so the
+  destination tells how far an interrupted run got: either the output
+  tables don't exist yet, or frags holds a prefix of the final ids,
+  or splits is filled and the output is complete.
+*/
+
+#define CHECKPOINT_BATCH (64<<20)
+
+static int find_resume_point(
+    globals *g,
+    sqlite3_int64 *written,
+    int *complete)
+{
+    sqlite3_stmt *find=NULL;
+    int status;
+
+    status=sqlite3_prepare_v2(
+        g->db,find_output_sql,sizeof find_output_sql,&find,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(find_output): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(find);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(find_output): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    if (!sqlite3_column_int(find,0)) {
+        sqlite3_finalize(find);
+        *written=-1;
+        *complete=0;
+        return 0;
+    }
+    sqlite3_finalize(find);
+
+    status=sqlite3_prepare_v2(
+        g->db,resume_point_sql,sizeof resume_point_sql,&find,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(resume_point): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(find);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(resume_point): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    *written=sqlite3_column_int64(find,0);
+    *complete=sqlite3_column_int(find,1);
+    sqlite3_finalize(find);
+    if (*written>g->cat.final_cnt) {
+        fprintf(stderr,"%s: More fragments than planned\n",g->dst_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  The split checksums are combined from fragment checksums,
+  so those of the fragments already written are read back.
+*/
+
+static int resume_crcs(
+    globals *g,
+    sqlite3_int64 written)
+{
+    catalog *c=&g->cat;
+    sqlite3_stmt *list=NULL;
+    sqlite3_int64 next;
+    char msg[100];
+    int status;
+
+    sqlite3_snprintf(sizeof msg,msg,
+                     "Resuming after fragment %lld of %lld...\n",
+                     written,c->final_cnt);
+    progress(g,msg);
+    status=sqlite3_prepare_v2(
+        g->db,list_written_frags_sql,sizeof list_written_frags_sql,
+        &list,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(list_written_frags): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_bind_int64(list,1,written);
+    next=1;
+    for (;;) {
+        sqlite3_int64 frag_no,piece;
+        unsigned char const *val;
+        int size;
+
+        status=sqlite3_step(list);
+        if (status!=SQLITE_ROW)
+            break;
+        if (sqlite3_column_int64(list,0)!=next) {
+            fprintf(stderr,"%s: Fragment %lld is missing\n",
+                    g->dst_path,next);
+            return -1;
+        }
+        frag_no=c->frag_order[next-1];
+        val=sqlite3_column_blob(list,1);
+        size=sqlite3_column_bytes(list,1);
+        if (!val && size>0) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        if (size!=row_size(c,frag_no)) {
+            fprintf(stderr,"%s: Fragment %lld doesn't match the plan\n",
+                    g->dst_path,next);
+            return -1;
+        }
+        for (piece=frag_no; piece>=0; piece=next_piece(c,piece)) {
+            sqlite3_int64 offset;
+
+            offset=piece==frag_no ? 0 : c->row_offset[piece];
+            c->crc[piece]=crc32c(0,val+offset,c->size[piece]);
+        }
+        next++;
+    }
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(list_written_frags): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_finalize(list);
+    return 0;
+}
+
+/*
+  Write the output tables in rowid order.  Yes, this means that
+  split source blobs are read twice, but since the destination database
+  won't need vacuuming, it's a net win measured by total i/o.
+
+  The fragments are written first so that each split's checksum
+  can be combined from its fragments' checksums, computed on the way.
+  Both tables are created up front, so the splits table still gets
+  the lower root page.
+*/
+
+static int write_frags(
+    globals *g,
+    sqlite3_int64 written)
+{
+    catalog *c=&g->cat;
+    sqlite3_stmt *insert=NULL;
+    source_blob blob;
+    unsigned char *buf=NULL;
+    sqlite3_int64 buf_size,blob_split,batch_size,frag_no,i;
+    char *errmsg=NULL;
+    int status;
+
+    progress(g,"Writing output fragments...\n");
+    status=sqlite3_prepare_v2(
+        g->db,insert_frag_sql,sizeof insert_frag_sql,&insert,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(insert_frag): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++) {
+        if (c->page_id[frag_no])
+            c->frag_order[c->final_id[frag_no]-c->id_base-1]=frag_no;
+    }
+    if (written>0 && resume_crcs(g,written))
+        return -1;
+
+    buf_size=0;
+    memset(&blob,0,sizeof blob);
+    blob_split=-1;
+    batch_size=0;
+    for (i=written; i<c->final_cnt; i++) {
+        unsigned char const *bytes;
+        sqlite3_int64 size;
+
+        frag_no=c->frag_order[i];
+        size=row_size(c,frag_no);
+        if (c->split_no[frag_no]!=blob_split) {
+            blob_split=c->split_no[frag_no];
+            if (open_blob(g,&blob,blob_split))
+                return -1;
+        }
+        if (blob.data && next_piece(c,frag_no)<0) {
+            /* mapped from a file: no copy */
+            bytes=blob.data+c->offset[frag_no];
+            c->crc[frag_no]=crc32c(0,bytes,size);
+        } else {
+            sqlite3_int64 piece;
+
+            if (size>buf_size) {
+                sqlite3_free(buf);
+                buf_size=size;
+                buf=sqlite3_malloc64(buf_size);
+                if (!buf) {
+                    fputs(oom_msg,stderr);
+                    return -1;
+                }
+            }
+            /* a bundle is put together piece by piece */
+            for (piece=frag_no; piece>=0; piece=next_piece(c,piece)) {
+                unsigned char *dst;
+
+                if (c->split_no[piece]!=blob_split) {
+                    blob_split=c->split_no[piece];
+                    if (open_blob(g,&blob,blob_split))
+                        return -1;
+                }
+                dst=buf+(piece==frag_no ? 0 : c->row_offset[piece]);
+                if (read_blob(g,&blob,dst,c->size[piece],c->offset[piece]))
+                    return -1;
+                c->crc[piece]=crc32c(0,dst,c->size[piece]);
+            }
+            bytes=buf;
+        }
+
+        sqlite3_bind_int64(insert,1,c->id_base+i+1);
+        if (size>0) {
+            status=sqlite3_bind_blob64(insert,2,bytes,size,SQLITE_STATIC);
+        } else {
+            status=sqlite3_bind_zeroblob(insert,2,0);
+        }
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"sqlite3_bind(insert_frag): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+        status=sqlite3_step(insert);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(insert_frag): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+        sqlite3_reset(insert);
+
+        batch_size+=size;
+        if (g->checkpoint && batch_size>=CHECKPOINT_BATCH) {
+            batch_size=0;
+            status=sqlite3_exec(g->db,commit_sql,0,NULL,&errmsg);
+            if (status!=SQLITE_OK) {
+                fprintf(stderr,"Failed to commit transaction: %s\n",errmsg);
+                return -1;
+            }
+            status=sqlite3_exec(g->db,begin_sql,0,NULL,&errmsg);
+            if (status!=SQLITE_OK) {
+                fprintf(stderr,"Failed to start transaction: %s\n",errmsg);
+                return -1;
+            }
+        }
+    }
+
+    sqlite3_finalize(insert);
+    close_blob(g,&blob);
+    sqlite3_free(buf);
+    return 0;
+}
+
+/*
+  In the implicit split layout, the frag column packs the id of the
+  first fragment with a two-bit kind:
+      0: the blob is in one fragment
+      1: the head is at id, the tail at id+1
+      2: the tail is at id, the head at id+1
+      3: the head is at id, the tail is in the tail column
+*/
+
+static int implicit_frag(
+    catalog const *c,
+    sqlite3_int64 owner,
+    sqlite3_int64 *frag,
+    sqlite3_int64 *tail)
+{
+    sqlite3_int64 head_id,tail_id;
+
+    head_id=c->final_id[c->first_frag[owner]];
+    if (c->split_frags[owner]<2) {
+        *frag=head_id*4;
+        return 0;
+    }
+    tail_id=c->final_id[c->first_frag[owner]+1];
+    if (tail_id==head_id+1) {
+        *frag=head_id*4+1;
+        return 1;
+    }
+    if (head_id==tail_id+1) {
+        *frag=tail_id*4+2;
+        return 2;
+    }
+    *frag=head_id*4+3;
+    *tail=tail_id;
+    return 3;
+}
+
+static int write_splits(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    sqlite3_stmt *insert=NULL;
+    sqlite3_int64 split_no,split_cnt,explicit_cnt;
+    int status;
+
+    progress(g,"Writing output splits...\n");
+    if (g->implicit_splits && c->bundle_cnt>0) {
+        status=sqlite3_prepare_v2(
+            g->db,insert_sliced_implicit_split_sql,
+            sizeof insert_sliced_implicit_split_sql,&insert,NULL);
+    } else if (c->bundle_cnt>0) {
+        status=sqlite3_prepare_v2(
+            g->db,insert_sliced_split_sql,sizeof insert_sliced_split_sql,
+            &insert,NULL);
+    } else if (g->implicit_splits && g->prev_path) {
+        status=sqlite3_prepare_v2(
+            g->db,upsert_implicit_split_sql,sizeof upsert_implicit_split_sql,
+            &insert,NULL);
+    } else if (g->implicit_splits) {
+        status=sqlite3_prepare_v2(
+            g->db,insert_implicit_split_sql,sizeof insert_implicit_split_sql,
+            &insert,NULL);
+    } else if (g->prev_path) {
+        status=sqlite3_prepare_v2(
+            g->db,upsert_split_sql,sizeof upsert_split_sql,&insert,NULL);
+    } else {
+        status=sqlite3_prepare_v2(
+            g->db,insert_split_sql,sizeof insert_split_sql,&insert,NULL);
+    }
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(insert_split): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+
+    split_cnt=explicit_cnt=0;
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        sqlite3_int64 owner,head,tail;
+        unsigned int crc;
+
+        owner=c->same_as[split_no]>=0 ? c->same_as[split_no] : split_no;
+        sqlite3_bind_int64(insert,1,c->split_id[split_no]);
+        if (c->split_frags[owner]>0) {
+            head=c->first_frag[owner];
+            tail=head+1;
+            crc=c->crc[head];
+            if (c->split_frags[owner]>1)
+                crc=crc32c_combine(crc,c->crc[tail],c->size[tail]);
+            if (g->implicit_splits) {
+                sqlite3_int64 frag,tail_id;
+
+                if (c->split_frags[owner]>1)
+                    split_cnt++;
+                if (implicit_frag(c,owner,&frag,&tail_id)==3) {
+                    sqlite3_bind_int64(insert,4,tail_id);
+                    explicit_cnt++;
+                }
+                sqlite3_bind_int64(insert,2,frag);
+                sqlite3_bind_int64(insert,3,crc);
+            } else {
+                sqlite3_bind_int64(insert,2,c->final_id[head]);
+                if (c->split_frags[owner]>1)
+                    sqlite3_bind_int64(insert,3,c->final_id[tail]);
+                sqlite3_bind_int64(insert,4,crc);
+            }
+            if (bundled(c,head)) {
+                sqlite3_bind_int64(insert,5,c->row_offset[head]);
+                sqlite3_bind_int64(insert,6,c->size[head]);
+            }
+        }
+        status=sqlite3_step(insert);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(insert_split): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+        sqlite3_reset(insert);
+        sqlite3_clear_bindings(insert);
+    }
+
+    sqlite3_finalize(insert);
+    if (g->implicit_splits) {
+        char msg[100];
+
+        sqlite3_snprintf(sizeof msg,msg,
+                         "%lld of %lld split blobs have adjacent fragments\n",
+                         split_cnt-explicit_cnt,split_cnt);
+        progress(g,msg);
+    }
+    return 0;
+}
+
+/*
+  Blobs from file sources are named after their files, and blobs from
+  packed sources keep their names, if any.
+  With --previous, rows that are already right are left alone,
+  here as in the splits table, so their pages stay the same.
 */
 
-static int fill_pages(
+static int write_names(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    sqlite3_stmt *insert=NULL;
+    sqlite3_stmt **lookups;
+    sqlite3_int64 split_no;
+    int src_no,status;
+
+    lookups=sqlite3_malloc64(g->src_cnt*sizeof *lookups);
+    if (!lookups) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    for (src_no=0; src_no<g->src_cnt; src_no++) {
+        lookups[src_no]=NULL;
+        if (!(g->srcs.layouts[src_no] & SOURCE_NAMED))
+            continue;
+        status=sqlite3_prepare_v2(
+            g->srcs.dbs[src_no],find_source_name_sql,
+            sizeof find_source_name_sql,&lookups[src_no],NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"%s: sqlite3_prepare(find_source_name): %s\n",
+                    g->src_paths[src_no],sqlite3_errmsg(g->srcs.dbs[src_no]));
+            return -1;
+        }
+    }
+
+    if (g->prev_path) {
+        status=sqlite3_prepare_v2(
+            g->db,upsert_name_sql,sizeof upsert_name_sql,&insert,NULL);
+    } else {
+        status=sqlite3_prepare_v2(
+            g->db,insert_name_sql,sizeof insert_name_sql,&insert,NULL);
+    }
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(insert_name): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        filesrc *files;
+        sqlite3_stmt *lookup;
+        sqlite3_int64 id;
+
+        src_no=c->split_src[split_no];
+        files=g->srcs.files[src_no];
+        lookup=lookups[src_no];
+        id=c->split_id[split_no]-shift_of(g,src_no);
+        if (files) {
+            sqlite3_bind_text(
+                insert,2,filesrc_name(files,file_entry(&g->srcs,src_no,id)),
+                -1,SQLITE_STATIC);
+        } else if (lookup) {
+            sqlite3_bind_int64(lookup,1,id);
+            status=sqlite3_step(lookup);
+            if (status==SQLITE_DONE) {
+                sqlite3_reset(lookup);
+                continue;
+            }
+            if (status!=SQLITE_ROW) {
+                fprintf(stderr,"%s: sqlite3_step(find_source_name): %s\n",
+                        g->src_paths[src_no],
+                        sqlite3_errmsg(g->srcs.dbs[src_no]));
+                return -1;
+            }
+            sqlite3_bind_value(insert,2,sqlite3_column_value(lookup,0));
+        } else {
+            continue;
+        }
+        sqlite3_bind_int64(insert,1,c->split_id[split_no]);
+        status=sqlite3_step(insert);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(insert_name): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+        sqlite3_reset(insert);
+        if (lookup)
+            sqlite3_reset(lookup);
+    }
+    sqlite3_finalize(insert);
+    for (src_no=0; src_no<g->src_cnt; src_no++)
+        sqlite3_finalize(lookups[src_no]);
+    sqlite3_free(lookups);
+    return 0;
+}
+
+/*
+  With --previous, the fragments that aren't kept and the blobs that
+  are gone are deleted from the copy before anything is written, so
+  that SQLite reuses their pages for the new fragments rather than
+  moving everything after them.
+*/
+
+static int delete_row(
+    globals *g,
+    sqlite3_stmt *del,
+    sqlite3_int64 id)
+{
+    int status;
+
+    sqlite3_bind_int64(del,1,id);
+    status=sqlite3_step(del);
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(delete): %s\n",sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_reset(del);
+    return 0;
+}
+
+static int remove_stale(
+    globals *g)
+{
+    catalog *c=&g->cat;
+    previous *p=&g->prev;
+    sqlite3_stmt *query=NULL;
+    sqlite3_int64 id,i;
+    char *errmsg=NULL;
+    int status,names;
+
+    progress(g,"Removing stale rows...\n");
+    status=sqlite3_prepare_v2(
+        g->db,delete_frag_sql,sizeof delete_frag_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(delete_frag): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    for (id=1; id<=c->id_base; id++) {
+        if (!kept_bit(p,id) && delete_row(g,query,id))
+            return -1;
+    }
+    sqlite3_finalize(query);
+
+    status=sqlite3_prepare_v2(
+        g->db,delete_split_sql,sizeof delete_split_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(delete_split): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    for (i=0; i<p->gone_cnt; i++) {
+        if (delete_row(g,query,p->gone[i]))
+            return -1;
+    }
+    sqlite3_finalize(query);
+
+    status=sqlite3_prepare_v2(
+        g->db,find_names_sql,sizeof find_names_sql,&query,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(find_names): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(query);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(find_names): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    names=sqlite3_column_int(query,0);
+    sqlite3_finalize(query);
+    if (names) {
+        status=sqlite3_exec(g->db,delete_stale_names_sql,0,NULL,&errmsg);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"Failed to delete stale names: %s\n",errmsg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_output(
+    globals *g)
+{
+    char *errmsg=NULL;
+    sqlite3_int64 written;
+    int status,complete;
+
+    written=-1;
+    complete=0;
+    if (g->resume && find_resume_point(g,&written,&complete))
+        return -1;
+    if (complete) {
+        progress(g,"Output is already complete\n");
+        return 0;
+    }
+    if (written<0) {
+        if (!g->prev_path) {
+            status=sqlite3_exec(
+                g->db,
+                g->implicit_splits
+                    ? create_implicit_output_sql : create_output_sql,
+                0,NULL,&errmsg);
+            if (status!=SQLITE_OK) {
+                fprintf(stderr,"Failed to create output tables: %s\n",
+                        errmsg);
+                return -1;
+            }
+        }
+        if (g->cat.bundle_cnt>0) {
+            status=sqlite3_exec(g->db,add_slice_columns_sql,0,NULL,&errmsg);
+            if (status!=SQLITE_OK) {
+                fprintf(stderr,"Failed to add slice columns: %s\n",errmsg);
+                return -1;
+            }
+        }
+        if (named_sources(g)) {
+            status=sqlite3_exec(g->db,create_names_sql,0,NULL,&errmsg);
+            if (status!=SQLITE_OK) {
+                fprintf(stderr,"Failed to create names table: %s\n",errmsg);
+                return -1;
+            }
+        }
+        written=0;
+    }
+    iotrace_phase("remove stale");
+    if (g->prev_path && remove_stale(g))
+        return -1;
+    iotrace_phase("write frags");
+    if (write_frags(g,written))
+        return -1;
+    iotrace_phase("write splits");
+    if (write_splits(g))
+        return -1;
+    if (named_sources(g) && write_names(g))
+        return -1;
+    return 0;
+}
+
+/*
+  Output size prediction.
+
+  Rows are appended in rowid order, so SQLite fills each leaf page
+  until the next cell doesn't fit and then starts a new one.
+  Simulating that over the final fragment order gives the leaf page
+  count; the interior pages are estimated as if packed full.
+  Checksums aren't known yet, so they're counted at their average
+  size of 5 bytes.  Add page 1 for the schema.  With --previous, only
+  the new fragments are counted, as if they were written alone.
+*/
+
+typedef struct prediction {
+    sqlite3_int64 frag_leaves;
+    sqlite3_int64 frag_overflows;
+    sqlite3_int64 frag_interiors;
+    sqlite3_int64 split_leaves;
+    sqlite3_int64 split_interiors;
+    sqlite3_int64 total;
+} prediction;
+
+static sqlite3_int64 interior_pages(
+    sqlite3_int64 child_cnt,
+    sqlite3_int64 max_rowid,
+    int page_size)
+{
+    sqlite3_int64 total,per_page;
+
+    per_page=(page_size-12)/(2+4+varint_size(max_rowid))+1;
+    total=0;
+    while (child_cnt>1) {
+        child_cnt=(child_cnt+per_page-1)/per_page;
+        total+=child_cnt;
+    }
+    return total;
+}
+
+static void predict_output(
+    globals *g,
+    prediction *pred)
+{
+    catalog *c=&g->cat;
+    sqlite3_int64 frag_no,split_no,i;
+    unsigned int max_space,used;
+
+    max_space=g->page_size-8;
+    for (frag_no=0; frag_no<c->frag_cnt; frag_no++) {
+        if (c->page_id[frag_no])
+            c->frag_order[c->final_id[frag_no]-c->id_base-1]=frag_no;
+    }
+
+    pred->frag_leaves=1;
+    pred->frag_overflows=0;
+    used=0;
+    for (i=0; i<c->final_cnt; i++) {
+        space frag_space;
+
+        frag_no=c->frag_order[i];
+        frag_space=blob_space(
+            c->id_base+i+1,row_size(c,frag_no),g->page_size);
+        if (used+frag_space.cell_size>max_space) {
+            pred->frag_leaves++;
+            used=0;
+        }
+        used+=frag_space.cell_size;
+        pred->frag_overflows+=frag_space.overflow_cnt;
+    }
+    pred->frag_interiors=
+        interior_pages(pred->frag_leaves,c->id_base+c->final_cnt,
+                       g->page_size);
+
+    pred->split_leaves=1;
+    used=0;
+    for (split_no=0; split_no<c->split_cnt; split_no++) {
+        sqlite3_int64 owner,rec_size;
+        unsigned int cell_size;
+
+        owner=c->same_as[split_no]>=0 ? c->same_as[split_no] : split_no;
+        rec_size=c->bundle_cnt>0 ? 7 : 5;
+        if (c->split_frags[owner]>0) {
+            if (g->implicit_splits) {
+                sqlite3_int64 frag,tail_id;
+
+                if (implicit_frag(c,owner,&frag,&tail_id)==3)
+                    rec_size+=int_size(tail_id);
+                rec_size+=int_size(frag)+5;
+            } else {
+                frag_no=c->first_frag[owner];
+                rec_size+=int_size(c->final_id[frag_no])+5;
+                if (c->split_frags[owner]>1)
+                    rec_size+=int_size(c->final_id[frag_no+1]);
+            }
+            frag_no=c->first_frag[owner];
+            if (bundled(c,frag_no))
+                rec_size+=int_size(c->row_offset[frag_no])
+                    +int_size(c->size[frag_no]);
+        }
+        cell_size=2+varint_size(rec_size)
+            +varint_size(c->split_id[split_no])+rec_size;
+        if (used+cell_size>max_space) {
+            pred->split_leaves++;
+            used=0;
+        }
+        used+=cell_size;
+    }
+    pred->split_interiors=
+        interior_pages(pred->split_leaves,
+                       c->split_cnt>0 ? c->split_id[c->split_cnt-1] : 0,
+                       g->page_size);
+
+    pred->total=1
+        +pred->frag_leaves+pred->frag_overflows+pred->frag_interiors
+        +pred->split_leaves+pred->split_interiors;
+}
+
+static void report_prediction(
+    globals *g,
+    prediction const *pred)
+{
+    catalog const *c=&g->cat;
+
+    flockfile(stdout);
+    if (g->shard_no>=0)
+        printf("Shard %d:\n",g->shard_no);
+    printf("Blobs:                  %lld\n"
+           "  NULL:                 %lld\n"
+           "  duplicates:           %lld\n"
+           "  split, subset A:      %lld\n"
+           "  split, subset B:      %lld\n"
+           "  splits undone:        %lld\n"
+           "Fragments:              %lld\n"
+           "Pages:                  %lld\n"
+           "  frags leaf:           %lld\n"
+           "  frags overflow:       %lld\n"
+           "  frags interior:       %lld\n"
+           "  splits leaf:          %lld\n"
+           "  splits interior:      %lld\n"
+           "  schema:               1\n"
+           "File size:              %lld\n",
+           c->split_cnt,c->null_cnt,c->dup_cnt,
+           c->subset_a_cnt,c->subset_b_cnt,c->unsplit_cnt,
+           c->final_cnt,pred->total,
+           pred->frag_leaves,pred->frag_overflows,pred->frag_interiors,
+           pred->split_leaves,pred->split_interiors,
+           pred->total*g->page_size);
+    if (g->adaptive_splits)
+        printf("Leaf pages saved by adaptive splits: %lld\n",c->saved_cnt);
+    if (g->tail_packing)
+        printf("Blobs sharing rows: %lld, in %lld rows\n",
+               c->bundled_cnt,c->bundle_cnt);
+    if (g->prev_path)
+        printf("Blobs kept from previous release: %lld\n",c->kept_cnt);
+    funlockfile(stdout);
+}
+
+/*
+  Checkpoints.  After each planning phase, the whole catalog arena
+  is saved to dst-path-plan, so that a resumed run can skip the phases
+  already done.  The file is written under a temporary name and
+  renamed into place, so it's always a complete plan.
+  The page_in and page_out arrays are only used while ordering,
+  which is the last phase, so they are never saved.  Neither is
+  split_heat, which is read from the hot ids file again instead.
+*/
+
+#define PLAN_GENERATED 1
+#define PLAN_FILLED 2
+#define PLAN_ORDERED 3
+
+typedef struct plan_header {
+    char magic[8];
+    unsigned int phase;
+    unsigned int page_size;
+    int dedup;
+    int implicit_splits;
+    int adaptive_splits;
+    int tail_packing;
+    int hot;
+    int src_cnt;
+    sqlite3_int64 id_shift;
+    sqlite3_int64 lo_id;
+    sqlite3_int64 hi_id;
+    sqlite3_int64 split_max;
+    sqlite3_int64 frag_max;
+    sqlite3_int64 split_cnt;
+    sqlite3_int64 frag_cnt;
+    sqlite3_int64 page_cnt;
+    sqlite3_int64 final_cnt;
+    sqlite3_int64 null_cnt;
+    sqlite3_int64 dup_cnt;
+    sqlite3_int64 subset_a_cnt;
+    sqlite3_int64 subset_b_cnt;
+    sqlite3_int64 unsplit_cnt;
+    sqlite3_int64 saved_cnt;
+    sqlite3_int64 bundled_cnt;
+    sqlite3_int64 bundle_cnt;
+} plan_header;
+
+static char const plan_magic[8]="blobpln3";
+
+static int save_plan(
+    globals *g,
+    unsigned int phase)
+{
+    catalog *c=&g->cat;
+    plan_header header;
+    char *path=NULL;
+    char *tmp_path=NULL;
+    FILE *file;
+
+    if (!g->checkpoint)
+        return 0;
+    memset(&header,0,sizeof header);
+    memcpy(header.magic,plan_magic,sizeof header.magic);
+    header.phase=phase;
+    header.page_size=g->page_size;
+    header.dedup=g->dedup;
+    header.implicit_splits=g->implicit_splits;
+    header.adaptive_splits=g->adaptive_splits;
+    header.tail_packing=g->tail_packing;
+    header.hot=g->hot_path!=NULL;
+    header.src_cnt=g->src_cnt;
+    header.id_shift=g->id_shift;
+    header.lo_id=g->lo_id;
+    header.hi_id=g->hi_id;
+    header.split_max=c->split_max;
+    header.frag_max=c->frag_max;
+    header.split_cnt=c->split_cnt;
+    header.frag_cnt=c->frag_cnt;
+    header.page_cnt=c->page_cnt;
+    header.final_cnt=c->final_cnt;
+    header.null_cnt=c->null_cnt;
+    header.dup_cnt=c->dup_cnt;
+    header.subset_a_cnt=c->subset_a_cnt;
+    header.subset_b_cnt=c->subset_b_cnt;
+    header.unsplit_cnt=c->unsplit_cnt;
+    header.saved_cnt=c->saved_cnt;
+    header.bundled_cnt=c->bundled_cnt;
+    header.bundle_cnt=c->bundle_cnt;
+
+    path=sqlite3_mprintf("%s-plan",g->dst_path);
+    tmp_path=sqlite3_mprintf("%s-plan-tmp",g->dst_path);
+    if (!path || !tmp_path) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    file=fopen(tmp_path,"wb");
+    if (!file) {
+        perror(tmp_path);
+        return -1;
+    }
+    if (fwrite(&header,sizeof header,1,file)!=1
+            || c->arena_size>0
+                && fwrite(c->arena,c->arena_size,1,file)!=1
+            || fflush(file)
+            || fsync(fileno(file))) {
+        perror(tmp_path);
+        fclose(file);
+        return -1;
+    }
+    if (fclose(file)) {
+        perror(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path,path)) {
+        perror(path);
+        return -1;
+    }
+    sqlite3_free(path);
+    sqlite3_free(tmp_path);
+    return 0;
+}
+
+/*
+  Load the plan of an interrupted run, if there is one,
+  and return the last phase it completed.
+*/
+
+static int load_plan(
+    globals *g,
+    unsigned int *phase)
+{
+    catalog *c=&g->cat;
+    plan_header header;
+    char *path=NULL;
+    FILE *file;
+
+    *phase=0;
+    path=sqlite3_mprintf("%s-plan",g->dst_path);
+    if (!path) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    file=fopen(path,"rb");
+    if (!file) {
+        if (errno!=ENOENT) {
+            perror(path);
+            return -1;
+        }
+        sqlite3_free(path);
+        return 0;
+    }
+    if (fread(&header,sizeof header,1,file)!=1
+            || memcmp(header.magic,plan_magic,sizeof header.magic)) {
+        fprintf(stderr,"%s: Not a plan file\n",path);
+        return -1;
+    }
+    if (header.page_size!=g->page_size
+            || header.dedup!=g->dedup
+            || header.implicit_splits!=g->implicit_splits
+            || header.adaptive_splits!=g->adaptive_splits
+            || header.tail_packing!=g->tail_packing
+            || header.hot!=(g->hot_path!=NULL)
+            || header.src_cnt!=g->src_cnt
+            || header.id_shift!=g->id_shift
+            || header.lo_id!=g->lo_id
+            || header.hi_id!=g->hi_id) {
+        fprintf(stderr,"%s: Plan was made with different options\n",path);
+        return -1;
+    }
+    if (alloc_catalog(c,header.split_max,header.frag_max,g->tail_packing))
+        return -1;
+    if (c->arena_size>0 && fread(c->arena,c->arena_size,1,file)!=1) {
+        fprintf(stderr,"%s: Truncated plan file\n",path);
+        return -1;
+    }
+    fclose(file);
+    c->split_cnt=header.split_cnt;
+    c->frag_cnt=header.frag_cnt;
+    c->page_cnt=header.page_cnt;
+    c->final_cnt=header.final_cnt;
+    c->null_cnt=header.null_cnt;
+    c->dup_cnt=header.dup_cnt;
+    c->subset_a_cnt=header.subset_a_cnt;
+    c->subset_b_cnt=header.subset_b_cnt;
+    c->unsplit_cnt=header.unsplit_cnt;
+    c->saved_cnt=header.saved_cnt;
+    c->bundled_cnt=header.bundled_cnt;
+    c->bundle_cnt=header.bundle_cnt;
+    *phase=header.phase;
+    sqlite3_free(path);
+    return 0;
+}
+
+static int remove_plan(
+    globals *g)
+{
+    char *path;
+
+    if (!g->checkpoint)
+        return 0;
+    path=sqlite3_mprintf("%s-plan",g->dst_path);
+    if (!path) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    if (remove(path) && errno!=ENOENT) {
+        perror(path);
+        return -1;
+    }
+    sqlite3_free(path);
+    return 0;
+}
+
+static int close_db(
     globals *g)
 {
-    sqlite3_stmt *size;
-    sqlite3_stmt *list=NULL;
-    sqlite3_stmt *find=NULL;
-    sqlite3_stmt *insert=NULL;
-    sqlite3_stmt *update=NULL;
-    sqlite3_stmt *assign=NULL;
-    char *errmsg=NULL;
-    int status;
-    unsigned int max_space,min_size;
-    sqlite3_int64 next_page;
+    char *errmsg;
+    int status;
+
+    status=sqlite3_exec(g->db,commit_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to commit transaction: %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    if (g->in_memory && write_image(g->db,g->tmp_path))
+        return -1;
+    status=sqlite3_close_v2(g->db);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_close: %s\n",sqlite3_errmsg(g->db));
+        return -1;
+    }
+    g->db=NULL;
+    close_sources(g,&g->srcs);
+    if (g->tmp_path) {
+        if (rename(g->tmp_path,g->dst_path)) {
+            perror(g->dst_path);
+            return -1;
+        }
+        if (sync_dir(g->dst_path))
+            return -1;
+        sqlite3_free(g->tmp_path);
+        g->tmp_path=NULL;
+    }
+    return 0;
+}
+
+/*
+  With --previous, count the pages of the output that differ from the
+  previous release, which is what a page-level delta has to carry.
+  Pages past the end of the previous release all count.
+*/
+
+static int report_changes(
+    globals const *g)
+{
+    FILE *old_file,*new_file;
+    unsigned char *old_page,*new_page;
+    sqlite3_int64 page_cnt,changed_cnt;
 
-    fputs("Packing fragments into pages...\n",stderr);
-    status=sqlite3_prepare_v2(
-        g->db,min_size_sql,sizeof min_size_sql,&size,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(min_size): %s\n",
-                sqlite3_errmsg(g->db));
+    old_file=fopen(g->prev_path,"rb");
+    if (!old_file) {
+        perror(g->prev_path);
         return -1;
     }
-    status=sqlite3_step(size);
-    if (status!=SQLITE_ROW) {
-        fprintf(stderr,"sqlite3_step(min_size): %s\n",
-                sqlite3_errmsg(g->db));
+    new_file=fopen(g->dst_path,"rb");
+    if (!new_file) {
+        perror(g->dst_path);
         return -1;
     }
-    min_size=sqlite3_column_int(size,0);
-    sqlite3_finalize(size);
-    size=NULL;
-
-    status=sqlite3_exec(g->db,create_temp_page_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to create temporary page table: %s\n",errmsg);
+    old_page=sqlite3_malloc(2*g->page_size);
+    if (!old_page) {
+        fputs(oom_msg,stderr);
         return -1;
     }
+    new_page=old_page+g->page_size;
 
-    status=sqlite3_prepare_v2(
-        g->db,list_frags_sql,sizeof list_frags_sql,&list,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(list_frags): %s\n",
-                sqlite3_errmsg(g->db));
-        return -1;
+    page_cnt=changed_cnt=0;
+    while (fread(new_page,1,g->page_size,new_file)==g->page_size) {
+        page_cnt++;
+        if (fread(old_page,1,g->page_size,old_file)!=g->page_size
+                || memcmp(old_page,new_page,g->page_size))
+            changed_cnt++;
     }
-
-    status=sqlite3_prepare_v2(
-        g->db,find_page_sql,sizeof find_page_sql,&find,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(find_page): %s\n",
-                sqlite3_errmsg(g->db));
+    if (ferror(new_file)) {
+        perror(g->dst_path);
         return -1;
     }
-
-    status=sqlite3_prepare_v2(
-        g->db,insert_page_sql,sizeof insert_page_sql,&insert,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(insert_page): %s\n",
-                sqlite3_errmsg(g->db));
+    if (ferror(old_file)) {
+        perror(g->prev_path);
         return -1;
     }
+    fclose(old_file);
+    fclose(new_file);
+    sqlite3_free(old_page);
+    fprintf(stderr,"%lld of %lld pages differ from %s\n",
+            changed_cnt,page_cnt,g->prev_path);
+    return 0;
+}
 
-    status=sqlite3_prepare_v2(
-        g->db,update_page_sql,sizeof update_page_sql,&update,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(update_page): %s\n",
-                sqlite3_errmsg(g->db));
+static int pack(
+    globals *g)
+{
+    unsigned int phase;
+
+    iotrace_phase("open");
+    if (open_db(g))
+        return -1;
+    phase=0;
+    if (g->resume && load_plan(g,&phase))
         return -1;
+    if (phase<PLAN_GENERATED) {
+        iotrace_phase("generate");
+        if (generate_frags(g) || save_plan(g,PLAN_GENERATED))
+            return -1;
     }
-
-    status=sqlite3_prepare_v2(
-        g->db,assign_page_sql,sizeof assign_page_sql,&assign,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(assign_page): %s\n",
-                sqlite3_errmsg(g->db));
+    if (load_heat(g))
+        return -1;
+    iotrace_phase("match");
+    if (match_previous(g))
         return -1;
+    if (phase<PLAN_FILLED) {
+        iotrace_phase("fill");
+        if (fill_pages(g) || save_plan(g,PLAN_FILLED))
+            return -1;
     }
-
-    max_space=g->page_size-8;
-    next_page=0;
-    for (;;) {
-        sqlite3_int64 frag_id, page_id;
-        unsigned int cell_size, cell_space;
-        sqlite3_stmt *page;
-
-        status=sqlite3_step(list);
-        if (status!=SQLITE_ROW)
-            break;
-        frag_id=sqlite3_column_int64(list,0);
-        cell_size=sqlite3_column_int(list,1);
-        sqlite3_bind_int(find,1,cell_size);
-        status=sqlite3_step(find);
-        switch (status) {
-        case SQLITE_ROW:
-            page_id=sqlite3_column_int64(find,0);
-            cell_space=sqlite3_column_int(find,1);
-            page=update;
-            break;
-        case SQLITE_DONE:
-            page_id=++next_page;
-            cell_space=max_space;
-            page=insert;
-            break;
-        default:
-            fprintf(stderr,"sqlite3_step(find_page): %s\n",
-                    sqlite3_errmsg(g->db));
+    if (phase<PLAN_ORDERED) {
+        iotrace_phase("order");
+        if (order_frags(g) || save_plan(g,PLAN_ORDERED))
             return -1;
-        }
-        sqlite3_reset(find);
+    }
+    if (g->dry_run) {
+        prediction pred;
 
-        cell_space-=cell_size;
-        sqlite3_bind_int64(page,1,page_id);
-        if (cell_space>=min_size) {
-            sqlite3_bind_int(page,2,cell_space);
-        } else {
-            sqlite3_bind_null(page,2);
-        }
-        status=sqlite3_step(page);
-        if (status!=SQLITE_DONE) {
-            fprintf(stderr,"sqlite3_step(*_page): %s\n",
-                    sqlite3_errmsg(g->db));
-            return -1;
-        }
-        sqlite3_reset(page);
+        predict_output(g,&pred);
+        report_prediction(g,&pred);
+    } else {
+        prediction pred;
+        sqlite3_int64 size;
 
-        sqlite3_bind_int64(assign,1,frag_id);
-        sqlite3_bind_int64(assign,2,page_id);
-        status=sqlite3_step(assign);
-        if (status!=SQLITE_DONE) {
-            fprintf(stderr,"sqlite3_step(assign_page): %s\n",
-                    sqlite3_errmsg(g->db));
+        predict_output(g,&pred);
+        size=pred.total*g->page_size;
+        if (check_memory(g,size))
+            return -1;
+        if (!g->prev_path)
+            sqlite3_file_control(g->db,"main",SQLITE_FCNTL_SIZE_HINT,&size);
+        if (write_output(g))
             return -1;
-        }
-        sqlite3_reset(assign);
-
     }
-    if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(list_frags): %s\n",
-                sqlite3_errmsg(g->db));
+    free_catalog(&g->cat);
+    free_previous(&g->prev);
+    iotrace_phase("commit");
+    if (close_db(g))
         return -1;
-    }
-
-    sqlite3_finalize(list);
-    sqlite3_finalize(find);
-    sqlite3_finalize(insert);
-    sqlite3_finalize(update);
-    sqlite3_finalize(assign);
+    if (remove_plan(g))
+        return -1;
+    if (g->prev_path && !g->dry_run && report_changes(g))
+        return -1;
+    return 0;
+}
 
 /*
-  A split is undone if either
-  a) both fragments end up on the same page, or
-  b) both fragments end up as the only ones on their respective pages.
+  Sharded output.
 
-  This is all done in SQL.  The cell_size column isn't updated,
-  but it's not used after this step.
+  The source id space is cut into contiguous ranges of roughly equal
+  estimated output size.  Each range is packed independently into its
+  own database, so a split's head and tail always end up together.
+  The destination path names a small manifest database listing the
+  shard files and their id ranges.
 */
 
-    status=sqlite3_exec(g->db,unsplit_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to remove useless splits: %s\n",errmsg);
-        return -1;
-    }
+typedef struct shard {
+    sqlite3_int64 lo;
+    sqlite3_int64 hi;
+    char *path;
+} shard;
 
-    return 0;
-}
+typedef struct shard_pool {
+    globals const *g;
+    shard *shards;
+    unsigned int shard_cnt;
+    unsigned int next;
+    int failed;
+    pthread_mutex_t lock;
+} shard_pool;
 
 /*
-  Goal: for each split, select head and tail ids that are close together.
+  Estimated number of output bytes for a blob, splits row excluded.
+*/
 
-  Consider splits and pages as the vertex subsets of a bipartite graph
-  with fragments as the edges.  Do a breadth-first traversal of each
-  connected subgraph, ordering pages as found.
+static sqlite3_int64 blob_estimate(
+    globals const *g,
+    sqlite3_int64 size)
+{
+    space est;
 
-  Generate the final fragment order from the page order.
-*/
+    est=blob_space(-1,size,g->page_size);
+    return est.cell_size+(sqlite3_int64)est.overflow_cnt*g->page_size;
+}
 
-static int order_frags(
-    globals *g)
+static int plan_shards(
+    globals *g,
+    shard **shards_ptr,
+    unsigned int *shard_cnt_ptr)
 {
-    sqlite3_stmt *one_split=NULL;
-    sqlite3_stmt *more_pages=NULL;
-    sqlite3_stmt *more_splits=NULL;
-    char *errmsg=NULL;
-    int status;
-    sqlite3_int64 page_cnt,split_cnt,split_id;
-    sqlite3_int64 changes;
+    sources srcs={NULL,NULL,NULL,NULL,NULL};
+    blob_list list;
+    shard *shards=NULL;
+    unsigned int shard_cnt,shard_max;
+    sqlite3_int64 total,target,used;
+    int pass,status;
 
-    fputs("Ordering pages...\n",stderr);
-    status=sqlite3_exec(g->db,create_order_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to create ordering tables: %s\n",
-                errmsg);
-        return -1;
-    }
-    status=sqlite3_prepare_v2(
-        g->db,one_split_sql,sizeof one_split_sql,&one_split,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(one_split): %s\n",
-                sqlite3_errmsg(g->db));
+    fputs("Planning shards...\n",stderr);
+    if (open_sources(g,&srcs))
         return -1;
-    }
-    status=sqlite3_prepare_v2(
-        g->db,more_pages_sql,sizeof more_pages_sql,&more_pages,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(more_pages): %s\n",
-                sqlite3_errmsg(g->db));
-        return -1;
-    }
-    status=sqlite3_prepare_v2(
-        g->db,more_splits_sql,sizeof more_splits_sql,&more_splits,NULL);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(more_splits): %s\n",
-                sqlite3_errmsg(g->db));
+    if (open_list(g,&srcs,&list))
         return -1;
-    }
 
-    page_cnt=split_cnt=0;
-    split_id=-9223372036854775807-1;
-    for (;;) {
-        sqlite3_bind_int64(one_split,1,split_id);
-        status=sqlite3_step(one_split);
-        if (status!=SQLITE_ROW)
-            break;
-        split_id=sqlite3_column_int64(one_split,0)+1;
-        sqlite3_reset(one_split);
-        changes=1;
+    /*
+      Pass 0 totals the estimated output size;
+      pass 1 cuts it into ranges.
+    */
 
+    total=target=0;
+    shard_cnt=shard_max=0;
+    for (pass=0; pass<2; pass++) {
+        used=0;
         for (;;) {
-            sqlite3_bind_int64(more_pages,1,split_cnt);
-            split_cnt+=changes;
-            status=sqlite3_step(more_pages);
-            if (status!=SQLITE_DONE) {
-                fprintf(stderr,"sqlite3_step(more_pages): %s\n",
-                        sqlite3_errmsg(g->db));
-                return 1;
-            }
-            changes=sqlite3_changes64(g->db);
-            sqlite3_reset(more_pages);
-            if (changes<=0)
+            sqlite3_int64 id,size,est;
+            int src_no;
+
+            status=next_blob(g,&srcs,&list,&id,&src_no,&size);
+            if (status<=0)
                 break;
+            est=16;
+            if (size>=0)
+                est+=blob_estimate(g,size);
+            if (!pass) {
+                total+=est;
+                continue;
+            }
+            if (!shard_cnt
+                    || used>0 && used+est>target
+                        && (g->max_output_size>0
+                            || shard_cnt<g->shard_cnt)) {
+                if (shard_cnt>=shard_max) {
+                    shard *more;
 
-            sqlite3_bind_int64(more_splits,1,page_cnt);
-            page_cnt+=changes;
-            status=sqlite3_step(more_splits);
-            if (status!=SQLITE_DONE) {
-                fprintf(stderr,"sqlite3_step(more_splits): %s\n",
-                        sqlite3_errmsg(g->db));
-                return 1;
+                    shard_max=shard_max ? shard_max*2 : 16;
+                    more=sqlite3_realloc64(shards,shard_max*sizeof *shards);
+                    if (!more) {
+                        fputs(oom_msg,stderr);
+                        return -1;
+                    }
+                    shards=more;
+                }
+                shards[shard_cnt].lo=id;
+                shards[shard_cnt].path=NULL;
+                shard_cnt++;
+                used=0;
             }
-            changes=sqlite3_changes64(g->db);
-            sqlite3_reset(more_splits);
-            if (changes<=0)
-                break;
+            shards[shard_cnt-1].hi=id;
+            used+=est;
+        }
+        if (status<0 || rewind_list(g,&srcs,&list))
+            return -1;
+
+        if (!pass) {
+            target=total;
+            if (g->shard_cnt>1)
+                target=(total+g->shard_cnt-1)/g->shard_cnt;
+            if (g->max_output_size>0 && target>g->max_output_size)
+                target=g->max_output_size;
         }
     }
-    if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(one_page): %s\n",sqlite3_errmsg(g->db));
+    close_list(&list);
+    close_sources(g,&srcs);
+
+    if (!shard_cnt) {
+        fputs("Nothing to pack\n",stderr);
         return -1;
     }
 
-    sqlite3_finalize(one_split);
-    sqlite3_finalize(more_pages);
-    sqlite3_finalize(more_splits);
+    /*
+      The first and last ranges are widened to cover
+      the whole id space, so the manifest has no gaps at the ends.
+    */
 
-    fputs("Ordering fragments...\n",stderr);
-    status=sqlite3_exec(g->db,order_frags_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to assign final fragment ids: %s\n",
-                errmsg);
-        return -1;
+    shards[0].lo=g->lo_id;
+    shards[shard_cnt-1].hi=g->hi_id;
+    for (pass=0; (unsigned int)pass<shard_cnt; pass++) {
+        shards[pass].path=sqlite3_mprintf("%s.%d",g->dst_path,pass);
+        if (!shards[pass].path) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
     }
 
+    fprintf(stderr,"%u shards of about %lld bytes each\n",
+            shard_cnt,target);
+    *shards_ptr=shards;
+    *shard_cnt_ptr=shard_cnt;
     return 0;
 }
 
+static void *shard_worker(
+    void *arg)
+{
+    shard_pool *pool=arg;
+
+    for (;;) {
+        globals sg;
+        unsigned int shard_no;
+
+        pthread_mutex_lock(&pool->lock);
+        shard_no=pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (shard_no>=pool->shard_cnt)
+            break;
+
+        sg=*pool->g;
+        sg.shard_no=shard_no;
+        sg.dst_path=pool->shards[shard_no].path;
+        sg.lo_id=pool->shards[shard_no].lo;
+        sg.hi_id=pool->shards[shard_no].hi;
+        if (pack(&sg)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->failed=1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
 /*
-  Write the output tables in rowid order.  Yes, this means that
-  split source blobs are read twice, but since the destination database
-  won't need vacuuming, it's a net win measured by total i/o.
+  Shard paths are stored relative to the manifest's directory.
 */
 
-static int write_output(
-    globals *g)
+static int write_manifest(
+    globals *g,
+    shard const *shards,
+    unsigned int shard_cnt)
 {
+    sqlite3 *db=NULL;
+    sqlite3_stmt *insert=NULL;
+    char *set_page_size_sql=NULL;
     char *errmsg=NULL;
+    unsigned int i;
     int status;
 
-    fputs("Writing output splits...\n",stderr);
-    status=sqlite3_exec(g->db,write_splits_sql,0,NULL,&errmsg);
+    fputs("Writing manifest...\n",stderr);
+    status=sqlite3_open_v2(
+        g->dst_path,&db,SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,NULL);
+    if (status!=SQLITE_OK) {
+        if (db) {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    g->dst_path,sqlite3_errmsg(db));
+        } else {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    g->dst_path,sqlite3_errstr(status));
+        }
+        return -1;
+    }
+
+    set_page_size_sql=sqlite3_mprintf(set_page_size_fmt,g->page_size);
+    if (!set_page_size_sql) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    status=sqlite3_exec(db,set_page_size_sql,0,NULL,&errmsg);
     if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to populate splits table: %s\n",errmsg);
+        fprintf(stderr,"Failed to set page size: %s\n",errmsg);
         return -1;
     }
+    sqlite3_free(set_page_size_sql);
 
-    fputs("Writing output fragments...\n",stderr);
-    status=sqlite3_exec(g->db,write_frags_sql,0,NULL,&errmsg);
+    status=sqlite3_exec(db,create_manifest_sql,0,NULL,&errmsg);
     if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to populate frags table: %s\n",errmsg);
+        fprintf(stderr,"Failed to create manifest: %s\n",errmsg);
         return -1;
     }
 
-    return 0;
+    status=sqlite3_prepare_v2(
+        db,insert_shard_sql,sizeof insert_shard_sql,&insert,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(insert_shard): %s\n",
+                sqlite3_errmsg(db));
+        return -1;
+    }
+    for (i=0; i<shard_cnt; i++) {
+        char const *name;
+
+        name=strrchr(shards[i].path,'/');
+        name=name ? name+1 : shards[i].path;
+        sqlite3_bind_int(insert,1,i);
+        sqlite3_bind_text(insert,2,name,-1,SQLITE_STATIC);
+        sqlite3_bind_int64(insert,3,shards[i].lo);
+        sqlite3_bind_int64(insert,4,shards[i].hi);
+        status=sqlite3_step(insert);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(insert_shard): %s\n",
+                    sqlite3_errmsg(db));
+            return -1;
+        }
+        sqlite3_reset(insert);
+    }
+    sqlite3_finalize(insert);
+
+    g->db=db;
+    return close_db(g);
 }
 
-static int close_db(
+static int pack_shards(
     globals *g)
 {
-    char *errmsg;
-    int status;
+    shard_pool pool;
+    pthread_t *threads=NULL;
+    shard *shards=NULL;
+    unsigned int shard_cnt,thread_cnt,i;
+    long cpu_cnt;
 
-    status=sqlite3_exec(g->db,commit_sql,0,NULL,&errmsg);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to commit transaction: %s\n",
-                sqlite3_errmsg(g->db));
+    iotrace_phase("plan shards");
+    if (plan_shards(g,&shards,&shard_cnt))
         return -1;
-    }
-    status=sqlite3_close_v2(g->db);
-    if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_close: %s\n",sqlite3_errmsg(g->db));
+
+    cpu_cnt=sysconf(_SC_NPROCESSORS_ONLN);
+    thread_cnt=cpu_cnt>0 ? (unsigned int)cpu_cnt : 1;
+    if (thread_cnt>shard_cnt)
+        thread_cnt=shard_cnt;
+    threads=sqlite3_malloc64(thread_cnt*sizeof *threads);
+    if (!threads) {
+        fputs(oom_msg,stderr);
         return -1;
     }
-    g->db=NULL;
+
+    pool.g=g;
+    pool.shards=shards;
+    pool.shard_cnt=shard_cnt;
+    pool.next=0;
+    pool.failed=0;
+    pthread_mutex_init(&pool.lock,NULL);
+    for (i=0; i<thread_cnt; i++) {
+        if (pthread_create(&threads[i],NULL,shard_worker,&pool)) {
+            /* the workers already running use pool; wait for them */
+            fputs("Failed to start thread\n",stderr);
+            pthread_mutex_lock(&pool.lock);
+            pool.failed=1;
+            pthread_mutex_unlock(&pool.lock);
+            thread_cnt=i;
+            break;
+        }
+    }
+    for (i=0; i<thread_cnt; i++)
+        pthread_join(threads[i],NULL);
+    pthread_mutex_destroy(&pool.lock);
+    sqlite3_free(threads);
+    if (pool.failed)
+        return -1;
+
+    if (!g->dry_run && write_manifest(g,shards,shard_cnt))
+        return -1;
+
+    for (i=0; i<shard_cnt; i++)
+        sqlite3_free(shards[i].path);
+    sqlite3_free(shards);
     return 0;
 }
 
@@ -754,15 +4684,108 @@ static int parse_args(
             }
             g->page_size=page_size;
             argi++;
+        } else if (!strcmp(arg,"--dedup")) {
+            g->dedup=1;
+        } else if (!strcmp(arg,"--implicit-splits")) {
+            g->implicit_splits=1;
+        } else if (!strcmp(arg,"--adaptive-splits")) {
+            g->adaptive_splits=1;
+        } else if (!strcmp(arg,"--tail-packing")) {
+            g->tail_packing=1;
+        } else if (!strcmp(arg,"--dry-run")) {
+            g->dry_run=1;
+        } else if (!strcmp(arg,"--checkpoint")) {
+            g->checkpoint=1;
+        } else if (!strcmp(arg,"--resume")) {
+            g->checkpoint=1;
+            g->resume=1;
+        } else if (!strcmp(arg,"--no-journal")) {
+            g->no_journal=1;
+        } else if (!strcmp(arg,"--id-shift")) {
+            if (argi>=argc)
+                goto missing;
+            if (sscanf(argv[argi],"%lld",&g->id_shift)!=1
+                    || g->id_shift<=0) {
+                fprintf(stderr,"Invalid id shift %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
+        } else if (!strcmp(arg,"--hot-ids")) {
+            if (argi>=argc)
+                goto missing;
+            g->hot_path=argv[argi++];
+        } else if (!strcmp(arg,"--previous")) {
+            if (argi>=argc)
+                goto missing;
+            g->prev_path=argv[argi++];
+        } else if (!strcmp(arg,"--build-in-memory")) {
+            if (argi>=argc)
+                goto missing;
+            if (parse_size(argv[argi],&g->memory_limit)) {
+                fprintf(stderr,"Invalid size %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
+        } else if (!strcmp(arg,"--trace-io")) {
+            g->trace_io=1;
+        } else if (!strcmp(arg,"--shards")) {
+            if (argi>=argc)
+                goto missing;
+            if (!sscanf(argv[argi],"%u",&g->shard_cnt) || !g->shard_cnt) {
+                fprintf(stderr,"Invalid shard count %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
+        } else if (!strcmp(arg,"--max-output-size")) {
+            if (argi>=argc)
+                goto missing;
+            if (parse_size(argv[argi],&g->max_output_size)) {
+                fprintf(stderr,"Invalid size %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
         } else {
             fprintf(stderr,"Unknown option %s\n",arg);
             goto usage;
         }
     }
-    if (argc-argi<2)
+    if (g->dry_run && g->checkpoint) {
+        fputs("A dry run has nothing to checkpoint\n",stderr);
+        return -1;
+    }
+    if (g->no_journal && g->checkpoint) {
+        fputs("--no-journal can't be combined with checkpoints\n",stderr);
+        return -1;
+    }
+    if (g->memory_limit>0 && g->checkpoint) {
+        fputs("--build-in-memory can't be combined with checkpoints\n",
+              stderr);
+        return -1;
+    }
+    if (g->prev_path && (g->checkpoint || g->shard_cnt>1
+                         || g->max_output_size>0)) {
+        fputs("--previous can't be combined with checkpoints or shards\n",
+              stderr);
+        return -1;
+    }
+    if (g->prev_path && g->tail_packing) {
+        fputs("--previous can't be combined with --tail-packing\n",stderr);
+        return -1;
+    }
+    if (argc-argi<(g->dry_run ? 1 : 2))
         goto usage;
-    g->src_path=argv[argi++];
-    g->dst_path=argv[argi++];
+    g->src_paths=(char const **)argv+argi;
+    if (g->dry_run) {
+        g->src_cnt=argc-argi;
+        g->dst_path="dry-run";
+    } else {
+        g->src_cnt=argc-argi-1;
+        g->dst_path=argv[argc-1];
+    }
+    if (g->id_shift>0 && (g->src_cnt-1)>INT64_MAX/g->id_shift) {
+        fputs("Id shift too large for that many sources\n",stderr);
+        return -1;
+    }
     return 0;
 
 missing:
@@ -779,10 +4802,27 @@ usage:
         } else {
             progname=argv[0];
         }
-        fprintf(stderr,"Usage: %s [ options ] src-path dst-path\n",progname);
+        fprintf(stderr,"Usage: %s [ options ] src-path... dst-path\n"
+                "       %s --dry-run [ options ] src-path...\n",
+                progname,progname);
     }
     fputs("    Options:\n"
-          "        --page-size         number\n",
+          "        --page-size         number\n"
+          "        --dedup\n"
+          "        --implicit-splits\n"
+          "        --adaptive-splits\n"
+          "        --tail-packing\n"
+          "        --id-shift          number\n"
+          "        --hot-ids           path\n"
+          "        --previous          path\n"
+          "        --dry-run\n"
+          "        --checkpoint\n"
+          "        --resume\n"
+          "        --no-journal\n"
+          "        --build-in-memory   bytes[k|M|G|T]\n"
+          "        --trace-io\n"
+          "        --shards            number\n"
+          "        --max-output-size   bytes[k|M|G|T]\n",
           stderr);
     return -1;
 }
@@ -795,18 +4835,26 @@ int main(
 
     if (parse_args(&g,argc,argv))
         return 11;
-    if (open_db(&g))
-        return 1;
-    if (generate_frags(&g))
+    crc32c_init();
+    if (outvfs_register()!=SQLITE_OK) {
+        fputs("Failed to register the output VFS\n",stderr);
         return 1;
-    if (fill_pages(&g))
-        return 1;
-    if (order_frags(&g))
-        return 1;
-    if (write_output(&g))
-        return 1;
-    if (close_db(&g))
+    }
+    if (g.trace_io && iotrace_register(OUTVFS_NAME)!=SQLITE_OK) {
+        fputs("Failed to register the tracing VFS\n",stderr);
         return 1;
+    }
+    if (g.shard_cnt>1 || g.max_output_size>0) {
+        if (pack_shards(&g))
+            return 1;
+    } else {
+        if (pack(&g))
+            return 1;
+    }
+    if (g.trace_io) {
+        fputs("I/O by phase:\n",stderr);
+        iotrace_report(stderr);
+    }
     return 0;
 }
 
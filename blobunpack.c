@@ -1,25 +1,58 @@
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <sqlite3.h>
 
+#include "common.h"
+#include "crc32c.h"
+#include "iotrace.h"
+
 typedef struct globals {
     unsigned int page_size;
+    int verify_only;
+    int sequential;
+    sqlite3_int64 reorder_memory;
+    sqlite3_int64 memory_limit;
+    int selective;
+    int trace_io;
 
     char const *src_path;
     char const *dst_path;
+    char *tmp_path;
+    char const *ids_path;
+    char const *where;
+    sqlite3_int64 lo_id;
+    sqlite3_int64 hi_id;
 
     sqlite3 *db;
+    int in_memory;
 } globals;
 
 static globals const default_globals =
 {
     0,
+    0,
+    0,
+    64<<20,
+    0,
+    0,
+    0,
 
     NULL,
     NULL,
+    NULL,
+    NULL,
+    "1",
+    INT64_MIN,
+    INT64_MAX,
 
-    NULL
+    NULL,
+    0
 };
 
 /*
@@ -37,29 +70,65 @@ static char const oom_msg[] =
   attach the source database using the identifier "source";
   set the page size;
   start a transaction.
+
+  When only verifying, the destination is an empty in-memory database.
+  With --build-in-memory, it's an in-memory database, resizable through
+  sqlite3_deserialize, that close_db writes out under a temporary name
+  and renames into place.
 */
 
-static int open_db(
+static int open_dst(
     globals *g)
 {
     sqlite3 *db=NULL;
     sqlite3_stmt *attach=NULL;
     char *set_page_size_sql=NULL;
     char *errmsg=NULL;
+    char const *dst_path;
     int status;
 
+    dst_path=g->verify_only ? ":memory:" : g->dst_path;
+    if (g->in_memory) {
+        if (!access(g->dst_path,F_OK)) {
+            fprintf(stderr,"%s: Already exists;"
+                    " --build-in-memory only writes new files\n",
+                    g->dst_path);
+            return -1;
+        }
+        g->tmp_path=sqlite3_mprintf("%s-tmp",g->dst_path);
+        if (!g->tmp_path) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        dst_path=":memory:";
+    }
     status=sqlite3_open_v2(
-        g->dst_path,&db,SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,NULL);
+        dst_path,&db,SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+        g->trace_io ? IOTRACE_NAME : NULL);
     if (status!=SQLITE_OK) {
         if (db) {
             fprintf(stderr,"%s: sqlite3_open: %s\n",
-                    g->dst_path,sqlite3_errmsg(db));
+                    dst_path,sqlite3_errmsg(db));
         } else {
             fprintf(stderr,"%s: sqlite3_open: %s\n",
-                    g->dst_path,sqlite3_errstr(status));
+                    dst_path,sqlite3_errstr(status));
         }
         return -1;
     }
+    if (g->in_memory) {
+        sqlite3_int64 size_limit;
+
+        status=sqlite3_deserialize(
+            db,"main",NULL,0,0,
+            SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"sqlite3_deserialize: %s\n",sqlite3_errmsg(db));
+            return -1;
+        }
+        /* room for prediction error before SQLITE_FULL */
+        size_limit=2*g->memory_limit;
+        sqlite3_file_control(db,"main",SQLITE_FCNTL_SIZE_LIMIT,&size_limit);
+    }
 
     status=sqlite3_prepare_v2(db,attach_sql,sizeof attach_sql,&attach,NULL);
     if (status!=SQLITE_OK) {
@@ -121,107 +190,1140 @@ static int open_db(
     return 0;
 }
 
-static int transfer_data(
+/*
+  Shard paths are relative to the manifest's directory unless absolute.
+*/
+
+static char *shard_path(
+    globals const *g,
+    char const *path)
+{
+    char const *slash;
+    int dir_len;
+
+    if (path[0]=='/')
+        return sqlite3_mprintf("%s",path);
+    slash=strrchr(g->src_path,'/');
+    dir_len=slash ? (int)(slash-g->src_path)+1 : 0;
+    return sqlite3_mprintf("%.*s%s",dir_len,g->src_path,path);
+}
+
+/*
+  The unpacked output is about as big as the packed source, or the
+  shards of it the selection reaches; a selection within those only
+  makes it smaller.
+*/
+
+static int source_size(
+    globals *g,
+    sqlite3_int64 *size)
+{
+    sqlite3_stmt *find=NULL;
+    sqlite3_stmt *list=NULL;
+    struct stat st;
+    int status,sharded;
+
+    if (stat(g->src_path,&st)) {
+        perror(g->src_path);
+        return -1;
+    }
+    *size=st.st_size;
+
+    status=sqlite3_prepare_v2(
+        g->db,find_manifest_sql,sizeof find_manifest_sql,&find,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(find_manifest): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(find);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(find_manifest): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sharded=sqlite3_column_int(find,0);
+    sqlite3_finalize(find);
+    if (!sharded)
+        return 0;
+
+    status=sqlite3_prepare_v2(
+        g->db,list_shards_sql,sizeof list_shards_sql,&list,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(list_shards): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    *size=0;
+    while ((status=sqlite3_step(list))==SQLITE_ROW) {
+        char const *path;
+        char *full_path;
+
+        if (sqlite3_column_int64(list,2)<g->lo_id
+                || sqlite3_column_int64(list,1)>g->hi_id)
+            continue;
+        path=(char const *)sqlite3_column_text(list,0);
+        full_path=path ? shard_path(g,path) : NULL;
+        if (!full_path) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        if (stat(full_path,&st)) {
+            perror(full_path);
+            return -1;
+        }
+        *size+=st.st_size;
+        sqlite3_free(full_path);
+    }
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(list_shards): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_finalize(list);
+    return 0;
+}
+
+/*
+  Builds that look too big for memory go to disk instead.  Nothing
+  has been written yet, so the in-memory database is just dropped.
+*/
+
+static int open_db(
+    globals *g)
+{
+    sqlite3_int64 size;
+
+    g->in_memory=g->memory_limit>0 && !g->verify_only;
+    if (open_dst(g))
+        return -1;
+    if (!g->in_memory)
+        return 0;
+    if (source_size(g,&size))
+        return -1;
+    if (size<=g->memory_limit)
+        return 0;
+    fprintf(stderr,"Predicted size %lld is over the memory limit;"
+            " building on disk\n",size);
+    sqlite3_close(g->db);
+    g->db=NULL;
+    sqlite3_free(g->tmp_path);
+    g->tmp_path=NULL;
+    g->in_memory=0;
+    return open_dst(g);
+}
+
+/*
+  The implicit split layout has a frag column in place of head and tail;
+  see blobpack.c for its encoding.  Kind 2 has the fragments swapped.
+
+  With tail packing, splits has offset and size columns as well.
+  Where they aren't NULL, the blob is that slice of its fragment,
+  which it shares with other small blobs.
+
+  Files packed before checksums were added have no crc column; their
+  blobs are unpacked unchecked.
+*/
+
+static int source_layout(
+    globals *g,
+    int *implicit,
+    int *checked,
+    int *sliced)
+{
+    sqlite3_stmt *find=NULL;
+    int status;
+
+    status=sqlite3_prepare_v2(
+        g->db,find_layout_sql,sizeof find_layout_sql,&find,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(find_layout): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(find);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(find_layout): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    *implicit=sqlite3_column_int(find,0);
+    *sliced=sqlite3_column_int(find,1);
+    *checked=sqlite3_column_int(find,2);
+    sqlite3_finalize(find);
+    return 0;
+}
+
+/*
+  The queries reading splits take the crc column as column 3 and the
+  slice columns as columns 4 and 5, or NULLs in their place.
+*/
+
+static int prepare_layout(
+    globals *g,
+    char const *fmt,
+    int checked,
+    int sliced,
+    sqlite3_stmt **stmt)
+{
+    char *sql;
+    int status;
+
+    sql=sqlite3_mprintf(fmt,
+                        checked ? crc_column_sql : no_crc_column_sql,
+                        sliced ? slice_columns_sql : no_slice_columns_sql);
+    if (!sql) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    status=sqlite3_prepare_v2(g->db,sql,-1,stmt,NULL);
+    sqlite3_free(sql);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(splits): %s\n",sqlite3_errmsg(g->db));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Narrow a shared fragment down to one blob's slice of it.
+  Returns 1 if the slice doesn't fit in the fragment.
+*/
+
+static int slice_frag(
+    sqlite3_int64 offset,
+    sqlite3_int64 len,
+    unsigned char const **data,
+    sqlite3_int64 *size)
+{
+    if (offset<0 || len<0 || offset>*size || len>*size-offset)
+        return 1;
+    *data+=offset;
+    *size=len;
+    return 0;
+}
+
+/*
+  A selection is made of an id range, an optional list of wanted ids
+  and an optional SQL condition on splits.id, all of which must hold.
+  The wanted ids also narrow the range, so that shards holding none
+  of them can be skipped.
+*/
+
+static int create_selection(
     globals *g)
 {
-    sqlite3_stmt *extract=NULL;
     sqlite3_stmt *insert=NULL;
+    sqlite3_stmt *bounds=NULL;
     char *errmsg=NULL;
+    char line[64];
+    FILE *file;
     int status;
 
-    status=sqlite3_exec(g->db,create_blob_sql,0,NULL,&errmsg);
+    if (!g->selective)
+        return 0;
+    status=sqlite3_exec(g->db,create_selection_sql,0,NULL,&errmsg);
     if (status!=SQLITE_OK) {
-        fprintf(stderr,"Failed to create destination table: %s\n",
-                sqlite3_errmsg(g->db));
+        fprintf(stderr,"Failed to create selection tables: %s\n",errmsg);
         return -1;
     }
+    if (!g->ids_path)
+        return 0;
 
     status=sqlite3_prepare_v2(
-        g->db,extract_frags_sql,sizeof extract_frags_sql,&extract,NULL);
+        g->db,insert_wanted_sql,sizeof insert_wanted_sql,&insert,NULL);
     if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(extract_frags): %s\n",
+        fprintf(stderr,"sqlite3_prepare(insert_wanted): %s\n",
                 sqlite3_errmsg(g->db));
         return -1;
     }
+    file=fopen(g->ids_path,"r");
+    if (!file) {
+        perror(g->ids_path);
+        return -1;
+    }
+    while (fgets(line,sizeof line,file)) {
+        long long id;
+        char extra;
+
+        if (sscanf(line,"%lld %c",&id,&extra)!=1) {
+            if (sscanf(line," %c",&extra)<1)
+                continue;
+            fprintf(stderr,"%s: Invalid id %s",g->ids_path,line);
+            return -1;
+        }
+        sqlite3_bind_int64(insert,1,id);
+        status=sqlite3_step(insert);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(insert_wanted): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+        sqlite3_reset(insert);
+    }
+    if (ferror(file)) {
+        perror(g->ids_path);
+        return -1;
+    }
+    fclose(file);
+    sqlite3_finalize(insert);
 
     status=sqlite3_prepare_v2(
-        g->db,insert_blob_sql,sizeof insert_blob_sql,&insert,NULL);
+        g->db,wanted_bounds_sql,sizeof wanted_bounds_sql,&bounds,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(wanted_bounds): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(bounds);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(wanted_bounds): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    if (sqlite3_column_type(bounds,0)==SQLITE_NULL) {
+        g->lo_id=1;
+        g->hi_id=0;
+    } else {
+        if (sqlite3_column_int64(bounds,0)>g->lo_id)
+            g->lo_id=sqlite3_column_int64(bounds,0);
+        if (sqlite3_column_int64(bounds,1)<g->hi_id)
+            g->hi_id=sqlite3_column_int64(bounds,1);
+    }
+    sqlite3_finalize(bounds);
+    return 0;
+}
+
+/*
+  Fill temp.picked with the selected splits of the current source.
+*/
+
+static int pick_splits(
+    globals *g)
+{
+    sqlite3_stmt *pick=NULL;
+    char *pick_splits_sql;
+    char *errmsg=NULL;
+    int status;
+
+    status=sqlite3_exec(g->db,clear_picked_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to clear selection: %s\n",errmsg);
+        return -1;
+    }
+    pick_splits_sql=sqlite3_mprintf(pick_splits_fmt,g->where);
+    if (!pick_splits_sql) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    status=sqlite3_prepare_v2(g->db,pick_splits_sql,-1,&pick,NULL);
     if (status!=SQLITE_OK) {
-        fprintf(stderr,"sqlite3_prepare(insert_blob): %s\n",
+        fprintf(stderr,"sqlite3_prepare(pick_splits): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_free(pick_splits_sql);
+    sqlite3_bind_int64(pick,1,g->lo_id);
+    sqlite3_bind_int64(pick,2,g->hi_id);
+    sqlite3_bind_int(pick,3,!g->ids_path);
+    status=sqlite3_step(pick);
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(pick_splits): %s\n",
                 sqlite3_errmsg(g->db));
         return -1;
     }
+    sqlite3_finalize(pick);
+    return 0;
+}
+
+/*
+  Check and insert one blob given as up to two pieces.
+  Returns 1 if the checksum didn't match, -1 on error.
+*/
+
+static int emit_blob(
+    globals *g,
+    sqlite3_stmt *insert,
+    sqlite3_int64 blob_id,
+    sqlite3_int64 crc,
+    void const *head,
+    sqlite3_int64 head_size,
+    void const *tail,
+    sqlite3_int64 tail_size)
+{
+    unsigned char *blob=NULL;
+    int status;
+
+    if (crc>=0) {
+        unsigned int sum;
+
+        sum=crc32c(0,head,head_size);
+        sum=crc32c(sum,tail,tail_size);
+        if (sum!=(unsigned int)crc) {
+            fprintf(stderr,"Checksum mismatch for blob %lld\n",blob_id);
+            return 1;
+        }
+    }
+    if (g->verify_only)
+        return 0;
 
+    sqlite3_bind_int64(insert,1,blob_id);
+    if (tail_size>0) {
+        blob=sqlite3_malloc64(head_size+tail_size);
+        if (!blob) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        if (head_size>0)
+            memcpy(blob,head,head_size);
+        memcpy(blob+head_size,tail,tail_size);
+        status=sqlite3_bind_blob64(
+            insert,2,blob,head_size+tail_size,sqlite3_free);
+    } else if (head_size>0) {
+        status=sqlite3_bind_blob64(insert,2,head,head_size,SQLITE_STATIC);
+    } else {
+        status=sqlite3_bind_zeroblob(insert,2,0);
+    }
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_bind(insert): %s\n",sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(insert);
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(insert): %s\n",sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_reset(insert);
+    sqlite3_clear_bindings(insert);
+    return 0;
+}
+
+/*
+  The blobs of a file packed before checksums were added are counted
+  apart rather than as verified.
+*/
+
+static void report_verified(
+    globals *g,
+    sqlite3_int64 blob_cnt,
+    sqlite3_int64 unchecked_cnt)
+{
+    if (!g->verify_only)
+        return;
+    if (unchecked_cnt>0) {
+        fprintf(stderr,"%lld blobs verified, %lld without a checksum\n",
+                blob_cnt-unchecked_cnt,unchecked_cnt);
+    } else {
+        fprintf(stderr,"%lld blobs verified\n",blob_cnt);
+    }
+}
+
+/*
+  Reassemble the blobs, checking each one against its stored checksum.
+  When only verifying, nothing is inserted.
+  When only some blobs are selected, their fragments are fetched
+  in fragment order, which is close to page order.
+*/
+
+static int transfer_data(
+    globals *g)
+{
+    sqlite3_stmt *extract=NULL;
+    sqlite3_stmt *insert=NULL;
+    char const *extract_fmt;
+    int status,implicit,checked,sliced,bad;
+    sqlite3_int64 blob_cnt,bad_cnt,unchecked_cnt;
+
+    if (source_layout(g,&implicit,&checked,&sliced))
+        return -1;
+    if (g->selective) {
+        if (pick_splits(g))
+            return -1;
+        extract_fmt=implicit ?
+            extract_picked_implicit_fmt : extract_picked_frags_fmt;
+    } else {
+        extract_fmt=implicit ? extract_implicit_fmt : extract_frags_fmt;
+    }
+    if (prepare_layout(g,extract_fmt,checked,sliced,&extract))
+        return -1;
+
+    if (!g->verify_only) {
+        status=sqlite3_prepare_v2(
+            g->db,insert_blob_sql,sizeof insert_blob_sql,&insert,NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"sqlite3_prepare(insert_blob): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+    }
+
+    blob_cnt=bad_cnt=unchecked_cnt=0;
     for (;;) {
-        sqlite3_int64 blob_id;
-        sqlite3_value *head,*tail;
+        sqlite3_int64 blob_id,crc,head_size,tail_size;
+        unsigned char const *head,*tail;
+        int head_col,tail_col;
 
         status=sqlite3_step(extract);
         if (status!=SQLITE_ROW)
             break;
         blob_id=sqlite3_column_int64(extract,0);
-        sqlite3_bind_int64(insert,1,blob_id);
+        head_col=1;
+        tail_col=2;
+        if (implicit && sqlite3_column_int(extract,6)==2) {
+            head_col=2;
+            tail_col=1;
+        }
+        blob_cnt++;
+        if (!checked)
+            unchecked_cnt++;
+        if (sqlite3_column_type(extract,head_col)==SQLITE_NULL) {
+            if (g->verify_only)
+                continue;
+            sqlite3_bind_int64(insert,1,blob_id);
+            status=sqlite3_step(insert);
+            if (status!=SQLITE_DONE) {
+                fprintf(stderr,"sqlite3_step(insert): %s\n",
+                        sqlite3_errmsg(g->db));
+                return -1;
+            }
+            sqlite3_reset(insert);
+            continue;
+        }
 
-        head=sqlite3_column_value(extract,1);
-        if (!head) {
+        head=sqlite3_column_blob(extract,head_col);
+        head_size=sqlite3_column_bytes(extract,head_col);
+        tail=sqlite3_column_blob(extract,tail_col);
+        tail_size=sqlite3_column_bytes(extract,tail_col);
+        if (!head && head_size>0 || !tail && tail_size>0) {
             fputs(oom_msg,stderr);
             return -1;
         }
-        tail=sqlite3_column_value(extract,2);
-        if (!head) {
+        if (sqlite3_column_type(extract,4)!=SQLITE_NULL
+                && slice_frag(sqlite3_column_int64(extract,4),
+                              sqlite3_column_int64(extract,5),
+                              &head,&head_size)) {
+            fprintf(stderr,"Bad slice for blob %lld\n",blob_id);
+            bad_cnt++;
+            continue;
+        }
+        crc=sqlite3_column_type(extract,3)==SQLITE_NULL ?
+            -1 : sqlite3_column_int64(extract,3);
+        bad=emit_blob(g,insert,blob_id,crc,head,head_size,tail,tail_size);
+        if (bad<0)
+            return -1;
+        bad_cnt+=bad;
+    }
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(extract_frags): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+
+    sqlite3_finalize(extract);
+    sqlite3_finalize(insert);
+    if (bad_cnt>0) {
+        fprintf(stderr,"%lld of %lld blobs failed verification\n",
+                bad_cnt,blob_cnt);
+        return -1;
+    }
+    report_verified(g,blob_cnt,unchecked_cnt);
+    return 0;
+}
+
+/*
+  Sequential reassembly.
+
+  Instead of following the splits table in id order, which jumps all
+  over frags, scan frags in rowid order, which is also the physical
+  order.  The splits table is first turned into a list of fragment
+  references sorted by fragment id, merged against the scan.
+
+  A fragment whose partner hasn't been seen yet waits in a reorder
+  buffer keyed by split id.  Past the memory limit, waiting fragments
+  go to a temporary file instead.  Since blobpack puts a split's
+  fragments on nearby pages, the buffer usually stays small.
+
+  Blobs are inserted as they are completed, so not in id order.
+*/
+
+#define ROLE_WHOLE 0
+#define ROLE_HEAD 1
+#define ROLE_TAIL 2
+
+typedef struct frag_ref {
+    sqlite3_int64 frag_id;
+    sqlite3_int64 split_id;
+    sqlite3_int64 crc;
+    sqlite3_int64 offset;
+    sqlite3_int64 len;
+    int role;
+} frag_ref;
+
+typedef struct waiting {
+    sqlite3_int64 split_id;
+    sqlite3_int64 size;
+    sqlite3_int64 spill_offset;
+    unsigned char *data;
+    int role;
+} waiting;
+
+typedef struct reorder_buffer {
+    waiting *slots;
+    sqlite3_int64 mask;
+    sqlite3_int64 used;
+    sqlite3_int64 mem_used;
+    sqlite3_int64 mem_peak;
+    sqlite3_int64 spill_size;
+    FILE *spill;
+} reorder_buffer;
+
+static int compare_refs(
+    void const *a,
+    void const *b)
+{
+    frag_ref const *ra=a,*rb=b;
+
+    if (ra->frag_id!=rb->frag_id)
+        return ra->frag_id<rb->frag_id ? -1 : 1;
+    if (ra->split_id!=rb->split_id)
+        return ra->split_id<rb->split_id ? -1 : 1;
+    return 0;
+}
+
+static int add_ref(
+    frag_ref **refs,
+    sqlite3_int64 *ref_cnt,
+    sqlite3_int64 *ref_max,
+    sqlite3_int64 frag_id,
+    sqlite3_int64 split_id,
+    sqlite3_int64 crc,
+    int role)
+{
+    frag_ref *ref;
+
+    if (*ref_cnt>=*ref_max) {
+        frag_ref *more;
+
+        *ref_max=*ref_max ? *ref_max*2 : 1024;
+        more=sqlite3_realloc64(*refs,*ref_max*sizeof **refs);
+        if (!more) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+        *refs=more;
+    }
+    ref=&(*refs)[(*ref_cnt)++];
+    ref->frag_id=frag_id;
+    ref->split_id=split_id;
+    ref->crc=crc;
+    ref->offset=-1;
+    ref->len=0;
+    ref->role=role;
+    return 0;
+}
+
+static waiting *find_waiting(
+    reorder_buffer *rb,
+    sqlite3_int64 split_id)
+{
+    sqlite3_int64 slot;
+
+    slot=(sqlite3_uint64)split_id*0x9E3779B97F4A7C15>>20&rb->mask;
+    while (rb->slots[slot].role>=0) {
+        if (rb->slots[slot].split_id==split_id)
+            return &rb->slots[slot];
+        slot=slot+1&rb->mask;
+    }
+    return &rb->slots[slot];
+}
+
+/*
+  Linear probing with backward shift deletion, so no tombstones.
+*/
+
+static void remove_waiting(
+    reorder_buffer *rb,
+    waiting *w)
+{
+    sqlite3_int64 hole,slot;
+
+    hole=w-rb->slots;
+    slot=hole;
+    for (;;) {
+        sqlite3_int64 home;
+
+        slot=slot+1&rb->mask;
+        if (rb->slots[slot].role<0)
+            break;
+        home=(sqlite3_uint64)rb->slots[slot].split_id
+            *0x9E3779B97F4A7C15>>20&rb->mask;
+        if ((slot-home&rb->mask)>=(slot-hole&rb->mask)) {
+            rb->slots[hole]=rb->slots[slot];
+            hole=slot;
+        }
+    }
+    rb->slots[hole].role=-1;
+    rb->used--;
+}
+
+static int grow_buffer(
+    reorder_buffer *rb)
+{
+    waiting *old;
+    sqlite3_int64 old_cnt,i;
+
+    old=rb->slots;
+    old_cnt=old ? rb->mask+1 : 0;
+    rb->mask=old_cnt ? old_cnt*2-1 : 1023;
+    rb->slots=sqlite3_malloc64((rb->mask+1)*sizeof *rb->slots);
+    if (!rb->slots) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    for (i=0; i<=rb->mask; i++)
+        rb->slots[i].role=-1;
+    for (i=0; i<old_cnt; i++) {
+        if (old[i].role>=0)
+            *find_waiting(rb,old[i].split_id)=old[i];
+    }
+    sqlite3_free(old);
+    return 0;
+}
+
+static int park_frag(
+    globals *g,
+    reorder_buffer *rb,
+    frag_ref const *ref,
+    void const *data,
+    sqlite3_int64 size)
+{
+    waiting *w;
+
+    if (2*(rb->used+1)>rb->mask+1 && grow_buffer(rb))
+        return -1;
+    w=find_waiting(rb,ref->split_id);
+    w->split_id=ref->split_id;
+    w->role=ref->role;
+    w->size=size;
+    w->data=NULL;
+    w->spill_offset=-1;
+    if (rb->mem_used+size<=g->reorder_memory) {
+        w->data=sqlite3_malloc64(size ? size : 1);
+        if (!w->data) {
             fputs(oom_msg,stderr);
             return -1;
         }
-        if (sqlite3_value_type(head)==SQLITE_NULL) {
-            status=sqlite3_bind_null(insert,2);
-        } else if (sqlite3_value_type(tail)==SQLITE_NULL) {
-            status=sqlite3_bind_value(insert,2,head);
+        if (size>0)
+            memcpy(w->data,data,size);
+        rb->mem_used+=size;
+        if (rb->mem_used>rb->mem_peak)
+            rb->mem_peak=rb->mem_used;
+    } else {
+        if (!rb->spill) {
+            rb->spill=tmpfile();
+            if (!rb->spill) {
+                perror("tmpfile");
+                return -1;
+            }
+        }
+        if (fseeko(rb->spill,rb->spill_size,SEEK_SET)
+                || fwrite(data,1,size,rb->spill)!=(size_t)size) {
+            perror("spill file");
+            return -1;
+        }
+        w->spill_offset=rb->spill_size;
+        rb->spill_size+=size;
+    }
+    rb->used++;
+    return 0;
+}
+
+/*
+  Take a waiting fragment out of the buffer; the caller frees the data.
+  The slot may be reused by the removal, so read its size first.
+*/
+
+static unsigned char *unpark_frag(
+    reorder_buffer *rb,
+    waiting *w)
+{
+    unsigned char *data;
+
+    data=w->data;
+    if (data) {
+        rb->mem_used-=w->size;
+    } else {
+        data=sqlite3_malloc64(w->size ? w->size : 1);
+        if (!data) {
+            fputs(oom_msg,stderr);
+            return NULL;
+        }
+        if (fseeko(rb->spill,w->spill_offset,SEEK_SET)
+                || fread(data,1,w->size,rb->spill)!=(size_t)w->size) {
+            perror("spill file");
+            sqlite3_free(data);
+            return NULL;
+        }
+    }
+    remove_waiting(rb,w);
+    return data;
+}
+
+static int list_refs(
+    globals *g,
+    sqlite3_stmt *insert,
+    frag_ref **refs_ptr,
+    sqlite3_int64 *ref_cnt_ptr,
+    sqlite3_int64 *blob_cnt_ptr,
+    sqlite3_int64 *unchecked_cnt_ptr)
+{
+    sqlite3_stmt *list=NULL;
+    frag_ref *refs=NULL;
+    sqlite3_int64 ref_cnt,ref_max,blob_cnt,unchecked_cnt;
+    int status,implicit,checked,sliced;
+
+    if (source_layout(g,&implicit,&checked,&sliced)
+            || prepare_layout(
+                g,implicit ? list_implicit_splits_fmt : list_splits_fmt,
+                checked,sliced,&list))
+        return -1;
+
+    ref_cnt=ref_max=blob_cnt=unchecked_cnt=0;
+    for (;;) {
+        sqlite3_int64 split_id,head,tail,crc;
+
+        status=sqlite3_step(list);
+        if (status!=SQLITE_ROW)
+            break;
+        blob_cnt++;
+        if (!checked)
+            unchecked_cnt++;
+        split_id=sqlite3_column_int64(list,0);
+        crc=sqlite3_column_type(list,3)==SQLITE_NULL ?
+            -1 : sqlite3_column_int64(list,3);
+        if (sqlite3_column_type(list,1)==SQLITE_NULL) {
+            if (!g->verify_only) {
+                sqlite3_bind_int64(insert,1,split_id);
+                status=sqlite3_step(insert);
+                if (status!=SQLITE_DONE) {
+                    fprintf(stderr,"sqlite3_step(insert): %s\n",
+                            sqlite3_errmsg(g->db));
+                    return -1;
+                }
+                sqlite3_reset(insert);
+            }
+            continue;
+        }
+        head=sqlite3_column_int64(list,1);
+        if (sqlite3_column_type(list,2)==SQLITE_NULL) {
+            if (add_ref(&refs,&ref_cnt,&ref_max,head,split_id,crc,ROLE_WHOLE))
+                return -1;
+            if (sqlite3_column_type(list,4)!=SQLITE_NULL) {
+                refs[ref_cnt-1].offset=sqlite3_column_int64(list,4);
+                refs[ref_cnt-1].len=sqlite3_column_int64(list,5);
+            }
         } else {
-            sqlite3_int64 head_size,tail_size,blob_size;
-            char const *head_blob,*tail_blob;
-            char *blob;
-
-            head_blob=sqlite3_value_blob(head);
-            head_size=sqlite3_value_bytes(head);
-            tail_blob=sqlite3_value_blob(tail);
-            tail_size=sqlite3_value_bytes(tail);
-            if (!head_blob && head_size>0
-                    || !tail_blob && tail_size>0) {
-                fputs(oom_msg,stderr);
+            tail=sqlite3_column_int64(list,2);
+            if (add_ref(&refs,&ref_cnt,&ref_max,head,split_id,crc,ROLE_HEAD)
+                    || add_ref(&refs,&ref_cnt,&ref_max,tail,split_id,crc,
+                               ROLE_TAIL))
                 return -1;
+        }
+    }
+    if (status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(list_splits): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sqlite3_finalize(list);
+
+    if (ref_cnt>0)
+        qsort(refs,ref_cnt,sizeof *refs,compare_refs);
+    *refs_ptr=refs;
+    *ref_cnt_ptr=ref_cnt;
+    *blob_cnt_ptr=blob_cnt;
+    *unchecked_cnt_ptr=unchecked_cnt;
+    return 0;
+}
+
+static int transfer_sequential(
+    globals *g)
+{
+    sqlite3_stmt *scan=NULL;
+    sqlite3_stmt *insert=NULL;
+    frag_ref *refs=NULL;
+    reorder_buffer rb;
+    sqlite3_int64 ref_cnt,ref_no,blob_cnt,bad_cnt,unchecked_cnt;
+    int status,bad;
+
+    if (!g->verify_only) {
+        status=sqlite3_prepare_v2(
+            g->db,insert_blob_sql,sizeof insert_blob_sql,&insert,NULL);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"sqlite3_prepare(insert_blob): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+    }
+
+    iotrace_phase("list splits");
+    if (list_refs(g,insert,&refs,&ref_cnt,&blob_cnt,&unchecked_cnt))
+        return -1;
+    iotrace_phase("scan frags");
+
+    status=sqlite3_prepare_v2(
+        g->db,scan_frags_sql,sizeof scan_frags_sql,&scan,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(scan_frags): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+
+    memset(&rb,0,sizeof rb);
+    if (grow_buffer(&rb))
+        return -1;
+    ref_no=bad_cnt=0;
+    while (ref_no<ref_cnt) {
+        sqlite3_int64 frag_id,size;
+        void const *data;
+
+        status=sqlite3_step(scan);
+        if (status!=SQLITE_ROW)
+            break;
+        frag_id=sqlite3_column_int64(scan,0);
+        if (refs[ref_no].frag_id<frag_id)
+            break;
+        data=sqlite3_column_blob(scan,1);
+        size=sqlite3_column_bytes(scan,1);
+        if (!data && size>0) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+
+        for (; ref_no<ref_cnt && refs[ref_no].frag_id==frag_id; ref_no++) {
+            frag_ref const *ref=&refs[ref_no];
+            waiting *w;
+            unsigned char *other;
+            sqlite3_int64 other_size;
+
+            if (ref->role==ROLE_WHOLE) {
+                unsigned char const *piece;
+                sqlite3_int64 piece_size;
+
+                piece=data;
+                piece_size=size;
+                if (ref->offset>=0
+                        && slice_frag(ref->offset,ref->len,
+                                      &piece,&piece_size)) {
+                    fprintf(stderr,"Bad slice for blob %lld\n",
+                            ref->split_id);
+                    bad_cnt++;
+                    continue;
+                }
+                bad=emit_blob(g,insert,ref->split_id,ref->crc,
+                              piece,piece_size,NULL,0);
+            } else {
+                w=find_waiting(&rb,ref->split_id);
+                if (w->role<0) {
+                    if (park_frag(g,&rb,ref,data,size))
+                        return -1;
+                    continue;
+                }
+                other_size=w->size;
+                other=unpark_frag(&rb,w);
+                if (!other)
+                    return -1;
+                if (ref->role==ROLE_HEAD) {
+                    bad=emit_blob(g,insert,ref->split_id,ref->crc,
+                                  data,size,other,other_size);
+                } else {
+                    bad=emit_blob(g,insert,ref->split_id,ref->crc,
+                                  other,other_size,data,size);
+                }
+                sqlite3_free(other);
             }
-            blob_size=head_size+tail_size;
-            blob=sqlite3_malloc64(blob_size);
-            if (!blob) {
+            if (bad<0)
+                return -1;
+            bad_cnt+=bad;
+        }
+    }
+    if (status!=SQLITE_ROW && status!=SQLITE_DONE) {
+        fprintf(stderr,"sqlite3_step(scan_frags): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    if (ref_no<ref_cnt) {
+        fprintf(stderr,"Missing fragment %lld for blob %lld\n",
+                refs[ref_no].frag_id,refs[ref_no].split_id);
+        return -1;
+    }
+
+    sqlite3_finalize(scan);
+    sqlite3_finalize(insert);
+    sqlite3_free(refs);
+    sqlite3_free(rb.slots);
+    if (rb.spill)
+        fclose(rb.spill);
+    fprintf(stderr,"Reorder buffer peak %lld bytes, %lld bytes spilled\n",
+            rb.mem_peak,rb.spill_size);
+    if (bad_cnt>0) {
+        fprintf(stderr,"%lld of %lld blobs failed verification\n",
+                bad_cnt,blob_cnt);
+        return -1;
+    }
+    report_verified(g,blob_cnt,unchecked_cnt);
+    return 0;
+}
+
+static int transfer_source(
+    globals *g)
+{
+    if (g->sequential)
+        return transfer_sequential(g);
+    iotrace_phase("transfer");
+    return transfer_data(g);
+}
+
+/*
+  A sharded source is a manifest database listing the shard files,
+  relative to its own directory, in id order.  Each shard is attached
+  in turn as "source" and transferred like an unsharded one.
+  Since attaching isn't possible inside a transaction,
+  each shard gets a transaction of its own.
+  Shards whose id range lies outside the selected one are skipped.
+*/
+
+static int transfer_shards(
+    globals *g)
+{
+    sqlite3_stmt *find=NULL;
+    sqlite3_stmt *list=NULL;
+    sqlite3_stmt *attach=NULL;
+    char **paths=NULL;
+    char *errmsg=NULL;
+    int status,sharded;
+    int path_cnt,path_max,i;
+
+    status=sqlite3_prepare_v2(
+        g->db,find_manifest_sql,sizeof find_manifest_sql,&find,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(find_manifest): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    status=sqlite3_step(find);
+    if (status!=SQLITE_ROW) {
+        fprintf(stderr,"sqlite3_step(find_manifest): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    sharded=sqlite3_column_int(find,0);
+    sqlite3_finalize(find);
+    if (!sharded)
+        return transfer_source(g);
+
+    status=sqlite3_prepare_v2(
+        g->db,list_shards_sql,sizeof list_shards_sql,&list,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(list_shards): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    path_cnt=path_max=0;
+    for (;;) {
+        char const *path;
+
+        status=sqlite3_step(list);
+        if (status!=SQLITE_ROW)
+            break;
+        if (path_cnt>=path_max) {
+            char **more;
+
+            path_max=path_max ? path_max*2 : 16;
+            more=sqlite3_realloc64(paths,path_max*sizeof *paths);
+            if (!more) {
                 fputs(oom_msg,stderr);
                 return -1;
             }
-            if (head_size>0)
-                memcpy(blob,head_blob,head_size);
-            if (tail_size>0)
-                memcpy(blob+head_size,tail_blob,tail_size);
-            status=sqlite3_bind_blob64(insert,2,blob,blob_size,sqlite3_free);
+            paths=more;
         }
-        if (status!=SQLITE_OK) {
-            fprintf(stderr,"sqlite3_bind(insert): %s\n",sqlite3_errmsg(g->db));
+        if (sqlite3_column_int64(list,2)<g->lo_id
+                || sqlite3_column_int64(list,1)>g->hi_id)
+            continue;
+        path=(char const *)sqlite3_column_text(list,0);
+        if (!path) {
+            fputs(oom_msg,stderr);
             return -1;
         }
-        status=sqlite3_step(insert);
-        if (status!=SQLITE_DONE) {
-            fprintf(stderr,"sqlite3_step(insert): %s\n",sqlite3_errmsg(g->db));
+        paths[path_cnt]=shard_path(g,path);
+        if (!paths[path_cnt]) {
+            fputs(oom_msg,stderr);
             return -1;
         }
-        sqlite3_reset(insert);
-        sqlite3_clear_bindings(insert);
+        path_cnt++;
     }
     if (status!=SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step(extract_frags): %s\n",
+        fprintf(stderr,"sqlite3_step(list_shards): %s\n",
                 sqlite3_errmsg(g->db));
         return -1;
     }
+    sqlite3_finalize(list);
 
-    sqlite3_finalize(extract);
-    sqlite3_finalize(insert);
+    status=sqlite3_prepare_v2(
+        g->db,attach_sql,sizeof attach_sql,&attach,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(attach): %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
+    for (i=0; i<path_cnt; i++) {
+        fprintf(stderr,"Shard %d: %s\n",i,paths[i]);
+        status=sqlite3_exec(g->db,commit_sql,0,NULL,&errmsg);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"Failed to commit transaction: %s\n",errmsg);
+            return -1;
+        }
+        status=sqlite3_exec(g->db,detach_sql,0,NULL,&errmsg);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"Failed to detach source: %s\n",errmsg);
+            return -1;
+        }
+        sqlite3_bind_text(attach,1,paths[i],-1,SQLITE_STATIC);
+        status=sqlite3_step(attach);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(attach): %s\n",
+                    sqlite3_errmsg(g->db));
+            return -1;
+        }
+        sqlite3_reset(attach);
+        status=sqlite3_exec(g->db,begin_sql,0,NULL,&errmsg);
+        if (status!=SQLITE_OK) {
+            fprintf(stderr,"Failed to start transaction: %s\n",errmsg);
+            return -1;
+        }
+        if (transfer_source(g))
+            return -1;
+        sqlite3_free(paths[i]);
+    }
+    sqlite3_finalize(attach);
+    sqlite3_free(paths);
+    return 0;
+}
+
+static int create_output(
+    globals *g)
+{
+    char *errmsg=NULL;
+    int status;
+
+    if (g->verify_only)
+        return 0;
+    status=sqlite3_exec(g->db,create_blob_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to create destination table: %s\n",
+                sqlite3_errmsg(g->db));
+        return -1;
+    }
     return 0;
 }
 
@@ -237,15 +1339,54 @@ static int close_db(
                 sqlite3_errmsg(g->db));
         return -1;
     }
+    if (g->in_memory && write_image(g->db,g->tmp_path))
+        return -1;
     status=sqlite3_close_v2(g->db);
     if (status!=SQLITE_OK) {
         fprintf(stderr,"sqlite3_close: %s\n",sqlite3_errmsg(g->db));
         return -1;
     }
     g->db=NULL;
+    if (g->tmp_path) {
+        if (rename(g->tmp_path,g->dst_path)) {
+            perror(g->dst_path);
+            return -1;
+        }
+        if (sync_dir(g->dst_path))
+            return -1;
+        sqlite3_free(g->tmp_path);
+        g->tmp_path=NULL;
+    }
     return 0;
 }
 
+/*
+  Either bound of lo:hi may be left out.
+*/
+
+static int parse_range(
+    char const *str,
+    sqlite3_int64 *lo,
+    sqlite3_int64 *hi)
+{
+    char *end;
+
+    if (*str!=':') {
+        *lo=strtoll(str,&end,10);
+        if (end==str)
+            return -1;
+        str=end;
+    }
+    if (*str++!=':')
+        return -1;
+    if (*str) {
+        *hi=strtoll(str,&end,10);
+        if (end==str || *end)
+            return -1;
+    }
+    return *lo<=*hi ? 0 : -1;
+}
+
 static int parse_args(
     globals *g,
     int argc,
@@ -276,15 +1417,62 @@ static int parse_args(
             }
             g->page_size=page_size;
             argi++;
+        } else if (!strcmp(arg,"--verify-only")) {
+            g->verify_only=1;
+        } else if (!strcmp(arg,"--ids")) {
+            if (argi>=argc)
+                goto missing;
+            g->ids_path=argv[argi++];
+            g->selective=1;
+        } else if (!strcmp(arg,"--range")) {
+            if (argi>=argc)
+                goto missing;
+            if (parse_range(argv[argi],&g->lo_id,&g->hi_id)) {
+                fprintf(stderr,"Invalid range %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
+            g->selective=1;
+        } else if (!strcmp(arg,"--where")) {
+            if (argi>=argc)
+                goto missing;
+            g->where=argv[argi++];
+            g->selective=1;
+        } else if (!strcmp(arg,"--trace-io")) {
+            g->trace_io=1;
+        } else if (!strcmp(arg,"--sequential")) {
+            g->sequential=1;
+        } else if (!strcmp(arg,"--reorder-memory")) {
+            if (argi>=argc)
+                goto missing;
+            if (parse_size(argv[argi],&g->reorder_memory)) {
+                fprintf(stderr,"Invalid size %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
+        } else if (!strcmp(arg,"--build-in-memory")) {
+            if (argi>=argc)
+                goto missing;
+            if (parse_size(argv[argi],&g->memory_limit)) {
+                fprintf(stderr,"Invalid size %s\n",argv[argi]);
+                return -1;
+            }
+            argi++;
         } else {
             fprintf(stderr,"Unknown option %s\n",arg);
             goto usage;
         }
     }
-    if (argc-argi<2)
+    if (g->sequential && g->selective) {
+        fputs("--sequential reads every fragment;"
+              " it can't be combined with a selection\n",stderr);
+        return -1;
+    }
+    if (argc-argi<(g->verify_only ? 1 : 2))
         goto usage;
     g->src_path=argv[argi++];
-    g->dst_path=argv[argi++];
+    if (!g->verify_only)
+        g->dst_path=argv[argi++];
     return 0;
 
 missing:
@@ -301,10 +1489,18 @@ usage:
         } else {
             progname=argv[0];
         }
-        fprintf(stderr,"Usage: %s [ options ] src-path dst-path\n",progname);
+        fprintf(stderr,"Usage: %s [ options ] src-path dst-path\n"
+                "       %s --verify-only src-path\n",progname,progname);
     }
     fputs("    Options:\n"
-          "        --page-size         number\n",
+          "        --page-size         number\n"
+          "        --ids               path\n"
+          "        --range             lo:hi\n"
+          "        --where             condition\n"
+          "        --trace-io\n"
+          "        --sequential\n"
+          "        --reorder-memory    bytes\n"
+          "        --build-in-memory   bytes\n",
           stderr);
     return -1;
 }
@@ -317,12 +1513,27 @@ int main(
 
     if (parse_args(&g,argc,argv))
         return 11;
+    crc32c_init();
+    if (g.trace_io && iotrace_register(NULL)!=SQLITE_OK) {
+        fputs("Failed to register the tracing VFS\n",stderr);
+        return 1;
+    }
+    iotrace_phase("open");
     if (open_db(&g))
         return 1;
-    if (transfer_data(&g))
+    if (create_output(&g))
         return 1;
+    if (create_selection(&g))
+        return 1;
+    if (transfer_shards(&g))
+        return 1;
+    iotrace_phase("commit");
     if (close_db(&g))
         return 1;
+    if (g.trace_io) {
+        fputs("I/O by phase:\n",stderr);
+        iotrace_report(stderr);
+    }
     return 0;
 }
 
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "common.h"
+
+static char const oom_msg[] =
+    "Out of memory or something\n";
+
+int parse_size(
+    char const *str,
+    sqlite3_int64 *size)
+{
+    long long val;
+    char suffix,extra;
+    int cnt;
+
+    suffix='\0';
+    cnt=sscanf(str,"%lld%c%c",&val,&suffix,&extra);
+    if (cnt<1 || cnt>2 || val<=0)
+        return -1;
+    switch (suffix) {
+    case '\0':
+        break;
+    case 'T':
+        val*=1024;
+        /* FALLTHROUGH */
+    case 'G':
+        val*=1024;
+        /* FALLTHROUGH */
+    case 'M':
+        val*=1024;
+        /* FALLTHROUGH */
+    case 'k':
+        val*=1024;
+        break;
+    default:
+        return -1;
+    }
+    *size=val;
+    return 0;
+}
+
+/*
+  The image is written straight from the in-memory database when
+  SQLite can hand it out without a copy.
+*/
+
+int write_image(
+    sqlite3 *db,
+    char const *path)
+{
+    unsigned char *image,*copy=NULL;
+    sqlite3_int64 size,done;
+    int fd;
+
+    image=sqlite3_serialize(db,"main",&size,SQLITE_SERIALIZE_NOCOPY);
+    if (!image) {
+        image=copy=sqlite3_serialize(db,"main",&size,0);
+        if (!image) {
+            fputs(oom_msg,stderr);
+            return -1;
+        }
+    }
+    fd=open(path,O_WRONLY | O_CREAT | O_TRUNC,0666);
+    if (fd<0) {
+        perror(path);
+        goto fail;
+    }
+    for (done=0; done<size; ) {
+        ssize_t len;
+
+        len=write(fd,image+done,size-done);
+        if (len<0) {
+            if (errno==EINTR)
+                continue;
+            perror(path);
+            goto fail;
+        }
+        if (len==0) {
+            fprintf(stderr,"%s: Short write\n",path);
+            goto fail;
+        }
+        done+=len;
+    }
+    if (fsync(fd)) {
+        perror(path);
+        goto fail;
+    }
+    if (close(fd)) {
+        fd=-1;
+        perror(path);
+        goto fail;
+    }
+    sqlite3_free(copy);
+    return 0;
+
+fail:
+    if (fd>=0)
+        close(fd);
+    sqlite3_free(copy);
+    return -1;
+}
+
+int sync_dir(
+    char const *path)
+{
+    char *dir_path;
+    char const *slash;
+    int fd,status;
+
+    slash=strrchr(path,'/');
+    if (slash) {
+        dir_path=sqlite3_mprintf("%.*s",(int)(slash-path)+1,path);
+    } else {
+        dir_path=sqlite3_mprintf(".");
+    }
+    if (!dir_path) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    status=0;
+    fd=open(dir_path,O_RDONLY);
+    if (fd<0 || fsync(fd)) {
+        perror(dir_path);
+        status=-1;
+    }
+    if (fd>=0)
+        close(fd);
+    sqlite3_free(dir_path);
+    return status;
+}
@@ -0,0 +1,29 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <sqlite3.h>
+
+/*
+  Helpers shared by blobpack and blobunpack.
+
+  parse_size reads a positive byte count with an optional binary
+  suffix: k, M, G or T.  It returns -1 on anything else.
+
+  write_image writes the main database of db to path, a new file, with
+  one sequential write and one fsync.  sync_dir syncs the directory
+  holding path, to make a rename into it durable.  Both report
+  failures on stderr and return -1.
+*/
+
+extern int parse_size(
+    char const *str,
+    sqlite3_int64 *size);
+
+extern int write_image(
+    sqlite3 *db,
+    char const *path);
+
+extern int sync_dir(
+    char const *path);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82F63B78
+
+static uint32_t table[8][256];
+
+static uint32_t crc32c_sw(
+    uint32_t crc,
+    unsigned char const *data,
+    size_t len)
+{
+    while (len>0 && ((uintptr_t)data&7)) {
+        crc=table[0][(crc^*data++)&0xFF]^crc>>8;
+        len--;
+    }
+    while (len>=8) {
+        uint64_t word;
+
+        memcpy(&word,data,8);
+        word^=crc;
+        crc=table[7][word&0xFF]
+            ^table[6][word>>8&0xFF]
+            ^table[5][word>>16&0xFF]
+            ^table[4][word>>24&0xFF]
+            ^table[3][word>>32&0xFF]
+            ^table[2][word>>40&0xFF]
+            ^table[1][word>>48&0xFF]
+            ^table[0][word>>56];
+        data+=8;
+        len-=8;
+    }
+    while (len>0) {
+        crc=table[0][(crc^*data++)&0xFF]^crc>>8;
+        len--;
+    }
+    return crc;
+}
+
+/*
+  The slicing-by-8 code above assumes a little-endian machine,
+  as does the hardware path below.
+*/
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(
+    uint32_t crc,
+    unsigned char const *data,
+    size_t len)
+{
+    uint64_t crc64;
+
+    while (len>0 && ((uintptr_t)data&7)) {
+        crc=__builtin_ia32_crc32qi(crc,*data++);
+        len--;
+    }
+    crc64=crc;
+    while (len>=8) {
+        uint64_t word;
+
+        memcpy(&word,data,8);
+        crc64=__builtin_ia32_crc32di(crc64,word);
+        data+=8;
+        len-=8;
+    }
+    crc=(uint32_t)crc64;
+    while (len>0) {
+        crc=__builtin_ia32_crc32qi(crc,*data++);
+        len--;
+    }
+    return crc;
+}
+
+#endif
+
+static uint32_t (*crc32c_impl)(
+    uint32_t crc,
+    unsigned char const *data,
+    size_t len) = crc32c_sw;
+
+void crc32c_init(void)
+{
+    uint32_t i,j,crc;
+
+    for (i=0; i<256; i++) {
+        crc=i;
+        for (j=0; j<8; j++)
+            crc=crc&1 ? crc>>1^POLY : crc>>1;
+        table[0][i]=crc;
+    }
+    for (i=0; i<256; i++) {
+        crc=table[0][i];
+        for (j=1; j<8; j++) {
+            crc=table[0][crc&0xFF]^crc>>8;
+            table[j][i]=crc;
+        }
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl=crc32c_hw;
+#endif
+}
+
+unsigned int crc32c(
+    unsigned int crc,
+    void const *data,
+    size_t len)
+{
+    return ~crc32c_impl(~(uint32_t)crc,data,len);
+}
+
+/*
+  Combining works by applying len2 zero bytes' worth of the crc
+  shift register to crc1, using repeated squaring of the
+  corresponding GF(2) matrix.  Same method as zlib.
+*/
+
+static uint32_t gf2_times(
+    uint32_t const *mat,
+    uint32_t vec)
+{
+    uint32_t sum;
+
+    sum=0;
+    while (vec) {
+        if (vec&1)
+            sum^=*mat;
+        vec>>=1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_square(
+    uint32_t *square,
+    uint32_t const *mat)
+{
+    int n;
+
+    for (n=0; n<32; n++)
+        square[n]=gf2_times(mat,mat[n]);
+}
+
+unsigned int crc32c_combine(
+    unsigned int crc1,
+    unsigned int crc2,
+    long long len2)
+{
+    uint32_t even[32],odd[32];
+    uint32_t row;
+    int n;
+
+    if (len2<=0)
+        return crc1;
+
+    odd[0]=POLY;
+    row=1;
+    for (n=1; n<32; n++) {
+        odd[n]=row;
+        row<<=1;
+    }
+    gf2_square(even,odd);
+    gf2_square(odd,even);
+
+    do {
+        gf2_square(even,odd);
+        if (len2&1)
+            crc1=gf2_times(even,crc1);
+        len2>>=1;
+        if (!len2)
+            break;
+        gf2_square(odd,even);
+        if (len2&1)
+            crc1=gf2_times(odd,crc1);
+        len2>>=1;
+    } while (len2);
+
+    return crc1^crc2;
+}
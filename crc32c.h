@@ -0,0 +1,33 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+
+/*
+  CRC-32C (Castagnoli), as used by iSCSI and ext4.
+
+  crc32c_init must be called once before anything else;
+  it picks the fastest implementation the cpu supports.
+
+  crc32c(0,data,len) computes the checksum of a buffer;
+  pass a previous result as the first argument to continue it.
+*/
+
+extern void crc32c_init(void);
+
+extern unsigned int crc32c(
+    unsigned int crc,
+    void const *data,
+    size_t len);
+
+/*
+  Checksum of the concatenation of two buffers,
+  given their checksums and the length of the second one.
+*/
+
+extern unsigned int crc32c_combine(
+    unsigned int crc1,
+    unsigned int crc2,
+    long long len2);
+
+#endif
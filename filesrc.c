@@ -0,0 +1,809 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "filesrc.h"
+
+/*
+  A blob can't be larger than this in SQLite, whatever the limits
+  it was compiled with.
+*/
+
+#define MAX_FILE_SIZE 2147483647
+
+typedef struct file_entry {
+    char *name;
+    sqlite3_int64 size;
+    sqlite3_int64 offset;
+} file_entry;
+
+struct filesrc {
+    char *path;
+    int is_dir;
+    int is_tar;
+    file_entry *entries;
+    sqlite3_int64 entry_cnt;
+    sqlite3_int64 entry_max;
+    unsigned char *map;
+    size_t map_size;
+};
+
+static char const oom_msg[] =
+    "Out of memory or something\n";
+
+/*
+  Takes over name, even on failure.
+*/
+
+static int add_entry(
+    filesrc *src,
+    char *name,
+    sqlite3_int64 size,
+    sqlite3_int64 offset)
+{
+    file_entry *e;
+
+    if (!name) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    if (size>MAX_FILE_SIZE) {
+        fprintf(stderr,"%s: %s: Too large for a blob\n",src->path,name);
+        sqlite3_free(name);
+        return -1;
+    }
+    if (src->entry_cnt==src->entry_max) {
+        sqlite3_int64 entry_max;
+        file_entry *entries;
+
+        entry_max=src->entry_max ? 2*src->entry_max : 1024;
+        entries=sqlite3_realloc64(src->entries,entry_max*sizeof *entries);
+        if (!entries) {
+            fputs(oom_msg,stderr);
+            sqlite3_free(name);
+            return -1;
+        }
+        src->entries=entries;
+        src->entry_max=entry_max;
+    }
+    e=&src->entries[src->entry_cnt++];
+    e->name=name;
+    e->size=size;
+    e->offset=offset;
+    return 0;
+}
+
+/*
+  Regular files only; symbolic links, devices and the like are skipped.
+  The directory descriptor is closed before returning.
+*/
+
+static int scan_dir(
+    filesrc *src,
+    int dir_fd,
+    char const *prefix)
+{
+    DIR *dir;
+    struct dirent *de;
+
+    dir=fdopendir(dir_fd);
+    if (!dir) {
+        fprintf(stderr,"%s/%s: %s\n",src->path,prefix,strerror(errno));
+        close(dir_fd);
+        return -1;
+    }
+    for (;;) {
+        struct stat st;
+        char *name;
+
+        errno=0;
+        de=readdir(dir);
+        if (!de)
+            break;
+        if (!strcmp(de->d_name,".") || !strcmp(de->d_name,".."))
+            continue;
+        name=sqlite3_mprintf("%s%s",prefix,de->d_name);
+        if (!name) {
+            fputs(oom_msg,stderr);
+            closedir(dir);
+            return -1;
+        }
+        if (fstatat(dirfd(dir),de->d_name,&st,AT_SYMLINK_NOFOLLOW)) {
+            fprintf(stderr,"%s/%s: %s\n",src->path,name,strerror(errno));
+            sqlite3_free(name);
+            closedir(dir);
+            return -1;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            char *sub_prefix;
+            int sub_fd;
+
+            sub_prefix=sqlite3_mprintf("%s/",name);
+            sub_fd=openat(dirfd(dir),de->d_name,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (!sub_prefix || sub_fd<0) {
+                if (!sub_prefix) {
+                    fputs(oom_msg,stderr);
+                } else {
+                    fprintf(stderr,"%s/%s: %s\n",
+                            src->path,name,strerror(errno));
+                }
+                sqlite3_free(sub_prefix);
+                sqlite3_free(name);
+                closedir(dir);
+                return -1;
+            }
+            sqlite3_free(name);
+            if (scan_dir(src,sub_fd,sub_prefix)) {
+                sqlite3_free(sub_prefix);
+                closedir(dir);
+                return -1;
+            }
+            sqlite3_free(sub_prefix);
+        } else if (S_ISREG(st.st_mode)) {
+            if (add_entry(src,name,st.st_size,0)) {
+                closedir(dir);
+                return -1;
+            }
+        } else {
+            sqlite3_free(name);
+        }
+    }
+    if (errno) {
+        fprintf(stderr,"%s/%s: %s\n",src->path,prefix,strerror(errno));
+        closedir(dir);
+        return -1;
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int scan_list(
+    filesrc *src)
+{
+    FILE *file;
+    char *line=NULL;
+    size_t line_max=0;
+    ssize_t len;
+
+    file=fopen(src->path,"r");
+    if (!file) {
+        perror(src->path);
+        return -1;
+    }
+    while ((len=getline(&line,&line_max,file))>=0) {
+        struct stat st;
+
+        while (len>0 && (line[len-1]=='\n' || line[len-1]=='\r'))
+            line[--len]=0;
+        if (len==0)
+            continue;
+        if (stat(line,&st)) {
+            perror(line);
+            free(line);
+            fclose(file);
+            return -1;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr,"%s: Not a regular file\n",line);
+            free(line);
+            fclose(file);
+            return -1;
+        }
+        if (add_entry(src,sqlite3_mprintf("%s",line),st.st_size,0)) {
+            free(line);
+            fclose(file);
+            return -1;
+        }
+    }
+    free(line);
+    if (ferror(file)) {
+        perror(src->path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+  Tar archives: POSIX ustar with pax extended headers for long names
+  and large sizes, and GNU tar's 'L' long name entries.  Numeric fields
+  are octal, or GNU base-256 when the high bit of the first byte is set.
+  Returns -1 for a malformed field.
+*/
+
+static sqlite3_int64 tar_number(
+    unsigned char const *field,
+    int len)
+{
+    sqlite3_int64 val;
+    int i;
+
+    val=0;
+    if (field[0]&0x80) {
+        val=field[0]&0x3f;
+        if (field[0]&0x40)
+            return -1;
+        for (i=1; i<len; i++) {
+            if (val>(INT64_MAX>>8))
+                return -1;
+            val=val<<8|field[i];
+        }
+        return val;
+    }
+    for (i=0; i<len && field[i]==' '; i++)
+        ;
+    for (; i<len && field[i]>='0' && field[i]<='7'; i++) {
+        if (val>(INT64_MAX>>3))
+            return -1;
+        val=val<<3|(field[i]-'0');
+    }
+    for (; i<len; i++) {
+        if (field[i]!=' ' && field[i]!=0)
+            return -1;
+    }
+    return val;
+}
+
+static int tar_checksum_ok(
+    unsigned char const *h)
+{
+    sqlite3_int64 stored;
+    unsigned int sum;
+    int signed_sum,i;
+
+    stored=tar_number(h+148,8);
+    sum=signed_sum=0;
+    for (i=0; i<512; i++) {
+        unsigned char ch;
+
+        ch=i>=148 && i<156 ? ' ' : h[i];
+        sum+=ch;
+        signed_sum+=(signed char)ch;
+    }
+    return stored==sum || stored==signed_sum;
+}
+
+/*
+  Archive names lose a leading "./", so that an archive of "."
+  gives the same names as the directory itself.
+*/
+
+static char *tar_name(
+    char const *name,
+    int len)
+{
+    while (len>=2 && name[0]=='.' && name[1]=='/') {
+        name+=2;
+        len-=2;
+        while (len>0 && name[0]=='/') {
+            name++;
+            len--;
+        }
+    }
+    return sqlite3_mprintf("%.*s",len,name);
+}
+
+/*
+  Each pax record is "length key=value\n".  Only path, linkpath and
+  size matter here, and the GNU.sparse keys, which make the member
+  data a sparse map rather than the file itself.
+*/
+
+static int parse_pax(
+    filesrc *src,
+    unsigned char const *data,
+    sqlite3_int64 size,
+    char **path,
+    char **link_path,
+    sqlite3_int64 *file_size)
+{
+    sqlite3_int64 pos;
+
+    pos=0;
+    while (pos<size) {
+        char const *rec,*key,*value,*end;
+        sqlite3_int64 rec_len;
+
+        rec=(char const *)data+pos;
+        rec_len=0;
+        while (pos+rec_len<size && rec[rec_len]>='0' && rec[rec_len]<='9')
+            rec_len++;
+        if (rec_len==0 || pos+rec_len>=size || rec[rec_len]!=' ')
+            break;
+        key=rec+rec_len+1;
+        rec_len=strtoll(rec,NULL,10);
+        if (rec_len<=0 || pos+rec_len>size || rec[rec_len-1]!='\n')
+            break;
+        end=rec+rec_len-1;
+        value=memchr(key,'=',end-key);
+        if (!value)
+            break;
+        value++;
+        if (value-key==5 && !memcmp(key,"path",4)) {
+            sqlite3_free(*path);
+            *path=tar_name(value,(int)(end-value));
+            if (!*path) {
+                fputs(oom_msg,stderr);
+                return -1;
+            }
+        } else if (value-key==9 && !memcmp(key,"linkpath",8)) {
+            sqlite3_free(*link_path);
+            *link_path=tar_name(value,(int)(end-value));
+            if (!*link_path) {
+                fputs(oom_msg,stderr);
+                return -1;
+            }
+        } else if (value-key==5 && !memcmp(key,"size",4)) {
+            *file_size=strtoll(value,NULL,10);
+        } else if (value-key>11 && !memcmp(key,"GNU.sparse.",11)) {
+            fprintf(stderr,"%s: Sparse files aren't supported\n",src->path);
+            return -1;
+        }
+        pos+=rec_len;
+    }
+    if (pos<size) {
+        fprintf(stderr,"%s: Malformed pax header\n",src->path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  A hard link stands for the latest earlier member of the name it
+  links to, and gets that member's data under its own name.
+*/
+
+static int find_link(
+    filesrc *src,
+    char const *name,
+    file_entry const **target)
+{
+    sqlite3_int64 i;
+
+    for (i=src->entry_cnt-1; i>=0; i--) {
+        if (!strcmp(src->entries[i].name,name)) {
+            *target=&src->entries[i];
+            return 0;
+        }
+    }
+    fprintf(stderr,"%s: Hard link to %s, which isn't an earlier member\n",
+            src->path,name);
+    return -1;
+}
+
+/*
+  Regular files and hard links to them are listed; symbolic links,
+  directories, devices, FIFOs, volume labels and global pax headers are
+  skipped.  Any other member type, such as a GNU sparse file, is an
+  error rather than a file silently left out.
+*/
+
+static int scan_tar(
+    filesrc *src,
+    int fd)
+{
+    struct stat st;
+    sqlite3_int64 pos,pax_size;
+    char *long_name=NULL;
+    char *long_link=NULL;
+    char *pax_path=NULL;
+    char *pax_link=NULL;
+    int status,ended;
+
+    if (fstat(fd,&st)) {
+        perror(src->path);
+        return -1;
+    }
+    src->map_size=st.st_size;
+    src->map=mmap(NULL,src->map_size,PROT_READ,MAP_SHARED,fd,0);
+    if (src->map==MAP_FAILED) {
+        src->map=NULL;
+        perror(src->path);
+        return -1;
+    }
+
+    status=ended=0;
+    pax_size=-1;
+    pos=0;
+    while (pos+512<=(sqlite3_int64)src->map_size) {
+        unsigned char const *h;
+        sqlite3_int64 size,data;
+        int i;
+
+        h=src->map+pos;
+        for (i=0; i<512 && !h[i]; i++)
+            ;
+        if (i==512) {
+            ended=1;
+            break;
+        }
+        size=tar_number(h+124,12);
+        if (!tar_checksum_ok(h) || size<0) {
+            fprintf(stderr,"%s: Bad tar header at offset %lld\n",
+                    src->path,pos);
+            status=-1;
+            break;
+        }
+        data=pos+512;
+        if (h[156]=='0' || h[156]==0 || h[156]=='7' || h[156]=='1') {
+            char *name;
+
+            if (pax_size>=0)
+                size=pax_size;
+            if (pax_path) {
+                name=pax_path;
+                pax_path=NULL;
+            } else if (long_name) {
+                name=long_name;
+                long_name=NULL;
+            } else if (h[345] && !memcmp(h+257,"ustar",6)) {
+                /* POSIX only; GNU tar keeps other fields there */
+                char full[256];
+                int len;
+
+                len=snprintf(full,sizeof full,"%.*s/%.*s",
+                             (int)strnlen((char const *)h+345,155),h+345,
+                             (int)strnlen((char const *)h,100),h);
+                name=tar_name(full,len);
+            } else {
+                name=tar_name((char const *)h,
+                              (int)strnlen((char const *)h,100));
+            }
+            if (h[156]=='1') {
+                file_entry const *target;
+                char *link;
+
+                if (pax_link) {
+                    link=pax_link;
+                    pax_link=NULL;
+                } else if (long_link) {
+                    link=long_link;
+                    long_link=NULL;
+                } else {
+                    link=tar_name((char const *)h+157,
+                                  (int)strnlen((char const *)h+157,100));
+                }
+                if (!name || !link) {
+                    fputs(oom_msg,stderr);
+                    sqlite3_free(name);
+                    sqlite3_free(link);
+                    status=-1;
+                    break;
+                }
+                status=find_link(src,link,&target);
+                sqlite3_free(link);
+                if (status) {
+                    sqlite3_free(name);
+                    break;
+                }
+                if (add_entry(src,name,target->size,target->offset)) {
+                    status=-1;
+                    break;
+                }
+            } else {
+                if (data+size>(sqlite3_int64)src->map_size) {
+                    fprintf(stderr,"%s: Truncated archive\n",src->path);
+                    sqlite3_free(name);
+                    status=-1;
+                    break;
+                }
+                if (add_entry(src,name,size,data)) {
+                    status=-1;
+                    break;
+                }
+            }
+        } else {
+            if (data+size>(sqlite3_int64)src->map_size) {
+                fprintf(stderr,"%s: Truncated archive\n",src->path);
+                status=-1;
+                break;
+            }
+            if (h[156]=='L' || h[156]=='K') {
+                char **long_ptr;
+
+                long_ptr=h[156]=='L' ? &long_name : &long_link;
+                sqlite3_free(*long_ptr);
+                *long_ptr=tar_name((char const *)src->map+data,
+                                   (int)strnlen((char const *)src->map+data,
+                                                size));
+                if (!*long_ptr) {
+                    fputs(oom_msg,stderr);
+                    status=-1;
+                    break;
+                }
+                pos=data+(size+511)/512*512;
+                continue;
+            }
+            if (h[156]=='x') {
+                if (parse_pax(src,src->map+data,size,
+                              &pax_path,&pax_link,&pax_size)) {
+                    status=-1;
+                    break;
+                }
+                pos=data+(size+511)/512*512;
+                continue;
+            }
+            if (!strchr("23456DVg",h[156])) {
+                fprintf(stderr,"%s: Unsupported member type '%c'"
+                        " at offset %lld\n",src->path,h[156],pos);
+                status=-1;
+                break;
+            }
+        }
+        /* anything but a long name or a pax header ends its entry */
+        sqlite3_free(long_name);
+        sqlite3_free(long_link);
+        sqlite3_free(pax_path);
+        sqlite3_free(pax_link);
+        long_name=long_link=pax_path=pax_link=NULL;
+        pax_size=-1;
+        pos=data+(size+511)/512*512;
+    }
+    sqlite3_free(long_name);
+    sqlite3_free(long_link);
+    sqlite3_free(pax_path);
+    sqlite3_free(pax_link);
+    if (status==0 && !ended && pos!=(sqlite3_int64)src->map_size) {
+        fprintf(stderr,"%s: Truncated archive\n",src->path);
+        status=-1;
+    }
+    if (status==0)
+        madvise(src->map,src->map_size,MADV_WILLNEED);
+    return status;
+}
+
+/*
+  By name, and by position for equal names, so that the last of
+  several archive members with the same name wins.
+*/
+
+static int compare_entries(
+    void const *a,
+    void const *b)
+{
+    file_entry const *ea=a,*eb=b;
+    int cmp;
+
+    cmp=strcmp(ea->name,eb->name);
+    if (cmp)
+        return cmp;
+    if (ea->offset!=eb->offset)
+        return ea->offset<eb->offset ? -1 : 1;
+    return 0;
+}
+
+static void sort_entries(
+    filesrc *src)
+{
+    sqlite3_int64 i,kept;
+
+    qsort(src->entries,src->entry_cnt,sizeof *src->entries,compare_entries);
+    kept=0;
+    for (i=0; i<src->entry_cnt; i++) {
+        if (i+1<src->entry_cnt
+                && !strcmp(src->entries[i].name,src->entries[i+1].name)) {
+            sqlite3_free(src->entries[i].name);
+            continue;
+        }
+        src->entries[kept++]=src->entries[i];
+    }
+    src->entry_cnt=kept;
+}
+
+int filesrc_open(
+    char const *path,
+    filesrc **src_ptr)
+{
+    filesrc *src;
+    struct stat st;
+    unsigned char header[512];
+    ssize_t got;
+    int fd,status;
+
+    *src_ptr=NULL;
+    fd=open(path,O_RDONLY | O_CLOEXEC);
+    if (fd<0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd,&st)) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    got=0;
+    if (!S_ISDIR(st.st_mode)) {
+        got=pread(fd,header,sizeof header,0);
+        if (got<0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        if (got==0 || got>=16 && !memcmp(header,"SQLite format 3",16)) {
+            close(fd);
+            return 1;
+        }
+    }
+
+    src=sqlite3_malloc(sizeof *src);
+    if (!src) {
+        fputs(oom_msg,stderr);
+        close(fd);
+        return -1;
+    }
+    memset(src,0,sizeof *src);
+    src->path=sqlite3_mprintf("%s",path);
+    if (!src->path) {
+        fputs(oom_msg,stderr);
+        sqlite3_free(src);
+        close(fd);
+        return -1;
+    }
+    *src_ptr=src;
+    if (S_ISDIR(st.st_mode)) {
+        src->is_dir=1;
+        status=scan_dir(src,fd,"");
+    } else if (got==512 && !memcmp(header+257,"ustar",5)) {
+        src->is_tar=1;
+        status=scan_tar(src,fd);
+        close(fd);
+    } else {
+        close(fd);
+        status=scan_list(src);
+    }
+    if (status)
+        return -1;
+    sort_entries(src);
+    return 0;
+}
+
+sqlite3_int64 filesrc_count(
+    filesrc const *src)
+{
+    return src->entry_cnt;
+}
+
+sqlite3_int64 filesrc_size(
+    filesrc const *src,
+    sqlite3_int64 entry_no)
+{
+    return src->entries[entry_no].size;
+}
+
+char const *filesrc_name(
+    filesrc const *src,
+    sqlite3_int64 entry_no)
+{
+    return src->entries[entry_no].name;
+}
+
+/*
+  Entries are sorted by name, with no two alike.
+*/
+
+sqlite3_int64 filesrc_find(
+    filesrc const *src,
+    char const *name)
+{
+    sqlite3_int64 lo,hi;
+
+    lo=0;
+    hi=src->entry_cnt;
+    while (lo<hi) {
+        sqlite3_int64 mid;
+        int cmp;
+
+        mid=lo+(hi-lo)/2;
+        cmp=strcmp(src->entries[mid].name,name);
+        if (!cmp)
+            return mid;
+        if (cmp<0) {
+            lo=mid+1;
+        } else {
+            hi=mid;
+        }
+    }
+    return -1;
+}
+
+/*
+  An empty file maps to NULL.  A file that changed size since it was
+  listed is an error, since the packing plan depends on its size.
+*/
+
+int filesrc_map(
+    filesrc *src,
+    sqlite3_int64 entry_no,
+    unsigned char const **data)
+{
+    file_entry const *e=&src->entries[entry_no];
+    struct stat st;
+    char *path;
+    void *map;
+    int fd;
+
+    if (src->is_tar) {
+        *data=src->map+e->offset;
+        return 0;
+    }
+    if (src->is_dir) {
+        path=sqlite3_mprintf("%s/%s",src->path,e->name);
+    } else {
+        path=sqlite3_mprintf("%s",e->name);
+    }
+    if (!path) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    fd=open(path,O_RDONLY | O_CLOEXEC);
+    if (fd<0) {
+        perror(path);
+        sqlite3_free(path);
+        return -1;
+    }
+    if (fstat(fd,&st)) {
+        perror(path);
+        close(fd);
+        sqlite3_free(path);
+        return -1;
+    }
+    if (st.st_size!=e->size) {
+        fprintf(stderr,"%s: Changed size since it was listed\n",path);
+        close(fd);
+        sqlite3_free(path);
+        return -1;
+    }
+    *data=NULL;
+    if (e->size>0) {
+        map=mmap(NULL,e->size,PROT_READ,MAP_SHARED,fd,0);
+        if (map==MAP_FAILED) {
+            perror(path);
+            close(fd);
+            sqlite3_free(path);
+            return -1;
+        }
+        madvise(map,e->size,MADV_SEQUENTIAL);
+        *data=map;
+    }
+    close(fd);
+    sqlite3_free(path);
+    return 0;
+}
+
+void filesrc_unmap(
+    filesrc *src,
+    sqlite3_int64 entry_no,
+    unsigned char const *data)
+{
+    if (!src->is_tar && data)
+        munmap((void *)data,src->entries[entry_no].size);
+}
+
+void filesrc_close(
+    filesrc *src)
+{
+    sqlite3_int64 i;
+
+    if (!src)
+        return;
+    for (i=0; i<src->entry_cnt; i++)
+        sqlite3_free(src->entries[i].name);
+    sqlite3_free(src->entries);
+    if (src->map)
+        munmap(src->map,src->map_size);
+    sqlite3_free(src->path);
+    sqlite3_free(src);
+}
@@ -0,0 +1,56 @@
+#ifndef FILESRC_H
+#define FILESRC_H
+
+#include <sqlite3.h>
+
+/*
+  Plain files as a blob source, without loading them into a database
+  first: a directory tree, a tar archive or a text file listing one
+  file path per line.
+
+  filesrc_open lists the files once, with their sizes, and sorts them
+  by name, so entry k (counting from 0) is the same file on every run
+  over the same files.  Names are relative to the directory, as stored
+  in the archive, or as listed.  It returns 1, without opening
+  anything, if the path is a SQLite database.  filesrc_find looks up
+  an entry by name, and returns -1 if there is none.
+
+  Contents are memory-mapped.  A tar archive is mapped as a whole when
+  it's opened; any other file only while filesrc_map has it in use.
+*/
+
+typedef struct filesrc filesrc;
+
+extern int filesrc_open(
+    char const *path,
+    filesrc **src_ptr);
+
+extern sqlite3_int64 filesrc_count(
+    filesrc const *src);
+
+extern sqlite3_int64 filesrc_size(
+    filesrc const *src,
+    sqlite3_int64 entry_no);
+
+extern char const *filesrc_name(
+    filesrc const *src,
+    sqlite3_int64 entry_no);
+
+extern sqlite3_int64 filesrc_find(
+    filesrc const *src,
+    char const *name);
+
+extern int filesrc_map(
+    filesrc *src,
+    sqlite3_int64 entry_no,
+    unsigned char const **data);
+
+extern void filesrc_unmap(
+    filesrc *src,
+    sqlite3_int64 entry_no,
+    unsigned char const *data);
+
+extern void filesrc_close(
+    filesrc *src);
+
+#endif
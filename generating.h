@@ -0,0 +1,14 @@
+static char const create_blobs_sql[] =
+    "begin immediate transaction;\n"
+    "create table main.blobs (\n"
+    "    id integer primary key,\n"
+    "    val blob\n"
+    ");\n";
+
+static char const insert_blob_sql[] =
+    "insert into main.blobs (id, val)\n"
+    "    values (?1, ?2);\n";
+
+static char const commit_sql[] =
+    "commit transaction;\n";
+
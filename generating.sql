@@ -0,0 +1,14 @@
+-- create_blobs_sql
+begin immediate transaction;
+
+create table main.blobs (
+    id integer primary key,
+    val blob
+);
+
+-- insert_blob_sql
+insert into main.blobs (id, val)
+    values (?1, ?2);
+
+-- commit_sql
+commit transaction;
@@ -0,0 +1,488 @@
+#include <pthread.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "iotrace.h"
+
+/*
+  The counters are shared by all threads and guarded by one mutex;
+  a system call per counted operation dwarfs the locking.
+  Phase and file tables are small and fixed, with the last slot
+  collecting whatever doesn't fit.
+*/
+
+#define MAX_PHASES 32
+#define MAX_FILES 64
+
+typedef struct io_counts {
+    sqlite3_int64 reads;
+    sqlite3_int64 read_bytes;
+    sqlite3_int64 seq_reads;
+    sqlite3_int64 writes;
+    sqlite3_int64 write_bytes;
+    sqlite3_int64 seq_writes;
+    sqlite3_int64 syncs;
+} io_counts;
+
+typedef struct trace_file {
+    sqlite3_file base;
+    sqlite3_file *real;
+    int file_no;
+    sqlite3_int64 read_end;
+    sqlite3_int64 write_end;
+} trace_file;
+
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static char const *phase_names[MAX_PHASES]={"startup"};
+static int phase_cnt=1;
+static char *file_names[MAX_FILES];
+static int file_cnt;
+static io_counts counts[MAX_PHASES][MAX_FILES];
+static _Thread_local int current_phase;
+
+static sqlite3_vfs *base_vfs;
+
+void iotrace_phase(
+    char const *name)
+{
+    int phase_no;
+
+    pthread_mutex_lock(&lock);
+    for (phase_no=0; phase_no<phase_cnt; phase_no++) {
+        if (!strcmp(phase_names[phase_no],name))
+            break;
+    }
+    if (phase_no==phase_cnt) {
+        if (phase_cnt<MAX_PHASES) {
+            phase_names[phase_cnt++]=name;
+        } else {
+            phase_no=MAX_PHASES-1;
+            phase_names[phase_no]="other";
+        }
+    }
+    current_phase=phase_no;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+  Files are told apart by their base name; journals are
+  named after their database, so that's enough to read the report.
+*/
+
+static int find_file(
+    char const *path)
+{
+    char const *name;
+    int file_no;
+
+    if (!path) {
+        name="(temporary)";
+    } else {
+        name=strrchr(path,'/');
+        name=name ? name+1 : path;
+    }
+    pthread_mutex_lock(&lock);
+    for (file_no=0; file_no<file_cnt; file_no++) {
+        if (!strcmp(file_names[file_no],name))
+            break;
+    }
+    if (file_no==file_cnt) {
+        if (file_cnt<MAX_FILES-1) {
+            file_names[file_no]=sqlite3_mprintf("%s",name);
+            if (file_names[file_no])
+                file_cnt++;
+        }
+        if (file_no==file_cnt) {
+            file_no=MAX_FILES-1;
+            file_names[file_no]="(other)";
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return file_no;
+}
+
+static int trace_close(
+    sqlite3_file *file)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xClose(f->real);
+}
+
+static int trace_read(
+    sqlite3_file *file,
+    void *data,
+    int amt,
+    sqlite3_int64 offset)
+{
+    trace_file *f=(trace_file *)file;
+    io_counts *c;
+
+    pthread_mutex_lock(&lock);
+    c=&counts[current_phase][f->file_no];
+    c->reads++;
+    c->read_bytes+=amt;
+    if (offset==f->read_end)
+        c->seq_reads++;
+    f->read_end=offset+amt;
+    pthread_mutex_unlock(&lock);
+    return f->real->pMethods->xRead(f->real,data,amt,offset);
+}
+
+static int trace_write(
+    sqlite3_file *file,
+    void const *data,
+    int amt,
+    sqlite3_int64 offset)
+{
+    trace_file *f=(trace_file *)file;
+    io_counts *c;
+
+    pthread_mutex_lock(&lock);
+    c=&counts[current_phase][f->file_no];
+    c->writes++;
+    c->write_bytes+=amt;
+    if (offset==f->write_end)
+        c->seq_writes++;
+    f->write_end=offset+amt;
+    pthread_mutex_unlock(&lock);
+    return f->real->pMethods->xWrite(f->real,data,amt,offset);
+}
+
+static int trace_truncate(
+    sqlite3_file *file,
+    sqlite3_int64 size)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xTruncate(f->real,size);
+}
+
+static int trace_sync(
+    sqlite3_file *file,
+    int flags)
+{
+    trace_file *f=(trace_file *)file;
+
+    pthread_mutex_lock(&lock);
+    counts[current_phase][f->file_no].syncs++;
+    pthread_mutex_unlock(&lock);
+    return f->real->pMethods->xSync(f->real,flags);
+}
+
+static int trace_file_size(
+    sqlite3_file *file,
+    sqlite3_int64 *size)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xFileSize(f->real,size);
+}
+
+static int trace_lock(
+    sqlite3_file *file,
+    int level)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xLock(f->real,level);
+}
+
+static int trace_unlock(
+    sqlite3_file *file,
+    int level)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xUnlock(f->real,level);
+}
+
+static int trace_check_reserved_lock(
+    sqlite3_file *file,
+    int *reserved)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xCheckReservedLock(f->real,reserved);
+}
+
+static int trace_file_control(
+    sqlite3_file *file,
+    int op,
+    void *arg)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xFileControl(f->real,op,arg);
+}
+
+static int trace_sector_size(
+    sqlite3_file *file)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xSectorSize(f->real);
+}
+
+static int trace_device_characteristics(
+    sqlite3_file *file)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xDeviceCharacteristics(f->real);
+}
+
+static int trace_shm_map(
+    sqlite3_file *file,
+    int region,
+    int region_size,
+    int extend,
+    void volatile **mapping)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xShmMap(
+        f->real,region,region_size,extend,mapping);
+}
+
+static int trace_shm_lock(
+    sqlite3_file *file,
+    int offset,
+    int cnt,
+    int flags)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xShmLock(f->real,offset,cnt,flags);
+}
+
+static void trace_shm_barrier(
+    sqlite3_file *file)
+{
+    trace_file *f=(trace_file *)file;
+
+    f->real->pMethods->xShmBarrier(f->real);
+}
+
+static int trace_shm_unmap(
+    sqlite3_file *file,
+    int delete_flag)
+{
+    trace_file *f=(trace_file *)file;
+
+    return f->real->pMethods->xShmUnmap(f->real,delete_flag);
+}
+
+/*
+  Version 2: memory-mapped reads (xFetch) couldn't be counted.
+*/
+
+static sqlite3_io_methods const trace_io_methods = {
+    2,
+    trace_close,
+    trace_read,
+    trace_write,
+    trace_truncate,
+    trace_sync,
+    trace_file_size,
+    trace_lock,
+    trace_unlock,
+    trace_check_reserved_lock,
+    trace_file_control,
+    trace_sector_size,
+    trace_device_characteristics,
+    trace_shm_map,
+    trace_shm_lock,
+    trace_shm_barrier,
+    trace_shm_unmap,
+    NULL,
+    NULL
+};
+
+static int trace_open(
+    sqlite3_vfs *vfs,
+    char const *path,
+    sqlite3_file *file,
+    int flags,
+    int *out_flags)
+{
+    trace_file *f=(trace_file *)file;
+    int status;
+
+    (void)vfs;
+    memset(f,0,sizeof *f);
+    f->real=(sqlite3_file *)(f+1);
+    status=base_vfs->xOpen(base_vfs,path,f->real,flags,out_flags);
+    if (status!=SQLITE_OK)
+        return status;
+    f->file_no=find_file(path);
+    f->read_end=f->write_end=-1;
+    f->base.pMethods=&trace_io_methods;
+    return SQLITE_OK;
+}
+
+static int trace_delete(
+    sqlite3_vfs *vfs,
+    char const *path,
+    int sync_dir)
+{
+    (void)vfs;
+    return base_vfs->xDelete(base_vfs,path,sync_dir);
+}
+
+static int trace_access(
+    sqlite3_vfs *vfs,
+    char const *path,
+    int flags,
+    int *result)
+{
+    (void)vfs;
+    return base_vfs->xAccess(base_vfs,path,flags,result);
+}
+
+static int trace_full_pathname(
+    sqlite3_vfs *vfs,
+    char const *path,
+    int size,
+    char *full_path)
+{
+    (void)vfs;
+    return base_vfs->xFullPathname(base_vfs,path,size,full_path);
+}
+
+static void *trace_dl_open(
+    sqlite3_vfs *vfs,
+    char const *path)
+{
+    (void)vfs;
+    return base_vfs->xDlOpen(base_vfs,path);
+}
+
+static void trace_dl_error(
+    sqlite3_vfs *vfs,
+    int size,
+    char *msg)
+{
+    (void)vfs;
+    base_vfs->xDlError(base_vfs,size,msg);
+}
+
+static void (*trace_dl_sym(
+    sqlite3_vfs *vfs,
+    void *handle,
+    char const *symbol))(void)
+{
+    (void)vfs;
+    return base_vfs->xDlSym(base_vfs,handle,symbol);
+}
+
+static void trace_dl_close(
+    sqlite3_vfs *vfs,
+    void *handle)
+{
+    (void)vfs;
+    base_vfs->xDlClose(base_vfs,handle);
+}
+
+static int trace_randomness(
+    sqlite3_vfs *vfs,
+    int size,
+    char *out)
+{
+    (void)vfs;
+    return base_vfs->xRandomness(base_vfs,size,out);
+}
+
+static int trace_sleep(
+    sqlite3_vfs *vfs,
+    int micros)
+{
+    (void)vfs;
+    return base_vfs->xSleep(base_vfs,micros);
+}
+
+static int trace_current_time(
+    sqlite3_vfs *vfs,
+    double *now)
+{
+    (void)vfs;
+    return base_vfs->xCurrentTime(base_vfs,now);
+}
+
+static int trace_get_last_error(
+    sqlite3_vfs *vfs,
+    int size,
+    char *msg)
+{
+    (void)vfs;
+    return base_vfs->xGetLastError(base_vfs,size,msg);
+}
+
+static int trace_current_time_int64(
+    sqlite3_vfs *vfs,
+    sqlite3_int64 *now)
+{
+    (void)vfs;
+    return base_vfs->xCurrentTimeInt64(base_vfs,now);
+}
+
+static sqlite3_vfs trace_vfs = {
+    2,
+    0,
+    1024,
+    NULL,
+    IOTRACE_NAME,
+    NULL,
+    trace_open,
+    trace_delete,
+    trace_access,
+    trace_full_pathname,
+    trace_dl_open,
+    trace_dl_error,
+    trace_dl_sym,
+    trace_dl_close,
+    trace_randomness,
+    trace_sleep,
+    trace_current_time,
+    trace_get_last_error,
+    trace_current_time_int64,
+    NULL,
+    NULL,
+    NULL
+};
+
+int iotrace_register(
+    char const *base_name)
+{
+    base_vfs=sqlite3_vfs_find(base_name);
+    if (!base_vfs || base_vfs->iVersion<2)
+        return SQLITE_ERROR;
+    trace_vfs.szOsFile=sizeof(trace_file)+base_vfs->szOsFile;
+    trace_vfs.mxPathname=base_vfs->mxPathname;
+    return sqlite3_vfs_register(&trace_vfs,0);
+}
+
+void iotrace_report(
+    FILE *out)
+{
+    int phase_no,file_no;
+
+    pthread_mutex_lock(&lock);
+    fprintf(out,"%-16s %-24s %9s %12s %9s %9s %12s %9s %6s\n",
+            "phase","file","reads","read bytes","seq","writes",
+            "write bytes","seq","syncs");
+    for (phase_no=0; phase_no<MAX_PHASES; phase_no++) {
+        for (file_no=0; file_no<MAX_FILES; file_no++) {
+            io_counts const *c=&counts[phase_no][file_no];
+
+            if (!c->reads && !c->writes && !c->syncs)
+                continue;
+            fprintf(out,"%-16s %-24s %9lld %12lld %9lld %9lld %12lld %9lld %6lld\n",
+                    phase_names[phase_no],file_names[file_no],
+                    c->reads,c->read_bytes,c->seq_reads,
+                    c->writes,c->write_bytes,c->seq_writes,c->syncs);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
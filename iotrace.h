@@ -0,0 +1,30 @@
+#ifndef IOTRACE_H
+#define IOTRACE_H
+
+#include <stdio.h>
+
+/*
+  A pass-through VFS that counts the I/O SQLite asks for.
+
+  iotrace_register layers IOTRACE_NAME over the named VFS
+  (NULL for the default one); open connections with IOTRACE_NAME
+  to have their files traced, attached databases included.
+
+  Reads, writes, their bytes, how many of them continue where the
+  previous one of the same kind on the same file ended, and syncs
+  are counted per file and per phase.  iotrace_phase starts a phase
+  for the calling thread; phases with the same name are added up.
+*/
+
+#define IOTRACE_NAME "iotrace"
+
+extern int iotrace_register(
+    char const *base_name);
+
+extern void iotrace_phase(
+    char const *name);
+
+extern void iotrace_report(
+    FILE *out);
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+/*
+  Generate a synthetic source database for blobpack,
+  as a workload for benchmarks and profile-guided builds.
+
+  The blob sizes are a mix meant to exercise all of the planner:
+  mostly small blobs that share pages, blobs around a page in size
+  that need splitting, a few large ones with overflow chains,
+  some NULLs and some exact duplicates of earlier blobs.
+  Everything follows from the seed, so a given count and seed
+  always give the same database.
+*/
+
+typedef struct globals {
+    sqlite3_int64 blob_cnt;
+    uint64_t seed;
+
+    char const *dst_path;
+} globals;
+
+static globals const default_globals =
+{
+    50000,
+    1,
+
+    NULL
+};
+
+#include "generating.h"
+
+static char const oom_msg[] =
+    "Out of memory or something\n";
+
+/*
+  splitmix64; good enough for test data and the same everywhere.
+*/
+
+static uint64_t next_random(
+    uint64_t *state)
+{
+    uint64_t z;
+
+    z=*state+=UINT64_C(0x9e3779b97f4a7c15);
+    z=(z ^ z>>30)*UINT64_C(0xbf58476d1ce4e5b9);
+    z=(z ^ z>>27)*UINT64_C(0x94d049bb133111eb);
+    return z ^ z>>31;
+}
+
+#define MAX_BLOB_SIZE (256<<10)
+
+/*
+  The size and contents of a blob both follow from its own seed,
+  so a duplicate only has to reuse an earlier blob's seed.
+  Returns -1 for a NULL blob.
+*/
+
+static int make_blob(
+    uint64_t blob_seed,
+    unsigned char *buf)
+{
+    uint64_t state;
+    unsigned int kind;
+    int size;
+    int i;
+
+    state=blob_seed;
+    kind=next_random(&state)%1000;
+    if (kind<30)
+        return -1;
+    if (kind<650) {
+        size=next_random(&state)%400;
+    } else if (kind<950) {
+        size=400+next_random(&state)%7800;
+    } else if (kind<995) {
+        size=8200+next_random(&state)%(32<<10);
+    } else {
+        size=(40<<10)+next_random(&state)%(MAX_BLOB_SIZE-(40<<10));
+    }
+    for (i=0; i<size; i+=8) {
+        uint64_t word;
+
+        word=next_random(&state);
+        memcpy(buf+i,&word,size-i<8 ? size-i : 8);
+    }
+    return size;
+}
+
+static int generate(
+    globals *g)
+{
+    sqlite3 *db=NULL;
+    sqlite3_stmt *insert=NULL;
+    unsigned char *buf;
+    uint64_t state;
+    uint64_t *seeds;
+    char *errmsg;
+    sqlite3_int64 id;
+    int status;
+
+    if (!access(g->dst_path,F_OK)) {
+        fprintf(stderr,"%s: Already exists\n",g->dst_path);
+        return -1;
+    }
+    buf=malloc(MAX_BLOB_SIZE);
+    /* ring of recent seeds to draw duplicates from */
+    seeds=malloc(1024*sizeof *seeds);
+    if (!buf || !seeds) {
+        fputs(oom_msg,stderr);
+        return -1;
+    }
+    status=sqlite3_open(g->dst_path,&db);
+    if (status!=SQLITE_OK) {
+        if (db) {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    g->dst_path,sqlite3_errmsg(db));
+        } else {
+            fprintf(stderr,"%s: sqlite3_open: %s\n",
+                    g->dst_path,sqlite3_errstr(status));
+        }
+        return -1;
+    }
+    status=sqlite3_exec(db,create_blobs_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to create blobs: %s\n",sqlite3_errmsg(db));
+        return -1;
+    }
+    status=sqlite3_prepare_v2(
+        db,insert_blob_sql,sizeof insert_blob_sql,&insert,NULL);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_prepare(insert_blob): %s\n",
+                sqlite3_errmsg(db));
+        return -1;
+    }
+
+    state=g->seed;
+    for (id=1; id<=g->blob_cnt; id++) {
+        uint64_t blob_seed;
+        int size;
+
+        blob_seed=next_random(&state);
+        if (id>1024 && blob_seed%50==0) {
+            blob_seed=seeds[blob_seed>>32 & 1023];
+        } else {
+            seeds[id & 1023]=blob_seed;
+        }
+        size=make_blob(blob_seed,buf);
+        sqlite3_bind_int64(insert,1,id);
+        if (size<0) {
+            sqlite3_bind_null(insert,2);
+        } else {
+            sqlite3_bind_blob(insert,2,buf,size,SQLITE_STATIC);
+        }
+        status=sqlite3_step(insert);
+        if (status!=SQLITE_DONE) {
+            fprintf(stderr,"sqlite3_step(insert_blob): %s\n",
+                    sqlite3_errmsg(db));
+            return -1;
+        }
+        sqlite3_reset(insert);
+    }
+    sqlite3_finalize(insert);
+
+    status=sqlite3_exec(db,commit_sql,0,NULL,&errmsg);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"Failed to commit transaction: %s\n",
+                sqlite3_errmsg(db));
+        return -1;
+    }
+    status=sqlite3_close(db);
+    if (status!=SQLITE_OK) {
+        fprintf(stderr,"sqlite3_close: %s\n",sqlite3_errmsg(db));
+        return -1;
+    }
+    free(seeds);
+    free(buf);
+    return 0;
+}
+
+static int parse_args(
+    globals *g,
+    int argc,
+    char **argv)
+{
+    int argi;
+    char const *arg;
+
+    for (argi=1; argi<argc; ) {
+        long long val;
+        unsigned long long seed;
+
+        arg=argv[argi];
+        if (arg[0]!='-')
+            break;
+        argi++;
+        if (!strcmp(arg,"--"))
+            break;
+        if (!strcmp(arg,"--count")) {
+            if (argi>=argc)
+                goto missing;
+            if (sscanf(argv[argi],"%lld",&val)!=1 || val<0) {
+                fprintf(stderr,"Invalid count %s\n",argv[argi]);
+                return -1;
+            }
+            g->blob_cnt=val;
+            argi++;
+        } else if (!strcmp(arg,"--seed")) {
+            if (argi>=argc)
+                goto missing;
+            if (sscanf(argv[argi],"%llu",&seed)!=1) {
+                fprintf(stderr,"Invalid seed %s\n",argv[argi]);
+                return -1;
+            }
+            g->seed=seed;
+            argi++;
+        } else {
+            fprintf(stderr,"Unknown option %s\n",arg);
+            goto usage;
+        }
+    }
+    if (argc-argi!=1)
+        goto usage;
+    g->dst_path=argv[argi];
+    return 0;
+
+missing:
+    fprintf(stderr,"Missing value for option %s\n",arg);
+    return -1;
+
+usage:
+    {
+        char *progname;
+
+        progname=strrchr(argv[0],'/');
+        if (progname) {
+            progname++;
+        } else {
+            progname=argv[0];
+        }
+        fprintf(stderr,"Usage: %s [ options ] dst-path\n",progname);
+    }
+    fputs("    Options:\n"
+          "        --count             number\n"
+          "        --seed              number\n",
+          stderr);
+    return -1;
+}
+
+int main(
+    int argc,
+    char **argv)
+{
+    globals g=default_globals;
+
+    if (parse_args(&g,argc,argv))
+        return 11;
+    if (generate(&g))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "outvfs.h"
+
+/*
+  Pending writes are flushed before anything that could observe
+  the file: reads of the pending range, size queries, truncation,
+  syncing, unlocking, file controls and closing.  Since they are only
+  ever delayed, never reordered with respect to a sync, the journal
+  still reaches the disk before the database pages it protects.
+
+  The coalescing buffer and the extra descriptor are only set up on
+  first use, so read-only files such as an attached source cost
+  nothing extra.
+*/
+
+#define COALESCE_SIZE (4<<20)
+
+typedef struct out_file {
+    sqlite3_file base;
+    sqlite3_file *real;
+    char const *path;
+    int main_db;
+    int fd;
+    unsigned char *buf;
+    sqlite3_int64 buf_offset;
+    int buf_len;
+} out_file;
+
+static sqlite3_vfs *base_vfs;
+
+/*
+  The unix VFS takes at most 128 KiB per write, so pending writes go
+  straight to a descriptor of our own.  It refers to the same file,
+  so the page cache keeps both views consistent.  Closing it would
+  drop the process's POSIX locks on the file, so it stays open
+  until the file is closed.
+*/
+
+static int own_fd(
+    out_file *f)
+{
+    if (f->fd<0 && f->path)
+        f->fd=open(f->path,O_RDWR | O_CLOEXEC);
+    return f->fd;
+}
+
+static int flush_writes(
+    out_file *f)
+{
+    unsigned char const *p;
+    sqlite3_int64 offset;
+    int len;
+
+    if (f->buf_len==0)
+        return SQLITE_OK;
+    p=f->buf;
+    offset=f->buf_offset;
+    len=f->buf_len;
+    f->buf_len=0;
+    if (own_fd(f)<0) {
+        while (len>0) {
+            int amt,status;
+
+            amt=len<65536 ? len : 65536;
+            status=f->real->pMethods->xWrite(f->real,p,amt,offset);
+            if (status!=SQLITE_OK)
+                return status;
+            p+=amt;
+            offset+=amt;
+            len-=amt;
+        }
+        return SQLITE_OK;
+    }
+    while (len>0) {
+        ssize_t wrote;
+
+        wrote=pwrite(f->fd,p,len,offset);
+        if (wrote<0 && errno==EINTR)
+            continue;
+        if (wrote<=0)
+            return wrote<0 && errno!=ENOSPC ? SQLITE_IOERR_WRITE : SQLITE_FULL;
+        p+=wrote;
+        offset+=wrote;
+        len-=wrote;
+    }
+    return SQLITE_OK;
+}
+
+static int out_close(
+    sqlite3_file *file)
+{
+    out_file *f=(out_file *)file;
+    int status,close_status;
+
+    status=flush_writes(f);
+    close_status=f->real->pMethods->xClose(f->real);
+    if (f->fd>=0)
+        close(f->fd);
+    sqlite3_free(f->buf);
+    f->buf=NULL;
+    return status!=SQLITE_OK ? status : close_status;
+}
+
+static int out_read(
+    sqlite3_file *file,
+    void *data,
+    int amt,
+    sqlite3_int64 offset)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    if (f->buf_len>0
+            && offset<f->buf_offset+f->buf_len
+            && offset+amt>f->buf_offset) {
+        status=flush_writes(f);
+        if (status!=SQLITE_OK)
+            return status;
+    }
+    return f->real->pMethods->xRead(f->real,data,amt,offset);
+}
+
+static int out_write(
+    sqlite3_file *file,
+    void const *data,
+    int amt,
+    sqlite3_int64 offset)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    if (!f->main_db || amt>=COALESCE_SIZE) {
+        /* an overlapping pending write must not land after this one */
+        status=flush_writes(f);
+        if (status!=SQLITE_OK)
+            return status;
+        return f->real->pMethods->xWrite(f->real,data,amt,offset);
+    }
+    if (f->buf_len>0
+            && (offset!=f->buf_offset+f->buf_len
+                || f->buf_len+amt>COALESCE_SIZE)) {
+        status=flush_writes(f);
+        if (status!=SQLITE_OK)
+            return status;
+    }
+    if (!f->buf) {
+        f->buf=sqlite3_malloc(COALESCE_SIZE);
+        if (!f->buf) {
+            f->main_db=0;
+            return f->real->pMethods->xWrite(f->real,data,amt,offset);
+        }
+    }
+    if (f->buf_len==0)
+        f->buf_offset=offset;
+    memcpy(f->buf+f->buf_len,data,amt);
+    f->buf_len+=amt;
+    return SQLITE_OK;
+}
+
+static int out_truncate(
+    sqlite3_file *file,
+    sqlite3_int64 size)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    status=flush_writes(f);
+    if (status!=SQLITE_OK)
+        return status;
+    return f->real->pMethods->xTruncate(f->real,size);
+}
+
+static int out_sync(
+    sqlite3_file *file,
+    int flags)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    status=flush_writes(f);
+    if (status!=SQLITE_OK)
+        return status;
+    return f->real->pMethods->xSync(f->real,flags);
+}
+
+static int out_file_size(
+    sqlite3_file *file,
+    sqlite3_int64 *size)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    status=flush_writes(f);
+    if (status!=SQLITE_OK)
+        return status;
+    return f->real->pMethods->xFileSize(f->real,size);
+}
+
+static int out_lock(
+    sqlite3_file *file,
+    int lock)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xLock(f->real,lock);
+}
+
+static int out_unlock(
+    sqlite3_file *file,
+    int lock)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    status=flush_writes(f);
+    if (status!=SQLITE_OK)
+        return status;
+    return f->real->pMethods->xUnlock(f->real,lock);
+}
+
+static int out_check_reserved_lock(
+    sqlite3_file *file,
+    int *reserved)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xCheckReservedLock(f->real,reserved);
+}
+
+/*
+  Reserve the hinted size with FALLOC_FL_KEEP_SIZE, so the blocks are
+  allocated in one go but the file doesn't grow past its real content.
+  Failure, e.g. on a file system without fallocate, is harmless.
+*/
+
+static void reserve_space(
+    out_file *f,
+    sqlite3_int64 size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (f->main_db && own_fd(f)>=0)
+        fallocate(f->fd,FALLOC_FL_KEEP_SIZE,0,size);
+#else
+    (void)f;
+    (void)size;
+#endif
+}
+
+static int out_file_control(
+    sqlite3_file *file,
+    int op,
+    void *arg)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    if (op==SQLITE_FCNTL_SIZE_HINT) {
+        reserve_space(f,*(sqlite3_int64 *)arg);
+    } else {
+        status=flush_writes(f);
+        if (status!=SQLITE_OK)
+            return status;
+    }
+    return f->real->pMethods->xFileControl(f->real,op,arg);
+}
+
+static int out_sector_size(
+    sqlite3_file *file)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xSectorSize(f->real);
+}
+
+static int out_device_characteristics(
+    sqlite3_file *file)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xDeviceCharacteristics(f->real);
+}
+
+static int out_shm_map(
+    sqlite3_file *file,
+    int region,
+    int region_size,
+    int extend,
+    void volatile **mapping)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xShmMap(
+        f->real,region,region_size,extend,mapping);
+}
+
+static int out_shm_lock(
+    sqlite3_file *file,
+    int offset,
+    int cnt,
+    int flags)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xShmLock(f->real,offset,cnt,flags);
+}
+
+static void out_shm_barrier(
+    sqlite3_file *file)
+{
+    out_file *f=(out_file *)file;
+
+    f->real->pMethods->xShmBarrier(f->real);
+}
+
+static int out_shm_unmap(
+    sqlite3_file *file,
+    int delete_flag)
+{
+    out_file *f=(out_file *)file;
+
+    return f->real->pMethods->xShmUnmap(f->real,delete_flag);
+}
+
+/*
+  Version 2: memory-mapped reads (xFetch) would bypass pending writes.
+*/
+
+static sqlite3_io_methods const out_io_methods = {
+    2,
+    out_close,
+    out_read,
+    out_write,
+    out_truncate,
+    out_sync,
+    out_file_size,
+    out_lock,
+    out_unlock,
+    out_check_reserved_lock,
+    out_file_control,
+    out_sector_size,
+    out_device_characteristics,
+    out_shm_map,
+    out_shm_lock,
+    out_shm_barrier,
+    out_shm_unmap,
+    NULL,
+    NULL
+};
+
+static int out_open(
+    sqlite3_vfs *vfs,
+    char const *path,
+    sqlite3_file *file,
+    int flags,
+    int *out_flags)
+{
+    out_file *f=(out_file *)file;
+    int status;
+
+    (void)vfs;
+    memset(f,0,sizeof *f);
+    f->real=(sqlite3_file *)(f+1);
+    f->fd=-1;
+    status=base_vfs->xOpen(base_vfs,path,f->real,flags,out_flags);
+    if (status!=SQLITE_OK)
+        return status;
+    f->path=path;
+    f->main_db=(flags & SQLITE_OPEN_MAIN_DB) && (flags & SQLITE_OPEN_READWRITE);
+    f->base.pMethods=&out_io_methods;
+    return SQLITE_OK;
+}
+
+static int out_delete(
+    sqlite3_vfs *vfs,
+    char const *path,
+    int sync_dir)
+{
+    (void)vfs;
+    return base_vfs->xDelete(base_vfs,path,sync_dir);
+}
+
+static int out_access(
+    sqlite3_vfs *vfs,
+    char const *path,
+    int flags,
+    int *result)
+{
+    (void)vfs;
+    return base_vfs->xAccess(base_vfs,path,flags,result);
+}
+
+static int out_full_pathname(
+    sqlite3_vfs *vfs,
+    char const *path,
+    int size,
+    char *full_path)
+{
+    (void)vfs;
+    return base_vfs->xFullPathname(base_vfs,path,size,full_path);
+}
+
+static void *out_dl_open(
+    sqlite3_vfs *vfs,
+    char const *path)
+{
+    (void)vfs;
+    return base_vfs->xDlOpen(base_vfs,path);
+}
+
+static void out_dl_error(
+    sqlite3_vfs *vfs,
+    int size,
+    char *msg)
+{
+    (void)vfs;
+    base_vfs->xDlError(base_vfs,size,msg);
+}
+
+static void (*out_dl_sym(
+    sqlite3_vfs *vfs,
+    void *handle,
+    char const *symbol))(void)
+{
+    (void)vfs;
+    return base_vfs->xDlSym(base_vfs,handle,symbol);
+}
+
+static void out_dl_close(
+    sqlite3_vfs *vfs,
+    void *handle)
+{
+    (void)vfs;
+    base_vfs->xDlClose(base_vfs,handle);
+}
+
+static int out_randomness(
+    sqlite3_vfs *vfs,
+    int size,
+    char *out)
+{
+    (void)vfs;
+    return base_vfs->xRandomness(base_vfs,size,out);
+}
+
+static int out_sleep(
+    sqlite3_vfs *vfs,
+    int micros)
+{
+    (void)vfs;
+    return base_vfs->xSleep(base_vfs,micros);
+}
+
+static int out_current_time(
+    sqlite3_vfs *vfs,
+    double *now)
+{
+    (void)vfs;
+    return base_vfs->xCurrentTime(base_vfs,now);
+}
+
+static int out_get_last_error(
+    sqlite3_vfs *vfs,
+    int size,
+    char *msg)
+{
+    (void)vfs;
+    return base_vfs->xGetLastError(base_vfs,size,msg);
+}
+
+static int out_current_time_int64(
+    sqlite3_vfs *vfs,
+    sqlite3_int64 *now)
+{
+    (void)vfs;
+    return base_vfs->xCurrentTimeInt64(base_vfs,now);
+}
+
+static sqlite3_vfs out_vfs = {
+    2,
+    0,
+    1024,
+    NULL,
+    OUTVFS_NAME,
+    NULL,
+    out_open,
+    out_delete,
+    out_access,
+    out_full_pathname,
+    out_dl_open,
+    out_dl_error,
+    out_dl_sym,
+    out_dl_close,
+    out_randomness,
+    out_sleep,
+    out_current_time,
+    out_get_last_error,
+    out_current_time_int64,
+    NULL,
+    NULL,
+    NULL
+};
+
+int outvfs_register(void)
+{
+    base_vfs=sqlite3_vfs_find(NULL);
+    if (!base_vfs || base_vfs->iVersion<2)
+        return SQLITE_ERROR;
+    out_vfs.szOsFile=sizeof(out_file)+base_vfs->szOsFile;
+    out_vfs.mxPathname=base_vfs->mxPathname;
+    return sqlite3_vfs_register(&out_vfs,0);
+}
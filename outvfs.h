@@ -0,0 +1,19 @@
+#ifndef OUTVFS_H
+#define OUTVFS_H
+
+/*
+  A VFS shim for writing output databases, layered over the default VFS.
+
+  Writes to main database files are collected while they are adjacent
+  and passed on as one large write.  Size hints reserve disk space
+  ahead of the writes without changing the file size.
+
+  outvfs_register must be called once before opening a connection
+  with OUTVFS_NAME; it doesn't make the shim the default.
+*/
+
+#define OUTVFS_NAME "blobpack-out"
+
+extern int outvfs_register(void);
+
+#endif
@@ -0,0 +1,274 @@
+static char const get_page_size_sql[] =
+    "pragma main.page_size;\n";
+
+static char const set_page_size_fmt[] =
+    "pragma page_size=%u;\n";
+
+static char const no_journal_sql[] =
+    "pragma main.journal_mode=off;\n";
+
+static char const begin_sql[] =
+    "begin immediate transaction;\n";
+
+static char const begin_read_sql[] =
+    "begin deferred transaction;\n";
+
+static char const list_blobs_sql[] =
+    "select id, length(val)\n"
+    "    from main.blobs\n"
+    "    where id between ?1 and ?2\n"
+    "    order by id;\n";
+
+static char const source_layout_sql[] =
+    "select exists (select 1 from main.sqlite_schema\n"
+    "                   where type='table' and name='blobs'),\n"
+    "       exists (select 1 from pragma_table_info('splits', 'main')\n"
+    "                   where name='head'),\n"
+    "       exists (select 1 from pragma_table_info('splits', 'main')\n"
+    "                   where name='frag'),\n"
+    "       exists (select 1 from pragma_table_info('splits', 'main')\n"
+    "                   where name='offset'),\n"
+    "       exists (select 1 from main.sqlite_schema\n"
+    "                   where type='table' and name='names'),\n"
+    "       exists (select 1 from main.sqlite_schema\n"
+    "                   where type='table' and name='shards');\n";
+
+static char const list_packed_fmt[] =
+    "select s.id,\n"
+    "       case\n"
+    "           when s.head is null then null\n"
+    "           else coalesce(s.size, length(h.val)+coalesce(length(t.val), 0))\n"
+    "       end\n"
+    "    from (select id, head, tail, %s as size\n"
+    "              from main.splits) as s\n"
+    "        left join main.frags as h on h.id=s.head\n"
+    "        left join main.frags as t on t.id=s.tail\n"
+    "    where s.id between ?1 and ?2\n"
+    "    order by s.id;\n";
+
+static char const list_packed_implicit_fmt[] =
+    "select s.id,\n"
+    "       case\n"
+    "           when s.head is null then null\n"
+    "           else coalesce(s.size, length(h.val)+coalesce(length(t.val), 0))\n"
+    "       end\n"
+    "    from (select id,\n"
+    "                 case frag&3\n"
+    "                     when 2 then (frag>>2)+1\n"
+    "                     else frag>>2\n"
+    "                 end as head,\n"
+    "                 case frag&3\n"
+    "                     when 0 then null\n"
+    "                     when 1 then (frag>>2)+1\n"
+    "                     when 2 then frag>>2\n"
+    "                     else tail\n"
+    "                 end as tail,\n"
+    "                 %s as size\n"
+    "              from main.splits) as s\n"
+    "        left join main.frags as h on h.id=s.head\n"
+    "        left join main.frags as t on t.id=s.tail\n"
+    "    where s.id between ?1 and ?2\n"
+    "    order by s.id;\n";
+
+static char const find_packed_fmt[] =
+    "select head, tail, %s\n"
+    "    from main.splits\n"
+    "    where id=?1;\n";
+
+static char const find_packed_implicit_fmt[] =
+    "select case frag&3\n"
+    "           when 2 then (frag>>2)+1\n"
+    "           else frag>>2\n"
+    "       end,\n"
+    "       case frag&3\n"
+    "           when 0 then null\n"
+    "           when 1 then (frag>>2)+1\n"
+    "           when 2 then frag>>2\n"
+    "           else tail\n"
+    "       end,\n"
+    "       %s\n"
+    "    from main.splits\n"
+    "    where id=?1;\n";
+
+static char const slice_size_column_sql[] =
+    "size\n";
+
+static char const slice_offset_column_sql[] =
+    "offset\n";
+
+static char const no_slice_column_sql[] =
+    "null\n";
+
+static char const find_source_name_sql[] =
+    "select name from main.names\n"
+    "    where id=?1;\n";
+
+static char const create_output_sql[] =
+    "create table main.splits (\n"
+    "    id integer primary key,\n"
+    "    head integer,\n"
+    "    tail integer,\n"
+    "    crc integer\n"
+    ");\n"
+    "create table main.frags (\n"
+    "    id integer primary key,\n"
+    "    val blob not null\n"
+    ");\n";
+
+static char const create_implicit_output_sql[] =
+    "create table main.splits (\n"
+    "    id integer primary key,\n"
+    "    frag integer,\n"
+    "    crc integer,\n"
+    "    tail integer\n"
+    ");\n"
+    "create table main.frags (\n"
+    "    id integer primary key,\n"
+    "    val blob not null\n"
+    ");\n";
+
+static char const add_slice_columns_sql[] =
+    "alter table main.splits add column offset integer;\n"
+    "alter table main.splits add column size integer;\n";
+
+static char const create_names_sql[] =
+    "create table if not exists main.names (\n"
+    "    id integer primary key,\n"
+    "    name text not null\n"
+    ");\n";
+
+static char const previous_layout_sql[] =
+    "select exists (select 1 from pragma_table_info('splits', 'main')\n"
+    "                   where name='frag'),\n"
+    "       (select coalesce(max(id), 0) from main.frags),\n"
+    "       exists (select 1 from pragma_table_info('splits', 'main')\n"
+    "                   where name='offset');\n";
+
+static char const list_previous_sql[] =
+    "select s.id, s.head, s.tail, s.crc,\n"
+    "       (select length(val) from main.frags where frags.id=s.head),\n"
+    "       (select length(val) from main.frags where frags.id=s.tail)\n"
+    "    from main.splits as s\n"
+    "    order by s.id;\n";
+
+static char const list_previous_names_sql[] =
+    "select id, name from main.names\n"
+    "    where id between ?1 and ?2;\n";
+
+static char const previous_max_id_sql[] =
+    "select coalesce(max(id), ?1-1) from main.splits\n"
+    "    where id between ?1 and ?2;\n";
+
+static char const list_previous_implicit_sql[] =
+    "select s.id, s.head, s.tail, s.crc,\n"
+    "       (select length(val) from main.frags where frags.id=s.head),\n"
+    "       (select length(val) from main.frags where frags.id=s.tail)\n"
+    "    from (select id,\n"
+    "                 case frag&3\n"
+    "                     when 2 then (frag>>2)+1\n"
+    "                     else frag>>2\n"
+    "                 end as head,\n"
+    "                 case frag&3\n"
+    "                     when 0 then null\n"
+    "                     when 1 then (frag>>2)+1\n"
+    "                     when 2 then frag>>2\n"
+    "                     else tail\n"
+    "                 end as tail,\n"
+    "                 crc\n"
+    "              from main.splits) as s\n"
+    "    order by s.id;\n";
+
+static char const find_output_sql[] =
+    "select count(*) from main.sqlite_schema\n"
+    "    where type='table' and name='frags';\n";
+
+static char const resume_point_sql[] =
+    "select (select coalesce(max(id), 0) from main.frags),\n"
+    "       exists (select 1 from main.splits);\n";
+
+static char const list_written_frags_sql[] =
+    "select id, val from main.frags\n"
+    "    where id<=?1\n"
+    "    order by id;\n";
+
+static char const insert_frag_sql[] =
+    "insert into main.frags (id, val)\n"
+    "    values (?1, ?2);\n";
+
+static char const insert_split_sql[] =
+    "insert into main.splits (id, head, tail, crc)\n"
+    "    values (?1, ?2, ?3, ?4);\n";
+
+static char const insert_implicit_split_sql[] =
+    "insert into main.splits (id, frag, crc, tail)\n"
+    "    values (?1, ?2, ?3, ?4);\n";
+
+static char const insert_sliced_split_sql[] =
+    "insert into main.splits (id, head, tail, crc, offset, size)\n"
+    "    values (?1, ?2, ?3, ?4, ?5, ?6);\n";
+
+static char const insert_sliced_implicit_split_sql[] =
+    "insert into main.splits (id, frag, crc, tail, offset, size)\n"
+    "    values (?1, ?2, ?3, ?4, ?5, ?6);\n";
+
+static char const insert_name_sql[] =
+    "insert into main.names (id, name)\n"
+    "    values (?1, ?2);\n";
+
+static char const upsert_split_sql[] =
+    "insert into main.splits (id, head, tail, crc)\n"
+    "    values (?1, ?2, ?3, ?4)\n"
+    "    on conflict (id) do update\n"
+    "        set head=excluded.head, tail=excluded.tail, crc=excluded.crc\n"
+    "        where head is not excluded.head\n"
+    "            or tail is not excluded.tail\n"
+    "            or crc is not excluded.crc;\n";
+
+static char const upsert_implicit_split_sql[] =
+    "insert into main.splits (id, frag, crc, tail)\n"
+    "    values (?1, ?2, ?3, ?4)\n"
+    "    on conflict (id) do update\n"
+    "        set frag=excluded.frag, crc=excluded.crc, tail=excluded.tail\n"
+    "        where frag is not excluded.frag\n"
+    "            or crc is not excluded.crc\n"
+    "            or tail is not excluded.tail;\n";
+
+static char const upsert_name_sql[] =
+    "insert into main.names (id, name)\n"
+    "    values (?1, ?2)\n"
+    "    on conflict (id) do update\n"
+    "        set name=excluded.name\n"
+    "        where name is not excluded.name;\n";
+
+static char const delete_frag_sql[] =
+    "delete from main.frags\n"
+    "    where id=?1;\n";
+
+static char const delete_split_sql[] =
+    "delete from main.splits\n"
+    "    where id=?1;\n";
+
+static char const find_names_sql[] =
+    "select count(*) from main.sqlite_schema\n"
+    "    where type='table' and name='names';\n";
+
+static char const delete_stale_names_sql[] =
+    "delete from main.names\n"
+    "    where id not in (select id from main.splits);\n";
+
+static char const commit_sql[] =
+    "commit transaction;\n";
+
+static char const create_manifest_sql[] =
+    "begin immediate transaction;\n"
+    "create table main.shards (\n"
+    "    id integer primary key,\n"
+    "    path text not null,\n"
+    "    lo integer not null,\n"
+    "    hi integer not null\n"
+    ");\n";
+
+static char const insert_shard_sql[] =
+    "insert into main.shards (id, path, lo, hi)\n"
+    "    values (?1, ?2, ?3, ?4);\n";
+
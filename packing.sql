@@ -1,206 +1,277 @@
--- attach_sql
-attach database ?1 as source;
-
 -- get_page_size_sql
-pragma source.page_size;
+pragma main.page_size;
 
 -- set_page_size_fmt
 pragma page_size=%u;
 
+-- no_journal_sql
+pragma main.journal_mode=off;
+
 -- begin_sql
 begin immediate transaction;
 
--- create_temps_sql
-create table temp.split (
-    split_id integer primary key
-);
-
-create table temp.frag (
-    frag_id integer primary key,
-    "offset" integer not null,
-    size integer not null,
-    cell_size integer not null,
-    split_id integer not null,
-    page_id integer,
-    final_id integer unique
-);
-
-create index temp.frag_size
-    on frag (cell_size);
-
-create index temp.frag_split
-    on frag (split_id);
-
-create index temp.frag_page
-    on frag (page_id);
+-- begin_read_sql
+begin deferred transaction;
 
 -- list_blobs_sql
 select id, length(val)
-    from source.blobs
+    from main.blobs
+    where id between ?1 and ?2
     order by id;
 
--- insert_temp_split_sql
-insert into temp.split (split_id)
-    values (?1);
-
--- insert_temp_frag_sql
-insert into temp.frag (frag_id, "offset", size, cell_size, split_id)
-    values (?1, ?2, ?3, ?4, ?5);
-
--- create_temp_page_sql
-create table temp.page (
-    page_id integer primary key,
-    free_space integer
-);
-
-create index temp.page_space
-    on page (free_space)
-    where free_space is not null;
-
--- min_size_sql
-select min(cell_size) from temp.frag;
-
--- list_frags_sql
-select frag_id, cell_size from temp.frag
-    order by cell_size desc;
-
--- find_page_sql
-select page_id, free_space from temp.page
-    where free_space is not null and free_space>=?1
-    order by free_space
-    limit 1;
-
--- insert_page_sql
-insert into temp.page (page_id, free_space)
-    values (?1, ?2);
-
--- update_page_sql
-update temp.page
-    set free_space=?2
-    where page_id=?1;
-
--- assign_page_sql
-update temp.frag
-    set page_id=?2
-    where frag_id=?1;
-
--- unsplit_sql
-create table temp.unsplit (
-    split_id integer primary key
-);
-
-insert into temp.unsplit
-    select split_id from temp.frag
-        group by split_id, page_id
-        having count(*)>=2
-    union all select split_id from
-        (select min(split_id) as split_id from temp.frag
-             group by page_id
-             having count(*)=1)
-        group by split_id
-        having count(*)>=2;
-
-update temp.frag as f1
-    set size=(select sum(f2.size) from temp.frag f2
-                  where f2.split_id=f1.split_id)
-    where split_id in temp.unsplit
-        and "offset"=0;
-
-delete from temp.frag
-    where split_id in temp.unsplit
-        and "offset">0;
-
-drop table temp.unsplit;
-
--- create_order_sql
-create table temp.split_order (
-    split_seq integer primary key,
-    split_id integer not null unique
+-- source_layout_sql
+select exists (select 1 from main.sqlite_schema
+                   where type='table' and name='blobs'),
+       exists (select 1 from pragma_table_info('splits', 'main')
+                   where name='head'),
+       exists (select 1 from pragma_table_info('splits', 'main')
+                   where name='frag'),
+       exists (select 1 from pragma_table_info('splits', 'main')
+                   where name='offset'),
+       exists (select 1 from main.sqlite_schema
+                   where type='table' and name='names'),
+       exists (select 1 from main.sqlite_schema
+                   where type='table' and name='shards');
+
+-- list_packed_fmt
+select s.id,
+       case
+           when s.head is null then null
+           else coalesce(s.size, length(h.val)+coalesce(length(t.val), 0))
+       end
+    from (select id, head, tail, %s as size
+              from main.splits) as s
+        left join main.frags as h on h.id=s.head
+        left join main.frags as t on t.id=s.tail
+    where s.id between ?1 and ?2
+    order by s.id;
+
+-- list_packed_implicit_fmt
+select s.id,
+       case
+           when s.head is null then null
+           else coalesce(s.size, length(h.val)+coalesce(length(t.val), 0))
+       end
+    from (select id,
+                 case frag&3
+                     when 2 then (frag>>2)+1
+                     else frag>>2
+                 end as head,
+                 case frag&3
+                     when 0 then null
+                     when 1 then (frag>>2)+1
+                     when 2 then frag>>2
+                     else tail
+                 end as tail,
+                 %s as size
+              from main.splits) as s
+        left join main.frags as h on h.id=s.head
+        left join main.frags as t on t.id=s.tail
+    where s.id between ?1 and ?2
+    order by s.id;
+
+-- find_packed_fmt
+select head, tail, %s
+    from main.splits
+    where id=?1;
+
+-- find_packed_implicit_fmt
+select case frag&3
+           when 2 then (frag>>2)+1
+           else frag>>2
+       end,
+       case frag&3
+           when 0 then null
+           when 1 then (frag>>2)+1
+           when 2 then frag>>2
+           else tail
+       end,
+       %s
+    from main.splits
+    where id=?1;
+
+-- slice_size_column_sql
+size
+
+-- slice_offset_column_sql
+offset
+
+-- no_slice_column_sql
+null
+
+-- find_source_name_sql
+select name from main.names
+    where id=?1;
+
+-- create_output_sql
+create table main.splits (
+    id integer primary key,
+    head integer,
+    tail integer,
+    crc integer
 );
 
-create table temp.page_order (
-    page_seq integer primary key,
-    page_id integer not null unique
+create table main.frags (
+    id integer primary key,
+    val blob not null
 );
 
--- one_split_sql
-insert into temp.split_order (split_id)
-    select split_id from temp.split
-        where split_id>=?1
-            and split_id not in (select split_id from temp.split_order)
-        order by split_id
-        limit 1
-    returning split_id;
-
--- more_pages_sql
-insert or ignore into temp.page_order (page_id)
-    select page_id
-        from temp.split_order
-            natural cross join temp.frag
-        where split_seq>?1;
-
--- more_splits_sql
-insert or ignore into temp.split_order (split_id)
-    select split_id
-        from temp.page_order
-            natural cross join temp.frag
-        where page_seq>=?1;
-
--- order_frags_sql
-drop table temp.split_order;
-
-with
-    frag_order (frag_id, final_id) as
-        (select frag_id, row_number() over (order by page_seq, frag_id)
-             from temp.frag
-                  natural join temp.page
-                  natural join temp.page_order)
-update temp.frag as f
-    set final_id=frag_order.final_id
-    from frag_order
-    where f.frag_id=frag_order.frag_id;
-
-drop table temp.page_order;
-
-drop table temp.page;
-
--- write_splits_sql
+-- create_implicit_output_sql
 create table main.splits (
     id integer primary key,
-    head integer,
+    frag integer,
+    crc integer,
     tail integer
 );
 
-insert into main.splits (id, head, tail)
-    select split_id,
-            (select f0.final_id from temp.frag f0
-                 where f0.split_id=s.split_id
-                 order by f0.frag_id
-                 limit 1),
-            (select f1.final_id from temp.frag f1
-                 where f1.split_id=s.split_id
-                 order by f1.frag_id
-                 limit 1
-                 offset 1)
-        from temp.split s
-        order by split_id;
-
-drop table temp.split;
-
--- write_frags_sql
 create table main.frags (
     id integer primary key,
     val blob not null
 );
 
+-- add_slice_columns_sql
+alter table main.splits add column offset integer;
+alter table main.splits add column size integer;
+
+-- create_names_sql
+create table if not exists main.names (
+    id integer primary key,
+    name text not null
+);
+
+-- previous_layout_sql
+select exists (select 1 from pragma_table_info('splits', 'main')
+                   where name='frag'),
+       (select coalesce(max(id), 0) from main.frags),
+       exists (select 1 from pragma_table_info('splits', 'main')
+                   where name='offset');
+
+-- list_previous_sql
+select s.id, s.head, s.tail, s.crc,
+       (select length(val) from main.frags where frags.id=s.head),
+       (select length(val) from main.frags where frags.id=s.tail)
+    from main.splits as s
+    order by s.id;
+
+-- list_previous_names_sql
+select id, name from main.names
+    where id between ?1 and ?2;
+
+-- previous_max_id_sql
+select coalesce(max(id), ?1-1) from main.splits
+    where id between ?1 and ?2;
+
+-- list_previous_implicit_sql
+select s.id, s.head, s.tail, s.crc,
+       (select length(val) from main.frags where frags.id=s.head),
+       (select length(val) from main.frags where frags.id=s.tail)
+    from (select id,
+                 case frag&3
+                     when 2 then (frag>>2)+1
+                     else frag>>2
+                 end as head,
+                 case frag&3
+                     when 0 then null
+                     when 1 then (frag>>2)+1
+                     when 2 then frag>>2
+                     else tail
+                 end as tail,
+                 crc
+              from main.splits) as s
+    order by s.id;
+
+-- find_output_sql
+select count(*) from main.sqlite_schema
+    where type='table' and name='frags';
+
+-- resume_point_sql
+select (select coalesce(max(id), 0) from main.frags),
+       exists (select 1 from main.splits);
+
+-- list_written_frags_sql
+select id, val from main.frags
+    where id<=?1
+    order by id;
+
+-- insert_frag_sql
 insert into main.frags (id, val)
-    select f.final_id, substr(s.val, f."offset"+1, f.size)
-        from temp.frag f,
-            source.blobs s on s.id=f.split_id
-        order by f.final_id;
+    values (?1, ?2);
 
-drop table temp.frag;
+-- insert_split_sql
+insert into main.splits (id, head, tail, crc)
+    values (?1, ?2, ?3, ?4);
+
+-- insert_implicit_split_sql
+insert into main.splits (id, frag, crc, tail)
+    values (?1, ?2, ?3, ?4);
+
+-- insert_sliced_split_sql
+insert into main.splits (id, head, tail, crc, offset, size)
+    values (?1, ?2, ?3, ?4, ?5, ?6);
+
+-- insert_sliced_implicit_split_sql
+insert into main.splits (id, frag, crc, tail, offset, size)
+    values (?1, ?2, ?3, ?4, ?5, ?6);
+
+-- insert_name_sql
+insert into main.names (id, name)
+    values (?1, ?2);
+
+-- upsert_split_sql
+insert into main.splits (id, head, tail, crc)
+    values (?1, ?2, ?3, ?4)
+    on conflict (id) do update
+        set head=excluded.head, tail=excluded.tail, crc=excluded.crc
+        where head is not excluded.head
+            or tail is not excluded.tail
+            or crc is not excluded.crc;
+
+-- upsert_implicit_split_sql
+insert into main.splits (id, frag, crc, tail)
+    values (?1, ?2, ?3, ?4)
+    on conflict (id) do update
+        set frag=excluded.frag, crc=excluded.crc, tail=excluded.tail
+        where frag is not excluded.frag
+            or crc is not excluded.crc
+            or tail is not excluded.tail;
+
+-- upsert_name_sql
+insert into main.names (id, name)
+    values (?1, ?2)
+    on conflict (id) do update
+        set name=excluded.name
+        where name is not excluded.name;
+
+-- delete_frag_sql
+delete from main.frags
+    where id=?1;
+
+-- delete_split_sql
+delete from main.splits
+    where id=?1;
+
+-- find_names_sql
+select count(*) from main.sqlite_schema
+    where type='table' and name='names';
+
+-- delete_stale_names_sql
+delete from main.names
+    where id not in (select id from main.splits);
 
 -- commit_sql
 commit transaction;
 
+-- create_manifest_sql
+begin immediate transaction;
+
+create table main.shards (
+    id integer primary key,
+    path text not null,
+    lo integer not null,
+    hi integer not null
+);
+
+-- insert_shard_sql
+insert into main.shards (id, path, lo, hi)
+    values (?1, ?2, ?3, ?4);
+
@@ -0,0 +1,140 @@
+static char const attach_sql[] =
+    "attach database ?1 as source;\n";
+
+static char const get_page_size_sql[] =
+    "pragma source.page_size;\n";
+
+static char const set_page_size_fmt[] =
+    "pragma page_size=%u;\n";
+
+static char const begin_sql[] =
+    "begin immediate transaction;\n";
+
+static char const create_blob_sql[] =
+    "create table main.blobs (\n"
+    "    id integer primary key,\n"
+    "    val blob\n"
+    ");\n";
+
+static char const find_manifest_sql[] =
+    "select count(*) from source.sqlite_schema\n"
+    "    where type='table' and name='shards';\n";
+
+static char const list_shards_sql[] =
+    "select path, lo, hi from source.shards\n"
+    "    order by lo;\n";
+
+static char const detach_sql[] =
+    "detach database source;\n";
+
+static char const find_layout_sql[] =
+    "select exists (select 1 from pragma_table_info('splits', 'source')\n"
+    "                   where name='frag'),\n"
+    "       exists (select 1 from pragma_table_info('splits', 'source')\n"
+    "                   where name='offset'),\n"
+    "       exists (select 1 from pragma_table_info('splits', 'source')\n"
+    "                   where name='crc');\n";
+
+static char const extract_frags_fmt[] =
+    "select s.id, h.val, t.val, %s, %s\n"
+    "    from source.splits s\n"
+    "        left join source.frags h on h.id=s.head\n"
+    "        left join source.frags t on t.id=s.tail\n"
+    "    order by s.id;\n";
+
+static char const extract_implicit_fmt[] =
+    "select s.id, f1.val, f2.val, %s, %s, s.frag&3\n"
+    "    from source.splits s\n"
+    "        left join source.frags f1 on f1.id=s.frag>>2\n"
+    "        left join source.frags f2\n"
+    "            on f2.id=case s.frag&3\n"
+    "                         when 1 then (s.frag>>2)+1\n"
+    "                         when 2 then (s.frag>>2)+1\n"
+    "                         when 3 then s.tail\n"
+    "                     end\n"
+    "    order by s.id;\n";
+
+static char const create_selection_sql[] =
+    "create temp table wanted (\n"
+    "    id integer primary key\n"
+    ");\n"
+    "create temp table picked (\n"
+    "    id integer primary key\n"
+    ");\n";
+
+static char const insert_wanted_sql[] =
+    "insert or ignore into temp.wanted (id)\n"
+    "    values (?1);\n";
+
+static char const wanted_bounds_sql[] =
+    "select min(id), max(id) from temp.wanted;\n";
+
+static char const clear_picked_sql[] =
+    "delete from temp.picked;\n";
+
+static char const pick_splits_fmt[] =
+    "insert into temp.picked (id)\n"
+    "    select id from source.splits\n"
+    "        where id between ?1 and ?2\n"
+    "            and (?3 or id in temp.wanted)\n"
+    "            and (%s);\n";
+
+static char const extract_picked_frags_fmt[] =
+    "select s.id, h.val, t.val, %s, %s\n"
+    "    from temp.picked p\n"
+    "        join source.splits s on s.id=p.id\n"
+    "        left join source.frags h on h.id=s.head\n"
+    "        left join source.frags t on t.id=s.tail\n"
+    "    order by s.head;\n";
+
+static char const extract_picked_implicit_fmt[] =
+    "select s.id, f1.val, f2.val, %s, %s, s.frag&3\n"
+    "    from temp.picked p\n"
+    "        join source.splits s on s.id=p.id\n"
+    "        left join source.frags f1 on f1.id=s.frag>>2\n"
+    "        left join source.frags f2\n"
+    "            on f2.id=case s.frag&3\n"
+    "                         when 1 then (s.frag>>2)+1\n"
+    "                         when 2 then (s.frag>>2)+1\n"
+    "                         when 3 then s.tail\n"
+    "                     end\n"
+    "    order by s.frag;\n";
+
+static char const list_splits_fmt[] =
+    "select id, head, tail, %s, %s\n"
+    "    from source.splits s;\n";
+
+static char const list_implicit_splits_fmt[] =
+    "select id,\n"
+    "        case frag&3 when 2 then (frag>>2)+1 else frag>>2 end,\n"
+    "        case frag&3\n"
+    "            when 1 then (frag>>2)+1\n"
+    "            when 2 then frag>>2\n"
+    "            when 3 then tail\n"
+    "        end,\n"
+    "        %s, %s\n"
+    "    from source.splits s;\n";
+
+static char const crc_column_sql[] =
+    "s.crc\n";
+
+static char const no_crc_column_sql[] =
+    "null\n";
+
+static char const slice_columns_sql[] =
+    "s.offset, s.size\n";
+
+static char const no_slice_columns_sql[] =
+    "null, null\n";
+
+static char const scan_frags_sql[] =
+    "select id, val from source.frags\n"
+    "    order by id;\n";
+
+static char const insert_blob_sql[] =
+    "insert into main.blobs (id, val)\n"
+    "    values (?1, ?2);\n";
+
+static char const commit_sql[] =
+    "commit transaction;\n";
+
@@ -16,13 +16,121 @@ create table main.blobs (
     val blob
 );
 
--- extract_frags_sql
-select s.id, h.val, t.val
+-- find_manifest_sql
+select count(*) from source.sqlite_schema
+    where type='table' and name='shards';
+
+-- list_shards_sql
+select path, lo, hi from source.shards
+    order by lo;
+
+-- detach_sql
+detach database source;
+
+-- find_layout_sql
+select exists (select 1 from pragma_table_info('splits', 'source')
+                   where name='frag'),
+       exists (select 1 from pragma_table_info('splits', 'source')
+                   where name='offset'),
+       exists (select 1 from pragma_table_info('splits', 'source')
+                   where name='crc');
+
+-- extract_frags_fmt
+select s.id, h.val, t.val, %s, %s
     from source.splits s
         left join source.frags h on h.id=s.head
         left join source.frags t on t.id=s.tail
     order by s.id;
 
+-- extract_implicit_fmt
+select s.id, f1.val, f2.val, %s, %s, s.frag&3
+    from source.splits s
+        left join source.frags f1 on f1.id=s.frag>>2
+        left join source.frags f2
+            on f2.id=case s.frag&3
+                         when 1 then (s.frag>>2)+1
+                         when 2 then (s.frag>>2)+1
+                         when 3 then s.tail
+                     end
+    order by s.id;
+
+-- create_selection_sql
+create temp table wanted (
+    id integer primary key
+);
+create temp table picked (
+    id integer primary key
+);
+
+-- insert_wanted_sql
+insert or ignore into temp.wanted (id)
+    values (?1);
+
+-- wanted_bounds_sql
+select min(id), max(id) from temp.wanted;
+
+-- clear_picked_sql
+delete from temp.picked;
+
+-- pick_splits_fmt
+insert into temp.picked (id)
+    select id from source.splits
+        where id between ?1 and ?2
+            and (?3 or id in temp.wanted)
+            and (%s);
+
+-- extract_picked_frags_fmt
+select s.id, h.val, t.val, %s, %s
+    from temp.picked p
+        join source.splits s on s.id=p.id
+        left join source.frags h on h.id=s.head
+        left join source.frags t on t.id=s.tail
+    order by s.head;
+
+-- extract_picked_implicit_fmt
+select s.id, f1.val, f2.val, %s, %s, s.frag&3
+    from temp.picked p
+        join source.splits s on s.id=p.id
+        left join source.frags f1 on f1.id=s.frag>>2
+        left join source.frags f2
+            on f2.id=case s.frag&3
+                         when 1 then (s.frag>>2)+1
+                         when 2 then (s.frag>>2)+1
+                         when 3 then s.tail
+                     end
+    order by s.frag;
+
+-- list_splits_fmt
+select id, head, tail, %s, %s
+    from source.splits s;
+
+-- list_implicit_splits_fmt
+select id,
+        case frag&3 when 2 then (frag>>2)+1 else frag>>2 end,
+        case frag&3
+            when 1 then (frag>>2)+1
+            when 2 then frag>>2
+            when 3 then tail
+        end,
+        %s, %s
+    from source.splits s;
+
+-- crc_column_sql
+s.crc
+
+-- no_crc_column_sql
+null
+
+-- slice_columns_sql
+s.offset, s.size
+
+-- no_slice_columns_sql
+null, null
+
+-- scan_frags_sql
+select id, val from source.frags
+    order by id;
+
 -- insert_blob_sql
 insert into main.blobs (id, val)
     values (?1, ?2);